@@ -0,0 +1,142 @@
+#ifndef _BLOCK_INTERNAL_H_
+#define _BLOCK_INTERNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "block.h"
+
+/* shared between block.c (device / image) and block_alloc.c (free space) */
+
+/* block.c */
+uint8_t *block_ptr(int blkno);     /* mmap backend only: pointer into the map */
+int      block_valid(int blkno);
+void     block_claim(int start, size_t n);  /* just allocated, see block.c */
+void     block_bitmap_dirty(size_t word);   /* bitmap word changed, save it */
+void     block_io_retire(int blkno, size_t n);  /* async transfer finished */
+/* checksums (no-ops without them): the block as it now is on the device */
+void     block_csum_write(int blkno, const void *buf);
+int      block_csum_check(int blkno, const void *buf);  /* -1 = mismatch */
+int      block_csum_match(int blkno, const void *buf);  /* ... without counting it */
+void     block_lzmap_dirty(size_t blk);     /* compression map entry changed */
+void     block_dedup_dirty(size_t blk);     /* dedup table entry changed */
+int      block_unref(int blkno);            /* 1 = still shared, keep it */
+
+/* block_alloc.c: bitmap lives inside the image, 1 bit per block, 1 = used */
+#define BITMAP_WORD_BITS 64
+#define BITMAP_WORDS(n)  (((size_t)(n) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+static inline unsigned bit_ctz64(uint64_t v)
+{
+#if defined(__GNUC__)
+    return (unsigned)__builtin_ctzll(v);
+#else
+    unsigned n = 0;
+    while (!(v & 1)) { v >>= 1; n++; }
+    return n;
+#endif
+}
+
+void balloc_attach(uint64_t *bitmap, size_t block_count);
+void balloc_detach(void);
+int  balloc_test(size_t blk);   /* 1 = allocated */
+
+/* block_cache.c: buffer cache for the file backend */
+#define BLOCK_CACHE_MIN  8
+#define BCACHE_NOREAD    0x1     /* caller overwrites the whole block */
+#define BCACHE_DIRTY     0x2
+#define BCACHE_CACHED    0x4     /* hit only: NULL instead of loading */
+
+int      bcache_init(int fd, size_t bsize, uint64_t data_off, size_t nslots);
+void     bcache_destroy(void);
+uint8_t *bcache_get(int blkno, int flags);   /* pinned until bcache_put */
+void     bcache_put(int blkno);
+void     bcache_discard(int blkno);          /* drop without writeback */
+int      bcache_peek(int blkno, void *buf);          /* copy out if cached */
+int      bcache_update(int blkno, const void *buf);  /* copy in if cached */
+int      bcache_flush_queue(void);           /* queue every dirty slot on bio */
+int      bcache_flush(void);                 /* ... and wait for them */
+int      bcache_sync(int blkno);             /* write back one block if dirty */
+/* readahead: fill slots for blocks [blkno, blkno+n) with one queued read,
+ * n <= BCACHE_FILL_MAX. Returns how many blocks got slots (0 when all are
+ * pinned); the slots are pinned and wait their load out on any access. */
+#define BCACHE_FILL_MAX  32
+size_t   bcache_prefetch(int blkno, size_t n);
+int      bcache_cached(int blkno);           /* 1 = held, loaded or loading */
+size_t   bcache_slots(void);
+
+/* block_io.c: I/O engine for the file backend, io_uring or pread/pwrite.
+ * done() runs on completion, possibly before bio_queue returns. */
+int      bio_init(int fd, size_t bsize, uint64_t data_off, unsigned depth);
+void     bio_destroy(void);
+const char *bio_engine(void);
+int      bio_queue(int write, int blkno, size_t nblk, void *buf,
+                   block_io_done done, void *arg);
+int      bio_queue_v(int write, int blkno, size_t nblk, const struct iovec *iov, int cnt,
+                     block_io_done done, void *arg);   /* iov stays valid until done */
+/* a read nobody waits for (readahead): its failure reaches done() only,
+ * not the next bio_wait() */
+int      bio_queue_hint(int blkno, size_t nblk, const struct iovec *iov, int cnt,
+                        block_io_done done, void *arg);
+int      bio_queue_at(int write, uint64_t off, size_t len, void *buf,
+                      block_io_done done, void *arg);   /* raw, not block data */
+int      bio_submit(void);                   /* start what is queued, don't wait */
+void     bio_drain(void);                    /* wait for everything in flight */
+/* wait for all but readahead; -1 if anything failed since */
+int      bio_wait(void);
+size_t   bio_inflight(void);                 /* not counting readahead */
+
+/* block_lz.c: compressed storage for IMG_F_LZ images, used by the cache
+ * in place of plain block reads and writes. One map entry per logical
+ * block, stored in the image; all zero = not stored (reads as zeros). */
+struct blz_ent
+{
+    uint32_t unit;      /* first unit in the data area */
+    uint16_t len;       /* compressed bytes */
+    uint16_t flags;     /* BLZ_RAW: stored uncompressed, a whole block */
+};
+#define BLZ_RAW 0x1
+
+int      blz_init(int fd, size_t bsize, uint64_t data_off, size_t phys_blocks,
+                  struct blz_ent *map, size_t count);   /* -1: bad map */
+void     blz_destroy(void);
+int      blz_active(void);
+int      blz_read(int blkno, void *buf, void *scratch); /* scratch: bsize or NULL */
+int      blz_write(int blkno, const void *buf);
+void     blz_unmap(int blkno);              /* reads as zeros, frees storage */
+void     blz_commit(void);                  /* map is on disk: reuse old units */
+size_t   blz_stored_bytes(void);
+/* copy the blocks keep() accepts into fd's data area, densely packed,
+ * and describe them in out[] */
+int      blz_copy_packed(int fd, uint64_t data_off, struct blz_ent *out,
+                         int (*keep)(size_t blk));
+
+/* block_dedup.c: content index for IMG_F_DEDUP images. One entry per
+ * block, stored in the image: refs counts the references beyond the
+ * first (0 = private), BDD_INDEXED marks blocks findable by content. */
+struct bdd_ent
+{
+    uint32_t hash;      /* CRC32C of the contents, when indexed */
+    uint32_t refs;
+};
+#define BDD_INDEXED 0x80000000u
+
+/* index 0: reference counts only (IMG_F_REFS) */
+int      bdd_init(struct bdd_ent *tab, size_t count, int index); /* -1: no index (no memory) */
+void     bdd_destroy(void);
+int      bdd_first(uint32_t hash);          /* indexed blocks with this hash, -1 = none */
+int      bdd_next(int blk, uint32_t hash);
+void     bdd_insert(int blk, uint32_t hash);
+void     bdd_remove(int blk);
+uint32_t bdd_refs(int blk);
+void     bdd_ref(int blk);
+int      bdd_unref(int blk);                /* 1 = was shared, one reference gone */
+size_t   bdd_saved_blocks(void);
+
+/* block_stat.c: counters behind block_stats_get(), per thread */
+uint64_t bstat_now(void);                       /* ns, start of a timed call */
+void     bstat_op(int op, uint64_t t0, size_t bytes);   /* t0 0 = not timed */
+void     bstat_cache(int hit);
+void     bstat_alloc_failed(void);
+
+#endif /* _BLOCK_INTERNAL_H_ */
@@ -22,9 +22,35 @@
 /* mode bits done */
 
 #define DIRECT_BLOCKS 12
+/* i_block[] after the direct pointers, as in ext2: an indirect block
+ * (block numbers of data blocks) and a double indirect block (block
+ * numbers of indirect blocks); see vfs_bmap.c */
+#define IND_BLOCK     DIRECT_BLOCKS
+#define DIND_BLOCK    (DIRECT_BLOCKS + 1)
+#define N_BLOCKS      (DIRECT_BLOCKS + 2)
+
+/* an extent-mapped inode reuses i_block[]: I_EXTENTS in slot 0, then the
+ * extent count, the extent block (-1: the extents are inline) and up to
+ * EXT_INLINE inline extents of (logical start, physical start, length) */
+#define I_EXTENTS     (-2)
+#define EXT_COUNT     1
+#define EXT_BLOCK     2
+#define EXT_FIRST     3
+#define EXT_INLINE    ((N_BLOCKS - EXT_FIRST) / 3)
+
+/* a file of at most INLINE_MAX bytes keeps them in i_block[], after
+ * I_INLINE in slot 0, and has no block at all */
+#define I_INLINE      (-3)
+#define INLINE_MAX    ((N_BLOCKS - 1) * sizeof(int32_t))
 
 struct super_block;
 
+struct extent {
+  uint32_t e_lblk;   /* first logical block */
+  int32_t  e_pblk;   /* where it is on the device */
+  uint32_t e_len;    /* blocks */
+};
+
 typedef enum {
   FS_INODE_FILE = 1,
   FS_INODE_DIR  = 2,
@@ -41,7 +67,17 @@ struct inode {
   size_t          i_size;    /* file size in bytes */
   uint64_t        i_mtime;   /* epoch time */
 
-  int             i_block[DIRECT_BLOCKS]; /* direct blocks, -1 means none */
+  int             i_block[N_BLOCKS]; /* -1 means none */
+  int            *i_map;             /* cached block map, NULL until looked up */
+  size_t          i_map_len;
+  struct extent  *i_ext;             /* cached extents, NULL until looked up */
+  size_t          i_ext_len;         /* extents in i_ext */
+
+  /* inode cache (icache.c) */
+  uint32_t        i_count;           /* pins: not evicted while > 0 */
+  int             i_dirty;           /* changed since the table was written */
+  struct inode   *i_hnext;           /* hash chain */
+  struct inode   *i_lprev, *i_lnext; /* LRU list, most recent first */
 
   struct super_block *i_sb;
 };
@@ -1,8 +1,41 @@
 #ifndef _META_H_
 #define _META_H_
+#include <stdint.h>
+
 #define META_RESERVED_BLOCKS 16
 
-int meta_load(void);
-int meta_save(void);
+struct dentry;
+
+int meta_load(void);    /* table, then journal replay (and a sweep after a crash) */
+int meta_save(void);    /* checkpoint, marked clean: call at exit */
+int meta_format(void);  /* reserve the meta area on a fresh image */
+
+/* write-ahead journal: after each change to the tree, append a record of
+ * it and make it durable (the file's data blocks first), so a crash loses
+ * at most the change in flight. When the journal fills up the whole table
+ * is checkpointed. No-ops on images without room for a journal. */
+int meta_log_update(const struct dentry *d);    /* d created or rewritten */
+int meta_log_remove(const struct dentry *parent, const char *name);
+
+/* snapshots: the tree frozen under a name. Data is not copied: the
+ * snapshot holds a reference to each block (the image's dedup table
+ * counts them, so the image needs one), and the live tree's next write
+ * to a file goes to new blocks. Rollback makes the live tree a copy of
+ * the snapshot, which stays. */
+#define META_SNAP_NAME 32
+
+struct meta_snapshot
+{
+    char     name[META_SNAP_NAME];
+    uint64_t created;           /* time(NULL) */
+    uint32_t entries;           /* files and directories */
+    uint32_t blocks;            /* data blocks referenced */
+};
+
+int meta_snapshot_create(const char *name);
+int meta_snapshot_delete(const char *name);
+int meta_snapshot_rollback(const char *name);
+int meta_snapshot_count(void);
+int meta_snapshot_get(int i, struct meta_snapshot *out);
 
-#endif /* _META_H_ */
\ No newline at end of file
+#endif /* _META_H_ */
@@ -1,6 +1,9 @@
 #ifndef _VFS_INTERNAL_H_
 #define _VFS_INTERNAL_H_
 
+#include <stdio.h>
+#include <stdint.h>
+
 #include "super.h"
 #include "inode.h"
 #include "dentry.h"
@@ -17,6 +20,88 @@ int  dentry_remove_child(struct dentry *parent, struct dentry *child);
 fs_uid_t fs_get_uid(void);     // get current user id
 void fs_set_uid(fs_uid_t uid);
 struct dentry *dentry_find_child(struct dentry *parent, const char *name);
+int  dentry_block_group(const struct dentry *dent);
+int  vfs_open_files(void);     /* fds open (vfs_fd.c) */
+/* inode table and cache (icache.c) */
+#define ROOT_INO 1
+struct inode *d_inode(const struct dentry *d);      /* NULL if it has none */
+struct inode *inode_get(fs_ino_t ino);              /* cached, or read from the table */
+struct inode *inode_new(fs_inode_type_t type);      /* a free number; NULL if none is left */
+struct inode *inode_new_at(fs_ino_t ino, fs_inode_type_t type); /* that number (or its cached inode) */
+void inode_delete(struct inode *inode);             /* number freed; blocks are the caller's */
+void inode_mark_dirty(struct inode *inode);
+void inode_hold(struct inode *inode);               /* pin in the cache */
+void inode_put(struct inode *inode);
+int  inode_claim(fs_ino_t ino);                     /* in use: rebuilding the bitmap at load */
+int  icache_setup(uint32_t count, uint32_t max);    /* numbers 1..max-1 free, count with records */
+int  icache_set_table(int start, uint32_t count);
+uint32_t icache_table_need(void);                   /* records the numbers in use need */
+size_t icache_table_blocks(uint32_t count);
+int  icache_flush(void);                            /* dirty inodes to the table, synced */
+
+/* block maps (vfs_bmap.c) */
+size_t inode_max_blocks(void);      /* direct + indirect + double indirect */
+void inode_init_blocks(struct inode *inode);    /* no blocks, no map */
+void inode_release(struct inode *inode);        /* free it and its cached map */
+/* take over pointers (N_BLOCKS of them, NULL = none) without touching blocks */
+void inode_set_ptrs(struct inode *inode, const int32_t *ptrs);
+/* the whole map, one entry per block of i_size: read once, then cached */
+int  inode_bmap(struct inode *inode, const int **map, size_t *count);
+/* device block of logical block lblk, -1 if there is none; a binary
+ * search of the extents for an extent-mapped inode */
+int  inode_lookup(struct inode *inode, size_t lblk);
+/* some block of the file, for placing its neighbours; -1 if it has none */
+int  inode_first_block(const struct inode *inode);
+/* inline data (I_INLINE): the bytes live in i_block[]; an inline inode
+ * has no map, inode_bmap() and inode_lookup() fail on it */
+int  inode_is_inline(const struct inode *inode);
+const uint8_t *inode_inline_data(const struct inode *inode);
+/* data[0..len) as inline data, len <= INLINE_MAX; like inode_set_ptrs,
+ * the blocks it had are the caller's to free first */
+int  inode_set_inline(struct inode *inode, const void *data, size_t len);
+/* n fresh blocks, in as few contiguous runs as the allocator can find,
+ * starting in allocation group `group`; rolls itself back on failure */
+int  inode_alloc_blocks(struct inode *inode, int group, size_t n);
+/* make map[0..n) the file's blocks, as extents when it is contiguous
+ * enough, else as block pointers; writes a new extent block or new
+ * indirect blocks as needed and takes map over. On failure the map's
+ * blocks are freed along with it. */
+int  inode_set_blocks(struct inode *inode, int group, int *map, size_t n);
+/* the same, for a file that already has blocks and keeps those map
+ * names: only the old extent or indirect blocks are freed. On failure
+ * the file is as it was and map is still the caller's. */
+int  inode_remap_blocks(struct inode *inode, int group, int *map, size_t n);
+int  inode_free_blocks(struct inode *inode);
+/* a file's blocks taken out of it while a new map is built in their
+ * place, so a failed rewrite leaves the old contents where the journal
+ * last saw them: save (the file has no blocks, size 0), then restore
+ * on failure (what the file has now is freed) or release on success */
+struct bmap_saved
+{
+  int32_t ptrs[N_BLOCKS];
+  size_t  size;
+};
+void inode_save_blocks(struct inode *inode, struct bmap_saved *old);
+void inode_restore_blocks(struct inode *inode, const struct bmap_saved *old);
+void bmap_release(const struct bmap_saved *old);
+/* fn(blk) for every block the pointers of a file of `size` bytes reach,
+ * data, indirect and extent blocks, each of those after the blocks it
+ * names; stops when fn fails. -1 as well for extents that do not fit
+ * the device or the size. */
+int  bmap_walk(const int32_t *ptrs, size_t size, int (*fn)(int blk, void *arg), void *arg);
+/* 1 if ptrs are well formed for `size` bytes: pointers inside the
+ * device, or extents as bmap_walk wants them (the contents of an extent
+ * block are only checked when it is read) */
+int  bmap_valid(const int32_t *ptrs, size_t size);
+/* blocks per read when streaming a file out (cat, export) */
+#define VFS_STREAM_BLOCKS 8
+/* blocks per read + write when cp copies data */
+#define VFS_COPY_BLOCKS   256
+int  inode_read_to_file(struct inode *inode, FILE *fp);
+/* buf[0..len) at offset off, the file growing as needed (a gap reads as
+ * zeros); only the blocks those bytes fall in are read or written. The
+ * caller checks permissions and logs the change. */
+int  inode_pwrite(struct inode *inode, int group, const void *buf, size_t len, size_t off);
 
 
 #endif /* _VFS_INTERNAL_H_ */
@@ -1,176 +1,2461 @@
+#define _GNU_SOURCE /* MAP_ANONYMOUS, pread / pwrite, fallocate */
+
 /*standard lib */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <time.h>
 /*standard lib done*/
 
 #include "block.h"
+#include "block_internal.h"
+#include "crc32c.h"
 
+#define IMG_MAGIC   0x56465331u /* 'VFS1' */
+#define IMG_VERSION 4           /* 0/1 = byte-per-block bitmap (upgraded on load)
+                                 * 2 = no flags; 3 = flags, optional checksums;
+                                 * 4 = 128 byte header, dedup table */
 
-/* RAM BLOCK Device (temp) */
-static uint8_t block_data[BLOCK_COUNT][BLOCK_SIZE];
-static uint8_t block_bitmap[BLOCK_COUNT]; /* 0 = free, 1 = used */
-/* RAM BLOCK Device (temp) */
+typedef struct {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t version;           /* was reserved (always 0) before geometry */
+    /* v2+ */
+    uint64_t bitmap_off;        /* byte offsets inside the image */
+    uint64_t data_off;
+    /* v3+ (zero in v2) */
+    uint32_t flags;             /* IMG_F_* */
+    uint32_t reserved0;
+    uint64_t csum_off;          /* IMG_F_CSUM: one CRC32C per block */
+    uint64_t map_off;           /* IMG_F_LZ: one struct blz_ent per block */
+    uint32_t phys_blocks;       /* IMG_F_LZ: size of the data area */
+    uint32_t reserved1;
+    /* v4+ (zero before) */
+    uint64_t dedup_off;         /* IMG_F_DEDUP / IMG_F_REFS: one struct bdd_ent per block */
+    uint32_t reserved[14];
+} img_hdr_t;
 
-/* define function */
-int block_init(void)
+#define IMG_F_CSUM      0x1u
+#define IMG_F_LZ        0x2u    /* blocks stored compressed, see block_lz.c */
+#define IMG_F_DEDUP     0x4u    /* shared blocks, see block_dedup.c (v4+) */
+#define IMG_F_REFS      0x8u    /* shared blocks, no content index (v4+) */
+#define IMG_F_SHARED    (IMG_F_DEDUP | IMG_F_REFS)
+#define IMG_F_KNOWN     (IMG_F_CSUM | IMG_F_LZ | IMG_F_DEDUP | IMG_F_REFS)
+
+/* disk.img layout: header | bitmap (1 bit per block) | [checksums] |
+ * [compression map] | [dedup table] | pad | data blocks. The data area is aligned to
+ * max(block size, page) so a block never straddles more pages than it has
+ * to. block_count is the logical size; a compressed image's data area
+ * holds only phys_blocks blocks' worth of units. */
+#define IMG_ALIGN_MIN   4096u
+#define IMG_LEGACY_HDR  16u     /* v0/v1 header size */
+#define IMG_V3_HDR      64u
+
+/* BLOCK Device
+ * mmap backend: the whole image is mapped once; the bitmap and data area
+ *               point into it. g_fd < 0 means an anonymous (not yet saved)
+ *               device.
+ * file backend: blocks stay in disk.img and go through the buffer cache
+ *               (block_cache.c); only the bitmap is held in memory. */
+static int      g_next_backend = BLOCK_BACKEND_MMAP;   /* for the next attach */
+static int      g_next_csum    = 1;                    /* for the next format */
+static unsigned g_next_lz      = 0;                    /* ... logical per physical */
+static int      g_next_dedup   = 0;
+static int      g_next_refs    = 0;
+static size_t   g_cache_blocks = BLOCK_CACHE_DEFAULT;
+static unsigned g_queue_depth  = BLOCK_QUEUE_DEPTH_DEFAULT;
+
+static int      g_backend = BLOCK_BACKEND_MMAP;
+static img_hdr_t g_hdr;
+static uint8_t *g_map = NULL;
+static uint64_t *g_bitmap;
+static int      g_fd  = -1;
+static char     g_path[256];
+
+static size_t   g_block_size  = BLOCK_SIZE_DEFAULT;
+static size_t   g_block_count = BLOCK_COUNT_DEFAULT;
+static size_t   g_img_size;
+
+static uint8_t *block_data;
+/* BLOCK Device done */
+
+/* dirty tracking for incremental saves
+ * one bit per item plus a summary bit per 64 items, so a save visits only
+ * the words that were touched instead of walking the whole device.
+ * g_dirty_data: data blocks written through the map (the buffer cache
+ *               tracks its own dirty slots for the file backend)
+ * g_dirty_bm:   allocation bitmap words */
+struct dirty_set
+{
+    uint64_t *bits;
+    uint64_t *sum;
+    size_t    n;
+};
+
+static struct dirty_set g_dirty_data;
+static struct dirty_set g_dirty_bm;
+
+/* unwritten (known-zero) blocks
+ * a set bit means the block reads as zeros whatever its storage holds:
+ * every free block, and allocated blocks nobody has written yet. Reads
+ * of such a block never touch the device; a partial write zeroes it
+ * first, a whole-block write does not.
+ * g_claimed remembers blocks allocated while unwritten, so a save can
+ * give the ones still unwritten real zeros on disk (see block_claim). */
+static uint64_t *g_unwritten;
+static uint8_t  *g_zero_block;      /* what a read pin of an unwritten block sees */
+static struct dirty_set g_claimed;
+static struct dirty_set g_freed;    /* discarded since the last save, see punch_freed */
+
+/* per-block checksums (IMG_F_CSUM)
+ * g_csum holds one CRC32C per block: inside the map (mmap), or a heap copy
+ * written back like the bitmap (file). An entry describes the block as
+ * the image file holds it: the file backend updates it whenever a block
+ * goes to the device, the mmap backend when a save syncs the block.
+ * g_verified marks blocks trusted for this session, checked on their
+ * first read or written by us; only the others pay for a CRC on read. */
+static uint32_t *g_csum;
+static uint64_t *g_verified;
+static struct dirty_set g_dirty_csum;   /* table entries to write back */
+static uint32_t  g_csum_zero;           /* CRC32C of an all-zero block */
+static size_t    g_csum_errors;
+
+/* compression map (IMG_F_LZ, file backend only): held in memory like the
+ * checksums, changed by block_lz.c, written back at save */
+static struct blz_ent *g_lzmap;
+static struct dirty_set g_dirty_lzmap;
+
+/* dedup table (IMG_F_DEDUP, or IMG_F_REFS for the counts alone):
+ * reference counts and content hashes, inside the map (mmap) or a heap
+ * copy (file) like the checksums. block_dedup.c indexes it when dedup is
+ * on; a block with references beyond its first is read only until
+ * block_cow() gives the writer a private copy. */
+static struct bdd_ent *g_ddtab;
+static struct dirty_set g_dirty_ddtab;
+
+/* file backend: blocks with an async transfer in flight. A second one on
+ * the same block waits for the first, the ring does not order them. */
+static uint64_t *g_busy;
+
+static size_t align_up(size_t v, size_t a)
 {
-  // memset(block_data, 0, sizeof(block_data));
-  // memset(block_bitmap, 0, sizeof(block_bitmap));
-  return 0;
+    return (v + a - 1) / a * a;
 }
 
-#include <stdio.h>
-#include <string.h>
-#include <stdint.h>
+static int geometry_valid(size_t bsize, size_t count)
+{
+    if (bsize < BLOCK_SIZE_MIN || bsize > BLOCK_SIZE_MAX) return 0;
+    if (bsize & (bsize - 1)) return 0;      /* power of two */
+    if (count < BLOCK_COUNT_MIN || count > BLOCK_COUNT_MAX) return 0;
+    return 1;
+}
 
-#include "block.h"
+static size_t data_align(size_t bsize)
+{
+    return bsize > IMG_ALIGN_MIN ? bsize : IMG_ALIGN_MIN;
+}
 
-static uint8_t block_data[BLOCK_COUNT][BLOCK_SIZE];
-static uint8_t block_bitmap[BLOCK_COUNT]; /* 0 free, 1 used */
+/* count: logical blocks; phys: blocks in the data area (== count unless
+ * IMG_F_LZ) */
+static void hdr_fill(img_hdr_t *hdr, size_t bsize, size_t count, size_t phys, uint32_t flags)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic       = IMG_MAGIC;
+    hdr->block_size  = (uint32_t)bsize;
+    hdr->block_count = (uint32_t)count;
+    hdr->version     = IMG_VERSION;
+    hdr->flags       = flags;
+    hdr->bitmap_off  = sizeof(img_hdr_t);
 
-#define IMG_MAGIC 0x56465331u /* 'VFS1' */
+    size_t end = hdr->bitmap_off + BITMAP_WORDS(count) * sizeof(uint64_t);
+    if (flags & IMG_F_CSUM)
+    {
+        hdr->csum_off = align_up(end, sizeof(uint64_t));
+        end = hdr->csum_off + count * sizeof(uint32_t);
+    }
+    if (flags & IMG_F_LZ)
+    {
+        hdr->map_off     = align_up(end, sizeof(uint64_t));
+        hdr->phys_blocks = (uint32_t)phys;
+        end = hdr->map_off + count * sizeof(struct blz_ent);
+    }
+    if (flags & IMG_F_SHARED)
+    {
+        hdr->dedup_off = align_up(end, sizeof(uint64_t));
+        end = hdr->dedup_off + count * sizeof(struct bdd_ent);
+    }
+    hdr->data_off = align_up(end, data_align(bsize));
+}
 
-typedef struct {
-    uint32_t magic;
-    uint32_t block_size;
-    uint32_t block_count;
-    uint32_t reserved;
-} img_hdr_t;
+static uint32_t next_flags(void)
+{
+    return (g_next_csum ? IMG_F_CSUM : 0) | (g_next_lz ? IMG_F_LZ : 0) |
+           (g_next_dedup ? IMG_F_DEDUP : 0) | (g_next_refs ? IMG_F_REFS : 0);
+}
 
-int block_reserve(int blkno)
+/* bytes of header a version defines; the rest of img_hdr_t is zero */
+static size_t hdr_size(uint32_t version)
 {
-    if (blkno < 0 || blkno >= (int)BLOCK_COUNT) return -1;
-    block_bitmap[blkno] = 1;
-    return 0;
+    if (version < 3) return offsetof(img_hdr_t, flags);
+    if (version < 4) return IMG_V3_HDR;
+    return sizeof(img_hdr_t);
 }
 
-int block_save_image(const char *filename)
+static size_t phys_blocks(const img_hdr_t *hdr)
 {
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) return -1;
+    return (hdr->flags & IMG_F_LZ) ? hdr->phys_blocks : hdr->block_count;
+}
 
-    img_hdr_t hdr;
-    memset(&hdr, 0, sizeof(hdr));
-    hdr.magic = IMG_MAGIC;
-    hdr.block_size = BLOCK_SIZE;
-    hdr.block_count = BLOCK_COUNT;
+static size_t img_size(const img_hdr_t *hdr)
+{
+    return (size_t)hdr->data_off + phys_blocks(hdr) * (size_t)hdr->block_size;
+}
 
-    /* header */
-    if (fwrite(&hdr, 1, sizeof(hdr), fp) != sizeof(hdr)) { fclose(fp); return -1; }
+static size_t bitmap_bytes(const img_hdr_t *hdr)
+{
+    return BITMAP_WORDS(hdr->block_count) * sizeof(uint64_t);
+}
 
-    /* bitmap */
-    if (fwrite(block_bitmap, 1, BLOCK_COUNT, fp) != BLOCK_COUNT) { fclose(fp); return -1; }
+static size_t csum_bytes(const img_hdr_t *hdr)
+{
+    return (size_t)hdr->block_count * sizeof(uint32_t);
+}
 
-    /* data blocks */
-    size_t total = (size_t)BLOCK_COUNT * (size_t)BLOCK_SIZE;
-    if (fwrite(block_data, 1, total, fp) != total) { fclose(fp); return -1; }
+static size_t lzmap_bytes(const img_hdr_t *hdr)
+{
+    return (size_t)hdr->block_count * sizeof(struct blz_ent);
+}
 
-    fclose(fp);
-    return 0;
+static size_t ddtab_bytes(const img_hdr_t *hdr)
+{
+    return (size_t)hdr->block_count * sizeof(struct bdd_ent);
 }
 
-int block_load_image(const char *filename)
+/* ---------- dirty sets ---------- */
+
+static void dset_free(struct dirty_set *d)
 {
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        /* 第一次沒有檔案很正常 */
+    free(d->bits);
+    free(d->sum);
+    d->bits = NULL;
+    d->sum  = NULL;
+    d->n    = 0;
+}
+
+static int dset_init(struct dirty_set *d, size_t n)
+{
+    d->bits = calloc(BITMAP_WORDS(n), sizeof(uint64_t));
+    d->sum  = calloc(BITMAP_WORDS(BITMAP_WORDS(n)), sizeof(uint64_t));
+    d->n    = n;
+    if (!d->bits || !d->sum)
+    {
+        dset_free(d);
         return -1;
     }
+    return 0;
+}
 
-    img_hdr_t hdr;
-    if (fread(&hdr, 1, sizeof(hdr), fp) != sizeof(hdr)) { fclose(fp); return -1; }
+static inline void dset_mark(struct dirty_set *d, size_t i)
+{
+    if (!d->bits || i >= d->n) return;
 
-    if (hdr.magic != IMG_MAGIC ||
-        hdr.block_size != BLOCK_SIZE ||
-        hdr.block_count != BLOCK_COUNT) {
-        fclose(fp);
-        return -1;
+    size_t w = i / BITMAP_WORD_BITS;
+    d->bits[w] |= (uint64_t)1 << (i % BITMAP_WORD_BITS);
+    d->sum[w / BITMAP_WORD_BITS] |= (uint64_t)1 << (w % BITMAP_WORD_BITS);
+}
+
+/* for sets that allocating threads mark concurrently (block_alloc.c) */
+static inline void dset_mark_atomic(struct dirty_set *d, size_t i)
+{
+    if (!d->bits || i >= d->n) return;
+
+    size_t w = i / BITMAP_WORD_BITS;
+    __atomic_fetch_or(&d->bits[w], (uint64_t)1 << (i % BITMAP_WORD_BITS), __ATOMIC_RELAXED);
+    __atomic_fetch_or(&d->sum[w / BITMAP_WORD_BITS], (uint64_t)1 << (w % BITMAP_WORD_BITS),
+                      __ATOMIC_RELAXED);
+}
+
+static inline int dset_test(const struct dirty_set *d, size_t i)
+{
+    if (!d->bits || i >= d->n) return 0;
+    return (d->bits[i / BITMAP_WORD_BITS] >> (i % BITMAP_WORD_BITS)) & 1;
+}
+
+/* first dirty item >= i, or d->n */
+static size_t dset_next(const struct dirty_set *d, size_t i)
+{
+    size_t nw = BITMAP_WORDS(d->n);
+    size_t w  = i / BITMAP_WORD_BITS;
+    if (i >= d->n) return d->n;
+
+    uint64_t v = d->bits[w] & (~(uint64_t)0 << (i % BITMAP_WORD_BITS));
+    if (v) return w * BITMAP_WORD_BITS + bit_ctz64(v);
+
+    /* skip clean words through the summary */
+    for (w++; w < nw; )
+    {
+        size_t s = w / BITMAP_WORD_BITS;
+        uint64_t sv = d->sum[s] & (~(uint64_t)0 << (w % BITMAP_WORD_BITS));
+        if (!sv)
+        {
+            w = (s + 1) * BITMAP_WORD_BITS;
+            continue;
+        }
+        w = s * BITMAP_WORD_BITS + bit_ctz64(sv);
+        if (d->bits[w]) return w * BITMAP_WORD_BITS + bit_ctz64(d->bits[w]);
+        w++;
+    }
+    return d->n;
+}
+
+static void dset_clear(struct dirty_set *d)
+{
+    size_t ns = BITMAP_WORDS(BITMAP_WORDS(d->n));
+    for (size_t s = 0; s < ns; s++)
+    {
+        for (uint64_t sv = d->sum[s]; sv; sv &= sv - 1)
+        {
+            d->bits[s * BITMAP_WORD_BITS + bit_ctz64(sv)] = 0;
+        }
+        d->sum[s] = 0;
+    }
+}
+
+/* hand every dirty run to out(first, n); runs closer than `gap` clean
+ * items are merged into one call. Clears the set if all calls succeed. */
+static int dset_flush(struct dirty_set *d, size_t gap, int (*out)(size_t first, size_t n))
+{
+    if (!d->bits) return -1;
+
+    int rc = 0;
+    size_t i = dset_next(d, 0);
+    while (i < d->n)
+    {
+        size_t start = i;
+        size_t end   = i + 1;
+        while ((i = dset_next(d, end)) < d->n && i <= end + gap)
+        {
+            end = i + 1;
+        }
+        if (out(start, end - start) != 0) rc = -1;
     }
 
-    if (fread(block_bitmap, 1, BLOCK_COUNT, fp) != BLOCK_COUNT) { fclose(fp); return -1; }
+    if (rc == 0) dset_clear(d);
+    return rc;
+}
+
+void block_bitmap_dirty(size_t word)
+{
+    dset_mark_atomic(&g_dirty_bm, word);
+}
 
-    size_t total = (size_t)BLOCK_COUNT * (size_t)BLOCK_SIZE;
-    if (fread(block_data, 1, total, fp) != total) { fclose(fp); return -1; }
+void block_lzmap_dirty(size_t blk)
+{
+    dset_mark(&g_dirty_lzmap, blk);
+}
 
-    fclose(fp);
-    return 0;
+void block_dedup_dirty(size_t blk)
+{
+    dset_mark(&g_dirty_ddtab, blk);
 }
 
+/* ---------- unwritten blocks ---------- */
 
-size_t block_total_blocks(void)
+/* allocating and freeing threads touch neighbouring bits: atomic */
+static inline int unwritten_test(size_t blk)
 {
-  return (size_t)BLOCK_COUNT;
+    return (__atomic_load_n(&g_unwritten[blk / BITMAP_WORD_BITS], __ATOMIC_RELAXED) >>
+            (blk % BITMAP_WORD_BITS)) & 1;
 }
 
-size_t block_used_blocks(void)
+static inline void unwritten_set(size_t blk)
 {
-  size_t used = 0;
-  for(size_t i = 0; i < BLOCK_COUNT; i++)
-  {
-    if (block_bitmap[i])
-    used++;
- }
-  return used;
+    __atomic_fetch_or(&g_unwritten[blk / BITMAP_WORD_BITS],
+                      (uint64_t)1 << (blk % BITMAP_WORD_BITS), __ATOMIC_RELAXED);
 }
 
-size_t block_free_blocks(void)
+static inline void unwritten_clear(size_t blk)
 {
-  return block_total_blocks() - block_used_blocks();
+    __atomic_fetch_and(&g_unwritten[blk / BITMAP_WORD_BITS],
+                       ~((uint64_t)1 << (blk % BITMAP_WORD_BITS)), __ATOMIC_RELAXED);
 }
 
-size_t block_total_size(void)
+/* ---------- checksums ---------- */
+
+static inline int verified_test(size_t blk)
+{
+    return (g_verified[blk / BITMAP_WORD_BITS] >> (blk % BITMAP_WORD_BITS)) & 1;
+}
+
+static inline void verified_set(size_t blk)
+{
+    g_verified[blk / BITMAP_WORD_BITS] |= (uint64_t)1 << (blk % BITMAP_WORD_BITS);
+}
+
+/* reading this block still owes a checksum comparison */
+static inline int needs_check(size_t blk)
+{
+    return g_csum && !verified_test(blk) && !unwritten_test(blk);
+}
+
+/* contents written this session are trusted */
+static inline void mark_written(size_t blk)
+{
+    unwritten_clear(blk);
+    if (g_verified) verified_set(blk);
+}
+
+static void csum_store(size_t blk, uint32_t c)
+{
+    if (g_csum[blk] == c) return;
+    g_csum[blk] = c;
+    dset_mark(&g_dirty_csum, blk);
+}
+
+void block_csum_write(int blkno, const void *buf)
+{
+    if (!g_csum) return;
+    csum_store((size_t)blkno, crc32c(0, buf, g_block_size));
+}
+
+int block_csum_match(int blkno, const void *buf)
+{
+    if (!needs_check((size_t)blkno)) return 0;
+    if (crc32c(0, buf, g_block_size) != g_csum[blkno]) return -1;
+    verified_set((size_t)blkno);
+    return 0;
+}
+
+int block_csum_check(int blkno, const void *buf)
 {
-  return (size_t)BLOCK_COUNT * (size_t)BLOCK_SIZE;
+    if (block_csum_match(blkno, buf) == 0) return 0;
+    g_csum_errors++;
+    return -1;
 }
 
-size_t block_used_size(void)
+/* ---------- dedup ---------- */
+
+/* a write is about to change the block: a shared one must be copied
+ * first (block_cow), a private one is no longer what its hash says */
+static int dedup_write(int blkno)
+{
+    if (!g_ddtab) return 0;
+    if (bdd_refs(blkno)) return -1;
+    bdd_remove(blkno);
+    return 0;
+}
+
+int block_unref(int blkno)
 {
-  return block_used_blocks() * (size_t)BLOCK_SIZE;
+    if (!g_ddtab) return 0;
+    if (bdd_unref(blkno)) return 1;
+    bdd_remove(blkno);
+    return 0;
 }
 
-size_t block_free_size(void)
+static void block_detach(void)
 {
-  return block_free_blocks() * (size_t)BLOCK_SIZE;
+    balloc_detach();
+    if (g_backend == BLOCK_BACKEND_FILE)
+    {
+        bio_destroy();      /* completions may still unpin cache slots */
+        bcache_destroy();
+        blz_destroy();
+        free(g_lzmap);
+        g_lzmap = NULL;
+        free(g_bitmap);
+        free(g_busy);
+        g_busy = NULL;
+    }
+    if (g_map)
+    {
+        munmap(g_map, g_img_size);
+    }
+    if (g_fd >= 0)
+    {
+        close(g_fd);
+    }
+    dset_free(&g_dirty_data);
+    dset_free(&g_dirty_bm);
+    dset_free(&g_claimed);
+    dset_free(&g_freed);
+    dset_free(&g_dirty_csum);
+    dset_free(&g_dirty_lzmap);
+    dset_free(&g_dirty_ddtab);
+    bdd_destroy();
+    if (!g_map)
+    {
+        free(g_csum);
+        free(g_ddtab);
+    }
+    free(g_verified);
+    free(g_unwritten);
+    free(g_zero_block);
+    g_csum       = NULL;
+    g_verified   = NULL;
+    g_csum_errors = 0;
+    g_ddtab      = NULL;
+    g_unwritten  = NULL;
+    g_zero_block = NULL;
+    g_map = NULL;
+    g_bitmap = NULL;
+    g_fd  = -1;
+    g_path[0] = '\0';
+    block_data = NULL;
+    g_backend = BLOCK_BACKEND_MMAP;
 }
 
-int block_alloc(void)
+/* blocks that lie wholly in a hole of the image file are zeros: mark them
+ * unwritten so reading them never faults a page in or issues a pread.
+ * Costs one lseek pair per hole, not a pass over the data. */
+static void mark_holes(int fd, const img_hdr_t *hdr, uint64_t *unwritten)
 {
-    for (int i = 0; i < BLOCK_COUNT; i++)
+    off_t base = (off_t)hdr->data_off;
+    off_t end  = base + (off_t)hdr->block_count * (off_t)hdr->block_size;
+    off_t bs   = (off_t)hdr->block_size;
+    off_t pos  = base;
+
+    while (pos < end)
     {
-        if (block_bitmap[i] == 0)
+        off_t hole = lseek(fd, pos, SEEK_HOLE);
+        if (hole < 0 || hole >= end) break;     /* no SEEK_HOLE: all data */
+
+        off_t data = lseek(fd, hole, SEEK_DATA);
+        if (data < 0 || data > end) data = end; /* ENXIO: hole to EOF */
+
+        off_t first = (hole - base + bs - 1) / bs;
+        off_t last  = (data - base) / bs;
+        for (off_t b = first; b < last; b++)
         {
-            block_bitmap[i] = 1;
-            memset(block_data[i], 0, BLOCK_SIZE);
-            return i;
+            unwritten[b / BITMAP_WORD_BITS] |= (uint64_t)1 << (b % BITMAP_WORD_BITS);
         }
+        pos = data;
     }
-    return -1; /* full */
 }
 
-void block_free(int blkno)
+/* take over an image whose header is already valid.
+ * map != NULL: mmap backend; map == NULL: file backend on fd */
+static int block_attach(const img_hdr_t *hdr, uint8_t *map, int fd, const char *path)
 {
-    if (blkno < 0 || blkno >= BLOCK_COUNT)
-        return;
+    uint64_t *bitmap;
+    size_t words = BITMAP_WORDS(hdr->block_count);
+
+    if (map)
+    {
+        bitmap = (uint64_t *)(map + hdr->bitmap_off);
+    }
+    else
+    {
+        bitmap = malloc(bitmap_bytes(hdr));
+        if (!bitmap) return -1;
+        if (pread(fd, bitmap, bitmap_bytes(hdr), (off_t)hdr->bitmap_off) !=
+                (ssize_t)bitmap_bytes(hdr)) {
+            free(bitmap);
+            return -1;
+        }
+    }
+
+    /* free blocks are unwritten: whatever a free block holds on disk
+     * (freed but not punched) must read back as zeros */
+    uint64_t *unwritten = malloc(words * sizeof(uint64_t));
+    uint8_t  *zero      = calloc(1, hdr->block_size);
+    uint32_t *csum      = NULL;
+    uint64_t *verified  = NULL;
+    int bad = !unwritten || !zero;
+
+    if (!bad && (hdr->flags & IMG_F_CSUM))
+    {
+        verified = calloc(words, sizeof(uint64_t));
+        if (map)
+        {
+            csum = (uint32_t *)(map + hdr->csum_off);
+        }
+        else if ((csum = malloc(csum_bytes(hdr))) != NULL &&
+                 pread(fd, csum, csum_bytes(hdr), (off_t)hdr->csum_off) !=
+                     (ssize_t)csum_bytes(hdr)) {
+            free(csum);
+            csum = NULL;
+        }
+        bad = !verified || !csum;
+    }
+
+    /* compressed blocks are not at their own offset: holes say nothing,
+     * unmapped entries do */
+    struct blz_ent *lzmap = NULL;
+    if (!bad && (hdr->flags & IMG_F_LZ))
+    {
+        lzmap = malloc(lzmap_bytes(hdr));
+        bad = map || !lzmap ||
+              pread(fd, lzmap, lzmap_bytes(hdr), (off_t)hdr->map_off) != (ssize_t)lzmap_bytes(hdr);
+    }
+
+    struct bdd_ent *ddtab = NULL;
+    if (!bad && (hdr->flags & IMG_F_SHARED))
+    {
+        if (map)
+        {
+            ddtab = (struct bdd_ent *)(map + hdr->dedup_off);
+        }
+        else if ((ddtab = malloc(ddtab_bytes(hdr))) != NULL &&
+                 pread(fd, ddtab, ddtab_bytes(hdr), (off_t)hdr->dedup_off) !=
+                     (ssize_t)ddtab_bytes(hdr)) {
+            free(ddtab);
+            ddtab = NULL;
+        }
+        bad = !ddtab;
+    }
+
+    if (bad)
+    {
+        free(unwritten);
+        free(zero);
+        free(verified);
+        free(lzmap);
+        if (!map)
+        {
+            free(bitmap);
+            free(csum);
+            free(ddtab);
+        }
+        return -1;
+    }
+    for (size_t w = 0; w < words; w++)
+    {
+        unwritten[w] = ~bitmap[w];
+    }
+    if (lzmap)
+    {
+        for (size_t b = 0; b < hdr->block_count; b++)
+        {
+            if (lzmap[b].len || (lzmap[b].flags & BLZ_RAW)) continue;
+            unwritten[b / BITMAP_WORD_BITS] |= (uint64_t)1 << (b % BITMAP_WORD_BITS);
+        }
+    }
+    else if (fd >= 0)
+    {
+        mark_holes(fd, hdr, unwritten);
+    }
+
+    /* the header may live inside the old mapping: copy it first */
+    img_hdr_t h = *hdr;
+    block_detach();
+
+    g_hdr         = h;
+    g_block_size  = h.block_size;
+    g_block_count = h.block_count;
+    g_img_size    = img_size(&h);
+    g_backend     = map ? BLOCK_BACKEND_MMAP : BLOCK_BACKEND_FILE;
 
-    block_bitmap[blkno] = 0;
-    memset(block_data[blkno], 0, BLOCK_SIZE);
+    g_map    = map;
+    g_bitmap = bitmap;
+    g_fd     = fd;
+    g_unwritten  = unwritten;
+    g_zero_block = zero;
+    g_csum       = csum;
+    g_verified   = verified;
+    g_csum_zero  = crc32c(0, zero, g_block_size);
+    g_lzmap      = lzmap;
+    g_ddtab      = ddtab;
+    if (path)
+    {
+        strncpy(g_path, path, sizeof(g_path) - 1);
+        g_path[sizeof(g_path) - 1] = '\0';
+    }
+
+    if (map)
+    {
+        block_data = g_map + h.data_off;
+    }
+    else if (bcache_init(fd, g_block_size, h.data_off, g_cache_blocks) != 0 ||
+             (lzmap && blz_init(fd, g_block_size, h.data_off, h.phys_blocks,
+                                lzmap, g_block_count) != 0)) {
+        bcache_destroy();
+        free(bitmap);
+        free(unwritten);
+        free(zero);
+        free(csum);
+        free(verified);
+        free(lzmap);
+        free(ddtab);
+        g_unwritten  = NULL;
+        g_zero_block = NULL;
+        g_csum       = NULL;
+        g_verified   = NULL;
+        g_lzmap      = NULL;
+        g_ddtab      = NULL;
+        g_bitmap = NULL;
+        g_fd = -1;          /* caller still owns fd on failure */
+        g_backend = BLOCK_BACKEND_MMAP;
+        return -1;
+    }
+    else
+    {
+        /* no ring (or no memory for g_busy) still works: pread/pwrite,
+         * and transfers on the same block are serialised */
+        bio_init(fd, g_block_size, h.data_off, g_queue_depth);
+        g_busy = calloc(BITMAP_WORDS(g_block_count), sizeof(uint64_t));
+    }
+
+    /* no dirty sets (out of memory) just means the next save is a full one */
+    dset_init(&g_dirty_bm, BITMAP_WORDS(g_block_count));
+    dset_init(&g_claimed, g_block_count);
+    dset_init(&g_freed, g_block_count);
+    if (csum)
+    {
+        dset_init(&g_dirty_csum, g_block_count);
+    }
+    if (lzmap)
+    {
+        dset_init(&g_dirty_lzmap, g_block_count);
+    }
+    if (ddtab)
+    {
+        /* no memory for the index: nothing new is shared this session */
+        dset_init(&g_dirty_ddtab, g_block_count);
+        bdd_init(ddtab, g_block_count, (h.flags & IMG_F_DEDUP) != 0);
+    }
+    if (map)
+    {
+        dset_init(&g_dirty_data, g_block_count);
+    }
+
+    balloc_attach(g_bitmap, g_block_count);
+    return 0;
 }
 
-int block_read(int blkno, void *buf)
+/* map an image for the mmap backend and attach; consumes fd on success.
+ * Compressed images need the cache: they always get the file backend. */
+static int attach_fd(const img_hdr_t *hdr, int fd, const char *path)
 {
-    if (!buf) return -1;
-    if (blkno < 0 || blkno >= (int)BLOCK_COUNT) return -1;
-    memcpy(buf, block_data[blkno], BLOCK_SIZE);
+    if (g_next_backend == BLOCK_BACKEND_FILE || (hdr->flags & IMG_F_LZ))
+    {
+        return block_attach(hdr, NULL, fd, path);
+    }
+
+    size_t size = img_size(hdr);
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return -1;
+
+    if (block_attach(hdr, (uint8_t *)map, fd, path) != 0)
+    {
+        munmap(map, size);
+        return -1;
+    }
     return 0;
 }
 
-int block_write(int blkno, const void *buf)
+/* create a sparse image file with a fresh header; returns the open fd.
+ * count is the size of the data area; IMG_F_LZ multiplies the logical
+ * size by the compression ratio. */
+static int img_create(const char *filename, size_t bsize, size_t count, uint32_t flags,
+                      img_hdr_t *hdr)
 {
-    if (!buf) return -1;
-    if (blkno < 0 || blkno >= (int)BLOCK_COUNT) return -1;
-    memcpy(block_data[blkno], buf, BLOCK_SIZE);
+    size_t logical = (flags & IMG_F_LZ) ? count * g_next_lz : count;
+    hdr_fill(hdr, bsize, logical, count, flags);
+    size_t size = img_size(hdr);
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    /* truncate only extends: unwritten blocks read back as zero */
+    if (ftruncate(fd, (off_t)size) != 0 ||
+        pwrite(fd, hdr, sizeof(*hdr), 0) != (ssize_t)sizeof(*hdr)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* v0/v1 images kept one byte per block right after a 16 byte header.
+ * Copy the used blocks into a fresh image and swap it in place. */
+static int img_upgrade(int fd, const img_hdr_t *old, const char *filename)
+{
+    size_t bsize = old->block_size;
+    size_t count = old->block_count;
+    size_t data_off = IMG_LEGACY_HDR + count;
+    if (old->version >= 1)
+    {
+        data_off = align_up(data_off, data_align(bsize));
+    }
+    size_t old_size = data_off + count * bsize;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < old_size) return -1;
+
+    uint8_t *src = mmap(NULL, old_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (src == MAP_FAILED) return -1;
+
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.upgrade", filename);
+
+    /* same logical layout as before: no compression */
+    img_hdr_t nhdr;
+    int nfd = img_create(tmp, bsize, count, next_flags() & ~IMG_F_LZ, &nhdr);
+    if (nfd < 0)
+    {
+        munmap(src, old_size);
+        return -1;
+    }
+
+    uint8_t *dst = mmap(NULL, img_size(&nhdr), PROT_READ | PROT_WRITE, MAP_SHARED, nfd, 0);
+    if (dst == MAP_FAILED)
+    {
+        close(nfd);
+        unlink(tmp);
+        munmap(src, old_size);
+        return -1;
+    }
+
+    const img_hdr_t *hdr = &nhdr;
+    uint64_t *bitmap = (uint64_t *)(dst + hdr->bitmap_off);
+    uint32_t *csum   = (hdr->flags & IMG_F_CSUM) ? (uint32_t *)(dst + hdr->csum_off) : NULL;
+    uint8_t  *data   = dst + hdr->data_off;
+
+    for (size_t b = 0; b < count; b++)
+    {
+        if (!src[IMG_LEGACY_HDR + b]) continue;
+        bitmap[b / BITMAP_WORD_BITS] |= (uint64_t)1 << (b % BITMAP_WORD_BITS);
+        memcpy(data + b * bsize, src + data_off + b * bsize, bsize);
+        if (csum) csum[b] = crc32c(0, data + b * bsize, bsize);
+    }
+
+    size_t new_size = img_size(hdr);
+    int rc = msync(dst, new_size, MS_SYNC);
+    munmap(dst, new_size);
+    munmap(src, old_size);
+    close(nfd);
+
+    if (rc != 0 || rename(tmp, filename) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
     return 0;
 }
 
-/* define function */
+uint8_t *block_ptr(int blkno)
+{
+    return block_data + (size_t)blkno * g_block_size;
+}
+
+/* backend dispatch: storage for one block, released with blk_put */
+static uint8_t *blk_get(int blkno, int flags)
+{
+    if (g_backend == BLOCK_BACKEND_MMAP)
+    {
+        /* the file backend checks in bcache's device read */
+        if (!(flags & BCACHE_NOREAD) && block_csum_check(blkno, block_ptr(blkno)) != 0)
+        {
+            return NULL;
+        }
+        if (flags & BCACHE_DIRTY)
+        {
+            dset_mark(&g_dirty_data, (size_t)blkno);
+        }
+        return block_ptr(blkno);
+    }
+    return bcache_get(blkno, flags);
+}
+
+static void blk_put(int blkno)
+{
+    if (g_backend == BLOCK_BACKEND_FILE)
+    {
+        bcache_put(blkno);
+    }
+}
+
+/* give blocks real zeros in storage (the unwritten state only promises
+ * them to readers) */
+static int block_zero(int start, size_t n)
+{
+    if (g_backend == BLOCK_BACKEND_MMAP)
+    {
+        memset(block_ptr(start), 0, n * g_block_size);
+        for (size_t i = 0; i < n; i++)
+        {
+            dset_mark(&g_dirty_data, (size_t)start + i);
+            mark_written((size_t)start + i);
+        }
+        return 0;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint8_t *p = bcache_get(start + (int)i, BCACHE_NOREAD | BCACHE_DIRTY);
+        if (!p) return -1;
+        memset(p, 0, g_block_size);
+        bcache_put(start + (int)i);
+        mark_written((size_t)start + i);
+    }
+    return 0;
+}
+
+void block_claim(int start, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (unwritten_test((size_t)start + i))
+        {
+            dset_mark_atomic(&g_claimed, (size_t)start + i);
+        }
+    }
+}
+
+/* punch [first, first+n) out of the image file: whole pages become holes,
+ * the filesystem zeroes partial ones */
+static int punch_blocks(size_t first, size_t n)
+{
+    off_t off = (off_t)g_hdr.data_off + (off_t)first * (off_t)g_block_size;
+    off_t len = (off_t)n * (off_t)g_block_size;
+    return fallocate(g_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0 ? 0 : -1;
+}
+
+/* claimed blocks nobody wrote may still hold what a freed block left
+ * behind; make them real zeros (a hole where possible) before the bitmap
+ * that calls them used reaches the disk */
+static int zero_claimed_run(size_t first, size_t n)
+{
+    for (size_t b = first; b < first + n; b++)
+    {
+        if (!unwritten_test(b) || !balloc_test(b)) continue;
+        if (g_backend == BLOCK_BACKEND_FILE)
+        {
+            bcache_discard((int)b);
+        }
+        if (g_lzmap) blz_unmap((int)b);
+        else if (punch_blocks(b, 1) != 0 && block_zero((int)b, 1) != 0) return -1;
+        if (g_csum) csum_store(b, g_csum_zero);
+    }
+    return 0;
+}
+
+static int zero_claimed(void)
+{
+    if (!g_claimed.bits)
+    {
+        /* lost track: every used block that is still unwritten */
+        return zero_claimed_run(0, g_block_count);
+    }
+    return dset_flush(&g_claimed, 0, zero_claimed_run);
+}
+
+int block_discard(int start, size_t n)
+{
+    if (!block_valid(start) || n == 0 || (size_t)start + n > g_block_count) return -1;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        unwritten_set((size_t)start + i);
+        dset_mark_atomic(&g_freed, (size_t)start + i);
+        if (g_backend == BLOCK_BACKEND_FILE)
+        {
+            bcache_discard(start + (int)i);
+        }
+        if (g_lzmap)
+        {
+            blz_unmap(start + (int)i);  /* storage punched at the next save */
+        }
+    }
+    if (g_lzmap) return 0;
+
+    /* release the whole pages inside the range; partial pages just keep
+     * their stale bytes, which nobody can read any more */
+    size_t pg  = (size_t)sysconf(_SC_PAGESIZE);
+    size_t off = (size_t)g_hdr.data_off + (size_t)start * g_block_size;
+    size_t s   = align_up(off, pg);
+    size_t e   = (off + n * g_block_size) / pg * pg;
+    if (s >= e) return 0;
+
+    if (g_fd >= 0)
+    {
+        fallocate(g_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)s, (off_t)(e - s));
+    }
+    else if (g_map)
+    {
+        /* anonymous device: private pages come back zero filled */
+        madvise(g_map + s, e - s, MADV_DONTNEED);
+    }
+    return 0;
+}
+
+int block_valid(int blkno)
+{
+    return blkno >= 0 && (size_t)blkno < g_block_count;
+}
+
+/* define function */
+int block_init(void)
+{
+    /* already backed by an image (or anonymous device) */
+    if (g_map || g_fd >= 0)
+    {
+        return 0;
+    }
+
+    img_hdr_t hdr;
+    hdr_fill(&hdr, BLOCK_SIZE_DEFAULT, BLOCK_COUNT_DEFAULT, BLOCK_COUNT_DEFAULT,
+             next_flags() & ~IMG_F_LZ);
+
+    /* anonymous mapping is zero filled: empty bitmap, empty data */
+    void *map = mmap(NULL, img_size(&hdr), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    memcpy(map, &hdr, sizeof(hdr));
+    block_attach(&hdr, (uint8_t *)map, -1, NULL);
+    return 0;
+}
+
+void block_close(void)
+{
+    block_detach();
+}
+
+int block_set_queue_depth(unsigned depth)
+{
+    g_queue_depth = depth;
+    return 0;
+}
+
+const char *block_io_engine(void)
+{
+    if (g_backend == BLOCK_BACKEND_MMAP) return "mmap";
+    return bio_engine();
+}
+
+int block_set_checksums(int on)
+{
+    g_next_csum = on ? 1 : 0;
+    return 0;
+}
+
+int block_checksums(void)
+{
+    return g_csum != NULL;
+}
+
+size_t block_csum_errors(void)
+{
+    return g_csum_errors;
+}
+
+int block_set_compression(unsigned ratio)
+{
+    if (ratio > BLOCK_LZ_RATIO_MAX) return -1;
+    g_next_lz = ratio == 1 ? 0 : ratio;
+    return 0;
+}
+
+int block_compressed(void)
+{
+    return g_lzmap != NULL;
+}
+
+size_t block_stored_size(void)
+{
+    if (!g_lzmap) return block_used_size();
+
+    /* a block's stored size is known once it is written back */
+    bcache_flush();
+    return blz_stored_bytes();
+}
+
+size_t block_phys_size(void)
+{
+    return phys_blocks(&g_hdr) * g_block_size;
+}
+
+int block_set_dedup(int on)
+{
+    g_next_dedup = on ? 1 : 0;
+    return 0;
+}
+
+int block_dedup(void)
+{
+    return g_ddtab && (g_hdr.flags & IMG_F_DEDUP);
+}
+
+int block_set_refcounts(int on)
+{
+    g_next_refs = on ? 1 : 0;
+    return 0;
+}
+
+int block_refcounts(void)
+{
+    return g_ddtab != NULL;
+}
+
+size_t block_dedup_saved(void)
+{
+    return g_ddtab ? bdd_saved_blocks() : 0;
+}
+
+int block_set_backend(int backend, size_t cache_blocks)
+{
+    if (backend != BLOCK_BACKEND_MMAP && backend != BLOCK_BACKEND_FILE) return -1;
+
+    g_next_backend = backend;
+    if (cache_blocks)
+    {
+        g_cache_blocks = cache_blocks;
+    }
+    return 0;
+}
+
+int block_format(const char *filename, size_t bsize, size_t count)
+{
+    if (!filename || !geometry_valid(bsize, count)) return -1;
+    if (g_next_lz && !geometry_valid(bsize, count * g_next_lz)) return -1;
+
+    img_hdr_t hdr;
+    int fd = img_create(filename, bsize, count, next_flags(), &hdr);
+    if (fd < 0) return -1;
+
+    if (attach_fd(&hdr, fd, filename) != 0) { close(fd); return -1; }
+    return 0;
+}
+
+static inline int block_has_data(size_t b)
+{
+    return balloc_test(b) && !unwritten_test(b);
+}
+
+/* compressed "save as": get every cached block into block_lz.c's units,
+ * then copy the stored blocks packed, without the gaps of this image */
+static int dump_packed(int fd, uint32_t *csum)
+{
+    struct blz_ent *map = malloc(lzmap_bytes(&g_hdr));
+    if (!map || bcache_flush() != 0)
+    {
+        free(map);
+        return -1;
+    }
+
+    int rc = blz_copy_packed(fd, g_hdr.data_off, map, block_has_data);
+    for (size_t b = 0; csum && b < g_block_count; b++)
+    {
+        if (block_has_data(b)) csum[b] = g_csum[b];
+    }
+    if (rc == 0 &&
+        pwrite(fd, map, lzmap_bytes(&g_hdr), (off_t)g_hdr.map_off) != (ssize_t)lzmap_bytes(&g_hdr)) {
+        rc = -1;
+    }
+    free(map);
+    return rc;
+}
+
+/* "save as": a sparse copy. Header, bitmap and the blocks holding data;
+ * free and unwritten blocks stay holes in the new file. The checksum
+ * table is rebuilt from what is written (holes read as zeros). */
+static int dump_image(const char *filename)
+{
+    uint32_t *csum = NULL;
+    if (g_hdr.flags & IMG_F_CSUM)
+    {
+        csum = malloc(csum_bytes(&g_hdr));
+        if (!csum) return -1;
+        for (size_t b = 0; b < g_block_count; b++)
+        {
+            csum[b] = g_csum_zero;
+        }
+    }
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        free(csum);
+        return -1;
+    }
+
+    int rc = 0;
+    if (ftruncate(fd, (off_t)g_img_size) != 0 ||
+        pwrite(fd, &g_hdr, hdr_size(g_hdr.version), 0) != (ssize_t)hdr_size(g_hdr.version) ||
+        pwrite(fd, g_bitmap, bitmap_bytes(&g_hdr), (off_t)g_hdr.bitmap_off) !=
+            (ssize_t)bitmap_bytes(&g_hdr)) {
+        rc = -1;
+    }
+    if (rc == 0 && g_lzmap)
+    {
+        rc = dump_packed(fd, csum);
+    }
+
+    size_t b = 0;
+    while (rc == 0 && !g_lzmap && b < g_block_count)
+    {
+        /* whole free words are skipped without looking at the blocks */
+        if (b % BITMAP_WORD_BITS == 0 && g_bitmap[b / BITMAP_WORD_BITS] == 0)
+        {
+            b += BITMAP_WORD_BITS;
+            continue;
+        }
+        if (!block_has_data(b)) { b++; continue; }
+
+        off_t off = (off_t)g_hdr.data_off + (off_t)b * (off_t)g_block_size;
+        if (g_backend == BLOCK_BACKEND_MMAP)
+        {
+            /* the run is contiguous in the map: one pwrite */
+            size_t e = b + 1;
+            while (e < g_block_count && block_has_data(e)) e++;
+            size_t len = (e - b) * g_block_size;
+            if (pwrite(fd, block_ptr((int)b), len, off) != (ssize_t)len) rc = -1;
+            for (; csum && b < e; b++)
+            {
+                csum[b] = crc32c(0, block_ptr((int)b), g_block_size);
+            }
+            b = e;
+            continue;
+        }
+
+        uint8_t *p = bcache_get((int)b, 0);
+        if (!p) { rc = -1; break; }
+        if (pwrite(fd, p, g_block_size, off) != (ssize_t)g_block_size) rc = -1;
+        if (csum) csum[b] = crc32c(0, p, g_block_size);
+        bcache_put((int)b);
+        b++;
+    }
+
+    if (rc == 0 && csum &&
+        pwrite(fd, csum, csum_bytes(&g_hdr), (off_t)g_hdr.csum_off) != (ssize_t)csum_bytes(&g_hdr)) {
+        rc = -1;
+    }
+    if (rc == 0 && g_ddtab &&
+        pwrite(fd, g_ddtab, ddtab_bytes(&g_hdr), (off_t)g_hdr.dedup_off) != (ssize_t)ddtab_bytes(&g_hdr)) {
+        rc = -1;
+    }
+
+    close(fd);
+    free(csum);
+    return rc;
+}
+
+/* blocks freed since the last save become holes. A run is widened over
+ * free neighbours to the enclosing pages, so small blocks freed one at a
+ * time still add up to whole pages; block_discard only punched the pages
+ * a single call covered. */
+static int punch_freed_run(size_t first, size_t n)
+{
+    size_t per_page = (size_t)sysconf(_SC_PAGESIZE) / g_block_size;
+    if (per_page < 1) per_page = 1;
+
+    size_t s = first;
+    size_t e = first + n;
+    size_t lo = s / per_page * per_page;
+    size_t hi = align_up(e, per_page);
+    if (hi > g_block_count) hi = g_block_count;
+
+    while (s > lo && !balloc_test(s - 1)) s--;
+    while (e < hi && !balloc_test(e)) e++;
+
+    /* trim to page boundaries; the run may have been reallocated since */
+    s = align_up(s, per_page);
+    e = e / per_page * per_page;
+    for (size_t b = s; b < e; b++)
+    {
+        if (balloc_test(b)) return 0;
+    }
+    if (s < e)
+    {
+        punch_blocks(s, e - s);     /* best effort: no holes is still correct */
+    }
+    return 0;
+}
+
+static void punch_freed(void)
+{
+    if (!g_freed.bits) return;
+    if (g_lzmap)
+    {
+        dset_clear(&g_freed);   /* block_lz.c punches units instead */
+        return;
+    }
+    dset_flush(&g_freed, 0, punch_freed_run);
+}
+
+/* msync the pages under [off, off+len) of the image; clean pages inside
+ * the range cost nothing, so callers merge runs freely */
+static int sync_map(size_t off, size_t len)
+{
+    size_t pg = (size_t)sysconf(_SC_PAGESIZE);
+    size_t s  = off / pg * pg;
+    size_t e  = off + len;
+    if (e > g_img_size) e = g_img_size;
+    return msync(g_map + s, e - s, MS_SYNC) == 0 ? 0 : -1;
+}
+
+/* the blocks' checksums follow them to disk; the run may include clean
+ * blocks (merged gaps) whose entries are already right */
+static int sync_data_run(size_t first, size_t n)
+{
+    for (size_t b = first; g_csum && b < first + n; b++)
+    {
+        if (dset_test(&g_dirty_data, b) && !unwritten_test(b))
+        {
+            csum_store(b, crc32c(0, block_ptr((int)b), g_block_size));
+        }
+    }
+    return sync_map((size_t)g_hdr.data_off + first * g_block_size, n * g_block_size);
+}
+
+static int sync_csum_run(size_t first, size_t n)
+{
+    return sync_map((size_t)g_hdr.csum_off + first * sizeof(uint32_t), n * sizeof(uint32_t));
+}
+
+static int queue_csum_run(size_t first, size_t n)
+{
+    return bio_queue_at(1, g_hdr.csum_off + first * sizeof(uint32_t),
+                        n * sizeof(uint32_t), g_csum + first, NULL, NULL);
+}
+
+static int queue_lzmap_run(size_t first, size_t n)
+{
+    return bio_queue_at(1, g_hdr.map_off + first * sizeof(struct blz_ent),
+                        n * sizeof(struct blz_ent), g_lzmap + first, NULL, NULL);
+}
+
+static int sync_ddtab_run(size_t first, size_t n)
+{
+    return sync_map((size_t)g_hdr.dedup_off + first * sizeof(struct bdd_ent),
+                    n * sizeof(struct bdd_ent));
+}
+
+static int queue_ddtab_run(size_t first, size_t n)
+{
+    return bio_queue_at(1, g_hdr.dedup_off + first * sizeof(struct bdd_ent),
+                        n * sizeof(struct bdd_ent), g_ddtab + first, NULL, NULL);
+}
+
+static int write_ddtab_all(void)
+{
+    size_t len = ddtab_bytes(&g_hdr);
+    return pwrite(g_fd, g_ddtab, len, (off_t)g_hdr.dedup_off) == (ssize_t)len ? 0 : -1;
+}
+
+static int write_lzmap_all(void)
+{
+    size_t len = lzmap_bytes(&g_hdr);
+    return pwrite(g_fd, g_lzmap, len, (off_t)g_hdr.map_off) == (ssize_t)len ? 0 : -1;
+}
+
+static int write_csum_all(void)
+{
+    size_t len = csum_bytes(&g_hdr);
+    return pwrite(g_fd, g_csum, len, (off_t)g_hdr.csum_off) == (ssize_t)len ? 0 : -1;
+}
+
+static int sync_bitmap_run(size_t first, size_t n)
+{
+    return sync_map((size_t)g_hdr.bitmap_off + first * sizeof(uint64_t), n * sizeof(uint64_t));
+}
+
+static int write_bitmap_run(size_t first, size_t n)
+{
+    size_t len = n * sizeof(uint64_t);
+    off_t off  = (off_t)(g_hdr.bitmap_off + first * sizeof(uint64_t));
+    return pwrite(g_fd, g_bitmap + first, len, off) == (ssize_t)len ? 0 : -1;
+}
+
+static int queue_bitmap_run(size_t first, size_t n)
+{
+    return bio_queue_at(1, g_hdr.bitmap_off + first * sizeof(uint64_t),
+                        n * sizeof(uint64_t), g_bitmap + first, NULL, NULL);
+}
+
+/* write back only what changed since the last save of this image.
+ * The header is fixed once the image exists, so it is never rewritten. */
+static int save_incremental(void)
+{
+    if (zero_claimed() != 0) return -1;
+    punch_freed();
+
+    if (g_backend == BLOCK_BACKEND_MMAP)
+    {
+        size_t page_blocks = (size_t)sysconf(_SC_PAGESIZE) / g_block_size;
+
+        /* data before the checksums that describe it, both before the
+         * bitmap that makes it reachable */
+        if (dset_flush(&g_dirty_data, page_blocks, sync_data_run) != 0 ||
+            (g_csum && dset_flush(&g_dirty_csum, 1024, sync_csum_run) != 0) ||
+            (g_ddtab && dset_flush(&g_dirty_ddtab, 512, sync_ddtab_run) != 0) ||
+            dset_flush(&g_dirty_bm, 512, sync_bitmap_run) != 0) {
+            /* lost track (or a failed run): sync everything */
+            return msync(g_map, g_img_size, MS_SYNC) == 0 ? 0 : -1;
+        }
+        return 0;
+    }
+
+    /* dirty slots and bitmap runs go to the device as one batch; a few
+     * clean words in between are cheaper than another request */
+    bio_drain();
+    int rc = bcache_flush_queue();
+    if (g_csum && dset_flush(&g_dirty_csum, 16, queue_csum_run) != 0) rc = -1;
+    if (g_lzmap && dset_flush(&g_dirty_lzmap, 8, queue_lzmap_run) != 0) rc = -1;
+    if (g_ddtab && dset_flush(&g_dirty_ddtab, 8, queue_ddtab_run) != 0) rc = -1;
+    if (dset_flush(&g_dirty_bm, 8, queue_bitmap_run) != 0) rc = -1;
+    if (bio_wait() != 0 || rc != 0)
+    {
+        /* retry the slow way: whatever is still dirty, whole tables */
+        if (bcache_flush() != 0 ||
+            (g_csum && write_csum_all() != 0) ||
+            (g_lzmap && write_lzmap_all() != 0) ||
+            (g_ddtab && write_ddtab_all() != 0) ||
+            write_bitmap_run(0, BITMAP_WORDS(g_block_count)) != 0) {
+            return -1;
+        }
+    }
+    if (fdatasync(g_fd) != 0) return -1;
+
+    /* the map on disk no longer points at units blocks moved away from */
+    blz_commit();
+    return 0;
+}
+
+/* entries [first, first+n) of a per-block table (or bitmap words) at
+ * off in the image, from mem */
+static int sync_table(uint64_t off, const void *mem, size_t first, size_t n, size_t esize)
+{
+    if (g_backend == BLOCK_BACKEND_MMAP)
+    {
+        return sync_map((size_t)off + first * esize, n * esize);
+    }
+    size_t len = n * esize;
+    return pwrite(g_fd, (const uint8_t *)mem + first * esize, len,
+                  (off_t)(off + first * esize)) == (ssize_t)len ? 0 : -1;
+}
+
+int block_sync(int start, size_t n)
+{
+    if (!block_valid(start) || n == 0 || (size_t)start + n > g_block_count) return -1;
+    if (g_fd < 0) return 0;     /* anonymous device: nowhere to go */
+
+    size_t first = (size_t)start;
+    if (zero_claimed_run(first, n) != 0) return -1;
+
+    if (g_backend == BLOCK_BACKEND_MMAP)
+    {
+        if (sync_data_run(first, n) != 0) return -1;
+    }
+    else
+    {
+        bio_drain();
+        for (size_t b = first; b < first + n; b++)
+        {
+            if (bcache_sync((int)b) != 0) return -1;
+        }
+    }
+
+    /* what describes the blocks, then the bitmap words that make them
+     * reachable */
+    size_t w  = first / BITMAP_WORD_BITS;
+    size_t nw = (first + n - 1) / BITMAP_WORD_BITS - w + 1;
+    if ((g_csum && sync_table(g_hdr.csum_off, g_csum, first, n, sizeof(uint32_t)) != 0) ||
+        (g_lzmap && sync_table(g_hdr.map_off, g_lzmap, first, n, sizeof(struct blz_ent)) != 0) ||
+        (g_ddtab && sync_table(g_hdr.dedup_off, g_ddtab, first, n, sizeof(struct bdd_ent)) != 0) ||
+        sync_table(g_hdr.bitmap_off, g_bitmap, w, nw, sizeof(uint64_t)) != 0) {
+        return -1;
+    }
+    if (g_backend == BLOCK_BACKEND_FILE && fdatasync(g_fd) != 0) return -1;
+    return 0;
+}
+
+int block_save_image(const char *filename)
+{
+    if (!filename || (!g_map && g_fd < 0)) return -1;
+
+    /* backed by this very file (same geometry by construction): write back
+     * what changed. Anything else (anonymous device, "save as") gets a
+     * full, sparse image. */
+    if (g_fd >= 0 && strcmp(filename, g_path) == 0)
+    {
+        return save_incremental();
+    }
+    return dump_image(filename);
+}
+
+int block_load_image(const char *filename)
+{
+    int fd = open(filename, O_RDWR);
+    if (fd < 0) {
+        /* 第一次沒有檔案很正常 */
+        return errno == ENOENT ? BLOCK_NO_IMAGE : -1;
+    }
+
+    img_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    if (pread(fd, &hdr, IMG_LEGACY_HDR, 0) != (ssize_t)IMG_LEGACY_HDR) { close(fd); return -1; }
+
+    if (hdr.magic != IMG_MAGIC ||
+        hdr.version > IMG_VERSION ||
+        !geometry_valid(hdr.block_size, hdr.block_count)) {
+        close(fd);
+        return -1;
+    }
+
+    if (hdr.version < 2)
+    {
+        int rc = img_upgrade(fd, &hdr, filename);
+        close(fd);
+        return rc == 0 ? block_load_image(filename) : -1;
+    }
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) { close(fd); return -1; }
+
+    /* older versions never wrote the later fields: what was read there
+     * is the bitmap */
+    size_t hsize = hdr_size(hdr.version);
+    memset((uint8_t *)&hdr + hsize, 0, sizeof(hdr) - hsize);
+
+    /* the tables come in layout order, each inside the metadata area */
+    size_t end = hdr.bitmap_off + bitmap_bytes(&hdr);
+    int bad = hdr.bitmap_off < hsize || (hdr.flags & ~IMG_F_KNOWN);
+    if (!bad && (hdr.flags & IMG_F_CSUM))
+    {
+        bad = hdr.csum_off < end || hdr.csum_off % sizeof(uint32_t);
+        end = hdr.csum_off + csum_bytes(&hdr);
+    }
+    if (!bad && (hdr.flags & IMG_F_LZ))
+    {
+        bad = hdr.map_off < end || hdr.map_off % sizeof(uint64_t) ||
+              hdr.phys_blocks < BLOCK_COUNT_MIN || hdr.phys_blocks > hdr.block_count;
+        end = hdr.map_off + lzmap_bytes(&hdr);
+    }
+    if (!bad && (hdr.flags & IMG_F_SHARED))
+    {
+        bad = hdr.dedup_off < end || hdr.dedup_off % sizeof(uint64_t);
+        end = hdr.dedup_off + ddtab_bytes(&hdr);
+    }
+    if (bad || end > hdr.data_off)
+    {
+        close(fd);
+        return -1;
+    }
+    size_t size = img_size(&hdr);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < size) { close(fd); return -1; }
+
+    /* drop the anonymous device (if any) and switch to the file */
+    if (attach_fd(&hdr, fd, filename) != 0) { close(fd); return -1; }
+    return 0;
+}
+
+
+size_t block_size(void)
+{
+  return g_block_size;
+}
+
+size_t block_total_blocks(void)
+{
+  return g_block_count;
+}
+
+size_t block_total_size(void)
+{
+  return g_block_count * g_block_size;
+}
+
+static void *pin(int blkno, int flags)
+{
+    if (!block_valid(blkno)) return NULL;
+    if (!(flags & (BLOCK_PIN_READ | BLOCK_PIN_WRITE))) return NULL;
+
+    if (!(flags & BLOCK_PIN_WRITE))
+    {
+        /* nothing written yet: no device access, no cache slot */
+        if (unwritten_test((size_t)blkno)) return g_zero_block;
+        return blk_get(blkno, 0);
+    }
+    if (dedup_write(blkno) != 0) return NULL;
+
+    /* mmap: a pin is just the address. file: the cache slot stays pinned
+     * (not evictable) until block_unpin. An unwritten block has nothing
+     * worth reading; it only needs zeros if the caller won't cover it. */
+    int fresh = unwritten_test((size_t)blkno);
+    int bflags = BCACHE_DIRTY;
+    if (fresh || (flags & BLOCK_PIN_WHOLE)) bflags |= BCACHE_NOREAD;
+
+    uint8_t *p = blk_get(blkno, bflags);
+    if (!p) return NULL;
+    if (fresh)
+    {
+        if (!(flags & BLOCK_PIN_WHOLE)) memset(p, 0, g_block_size);
+        mark_written((size_t)blkno);
+    }
+    return p;
+}
+
+void *block_pin(int blkno, int flags)
+{
+    uint64_t t0 = bstat_now();
+    void *p = pin(blkno, flags);
+    bstat_op((flags & BLOCK_PIN_WRITE) ? BLOCK_OP_WRITE : BLOCK_OP_READ, t0,
+             p ? g_block_size : 0);
+    return p;
+}
+
+void block_unpin(int blkno)
+{
+    if (!block_valid(blkno)) return;
+
+    /* read pins of unwritten blocks handed out g_zero_block */
+    if (unwritten_test((size_t)blkno)) return;
+    blk_put(blkno);
+}
+
+static int read_one(int blkno, void *buf)
+{
+    if (!buf) return -1;
+    if (!block_valid(blkno)) return -1;
+
+    if (unwritten_test((size_t)blkno))
+    {
+        memset(buf, 0, g_block_size);
+        return 0;
+    }
+
+    const uint8_t *p = blk_get(blkno, 0);
+    if (!p) return -1;
+    memcpy(buf, p, g_block_size);
+    blk_put(blkno);
+    return 0;
+}
+
+static int write_one(int blkno, const void *buf)
+{
+    if (!buf) return -1;
+    if (!block_valid(blkno)) return -1;
+    if (dedup_write(blkno) != 0) return -1;
+
+    /* whole block overwrite: no need to read the old contents */
+    uint8_t *p = blk_get(blkno, BCACHE_NOREAD | BCACHE_DIRTY);
+    if (!p) return -1;
+    memcpy(p, buf, g_block_size);
+    blk_put(blkno);
+    mark_written((size_t)blkno);
+    return 0;
+}
+
+int block_read(int blkno, void *buf)
+{
+    uint64_t t0 = bstat_now();
+    int rc = read_one(blkno, buf);
+    bstat_op(BLOCK_OP_READ, t0, rc == 0 ? g_block_size : 0);
+    return rc;
+}
+
+int block_write(int blkno, const void *buf)
+{
+    uint64_t t0 = bstat_now();
+    int rc = write_one(blkno, buf);
+    bstat_op(BLOCK_OP_WRITE, t0, rc == 0 ? g_block_size : 0);
+    return rc;
+}
+
+/* ---------- shared blocks ---------- */
+
+#define DEDUP_REFS_MAX (BDD_INDEXED - 1)
+
+int block_store(const void *buf)
+{
+    if (!buf) return -1;
+
+    uint32_t hash = 0;
+    if (block_dedup())
+    {
+        /* equal hashes are only candidates: compare the bytes */
+        hash = crc32c(0, buf, g_block_size);
+        for (int b = bdd_first(hash); b >= 0; b = bdd_next(b, hash))
+        {
+            const uint8_t *p = block_pin(b, BLOCK_PIN_READ);
+            int same = p && memcmp(p, buf, g_block_size) == 0;
+            if (p) block_unpin(b);
+            if (same && bdd_refs(b) < DEDUP_REFS_MAX)
+            {
+                bdd_ref(b);
+                return b;
+            }
+        }
+    }
+
+    int b = block_alloc();
+    if (b < 0) return -1;
+    if (block_write(b, buf) != 0)
+    {
+        block_free(b);
+        return -1;
+    }
+    if (block_dedup()) bdd_insert(b, hash);
+    return b;
+}
+
+int block_share(int blkno)
+{
+    if (!g_ddtab || !block_valid(blkno) || !balloc_test((size_t)blkno)) return -1;
+    if (bdd_refs(blkno) >= DEDUP_REFS_MAX) return -1;
+    bdd_ref(blkno);
+    return 0;
+}
+
+int block_cow(int blkno)
+{
+    if (!block_valid(blkno)) return -1;
+    if (!g_ddtab || bdd_refs(blkno) == 0) return blkno;
+
+    int b = block_alloc();
+    if (b < 0) return -1;
+
+    const uint8_t *p = block_pin(blkno, BLOCK_PIN_READ);
+    int rc = p ? block_write(b, p) : -1;
+    if (p) block_unpin(blkno);
+    if (rc != 0)
+    {
+        block_free(b);
+        return -1;
+    }
+    bdd_unref(blkno);
+    return b;
+}
+
+/* ---------- asynchronous I/O ---------- */
+
+void block_io_retire(int blkno, size_t n)
+{
+    if (!g_busy) return;
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t b = (size_t)blkno + i;
+        g_busy[b / BITMAP_WORD_BITS] &= ~((uint64_t)1 << (b % BITMAP_WORD_BITS));
+    }
+}
+
+static void busy_claim(int blkno)
+{
+    size_t b = (size_t)blkno;
+    if (!g_busy || ((g_busy[b / BITMAP_WORD_BITS] >> (b % BITMAP_WORD_BITS)) & 1))
+    {
+        bio_drain();
+    }
+    if (g_busy)
+    {
+        g_busy[b / BITMAP_WORD_BITS] |= (uint64_t)1 << (b % BITMAP_WORD_BITS);
+    }
+}
+
+int block_read_async(int blkno, void *buf, block_io_done done, void *arg)
+{
+    if (!buf || !block_valid(blkno)) return -1;
+    bstat_op(BLOCK_OP_READ, 0, g_block_size);
+
+    /* served without the device: unwritten, mapped, or already cached */
+    int hit = 0;
+    if (unwritten_test((size_t)blkno))
+    {
+        memset(buf, 0, g_block_size);
+        hit = 1;
+    }
+    else if (g_backend == BLOCK_BACKEND_MMAP || needs_check((size_t)blkno) || g_lzmap)
+    {
+        /* first read of a checksummed block goes through blk_get,
+         * which verifies it, and a compressed one, which inflates it;
+         * the caller sees a failure through done() */
+        if (g_backend == BLOCK_BACKEND_FILE) busy_claim(blkno);
+        const uint8_t *p = blk_get(blkno, 0);
+        if (p)
+        {
+            memcpy(buf, p, g_block_size);
+            blk_put(blkno);
+        }
+        block_io_retire(blkno, 1);
+        if (done) done(blkno, p ? 0 : -1, arg);
+        return 0;
+    }
+    else
+    {
+        busy_claim(blkno);
+        if (bcache_peek(blkno, buf) == 0)
+        {
+            block_io_retire(blkno, 1);
+            hit = 1;
+        }
+    }
+
+    if (hit)
+    {
+        if (done) done(blkno, 0, arg);
+        return 0;
+    }
+    return bio_queue(0, blkno, 1, buf, done, arg);
+}
+
+int block_write_async(int blkno, const void *buf, block_io_done done, void *arg)
+{
+    if (!buf || !block_valid(blkno)) return -1;
+    if (dedup_write(blkno) != 0) return -1;
+    bstat_op(BLOCK_OP_WRITE, 0, g_block_size);
+
+    mark_written((size_t)blkno);
+
+    int hit = 0;
+    if (g_backend == BLOCK_BACKEND_MMAP || g_lzmap)
+    {
+        /* into the map, or into the cache to be compressed at writeback */
+        uint8_t *p = blk_get(blkno, BCACHE_NOREAD | BCACHE_DIRTY);
+        if (p)
+        {
+            memcpy(p, buf, g_block_size);
+            blk_put(blkno);
+        }
+        if (done) done(blkno, p ? 0 : -1, arg);
+        return 0;
+    }
+    else
+    {
+        busy_claim(blkno);
+        /* a cached copy stays the one true copy: update it in place */
+        if (bcache_update(blkno, buf) == 0)
+        {
+            block_io_retire(blkno, 1);
+            hit = 1;
+        }
+    }
+
+    if (hit)
+    {
+        if (done) done(blkno, 0, arg);
+        return 0;
+    }
+    block_csum_write(blkno, buf);
+    return bio_queue(1, blkno, 1, (void *)buf, done, arg);
+}
+
+int block_io_wait(void)
+{
+    if (g_backend == BLOCK_BACKEND_MMAP) return 0;
+    return bio_wait();
+}
+
+/* ---------- vectored I/O ---------- */
+
+/* one run's iovecs must fit IOV_MAX: at most the caller's (halved cap)
+ * plus a zero pad per block */
+#define VEC_RUN_MAX 256     /* blocks per merged transfer */
+#define VEC_IOV_MAX (IOV_MAX / 2)
+
+/* walks the caller's iovecs as one byte stream. Past its end the stream
+ * reads as zeros (writev pads the last block) and swallows what is copied
+ * into it (readv of a short tail). */
+struct iov_cur
+{
+    const struct iovec *iov;
+    int    cnt;
+    int    i;
+    size_t off;         /* into iov[i] */
+};
+
+static int iov_at_end(struct iov_cur *c)
+{
+    while (c->i < c->cnt && c->off >= c->iov[c->i].iov_len)
+    {
+        c->i++;
+        c->off = 0;
+    }
+    return c->i >= c->cnt;
+}
+
+/* n bytes between mem and the stream; to_iov: mem -> stream, mem NULL
+ * stores zeros */
+static void iov_copy(struct iov_cur *c, uint8_t *mem, size_t n, int to_iov)
+{
+    while (n > 0)
+    {
+        if (iov_at_end(c))
+        {
+            if (!to_iov) memset(mem, 0, n);
+            return;
+        }
+
+        uint8_t *p = (uint8_t *)c->iov[c->i].iov_base + c->off;
+        size_t k = c->iov[c->i].iov_len - c->off;
+        if (k > n) k = n;
+
+        if (!to_iov)    memcpy(mem, p, k);
+        else if (mem)   memcpy(p, mem, k);
+        else            memset(p, 0, k);
+
+        c->off += k;
+        if (mem) mem += k;
+        n -= k;
+    }
+}
+
+/* CRC32C of the next n bytes of the stream, zero padded */
+static uint32_t iov_crc(struct iov_cur *c, size_t n)
+{
+    uint32_t crc = 0;
+    while (n > 0)
+    {
+        if (iov_at_end(c))
+        {
+            for (; n > g_block_size; n -= g_block_size)
+            {
+                crc = crc32c(crc, g_zero_block, g_block_size);
+            }
+            return crc32c(crc, g_zero_block, n);
+        }
+
+        size_t k = c->iov[c->i].iov_len - c->off;
+        if (k > n) k = n;
+        crc = crc32c(crc, (const uint8_t *)c->iov[c->i].iov_base + c->off, k);
+        c->off += k;
+        n -= k;
+    }
+    return crc;
+}
+
+/* describe the next n bytes of the stream as iovecs in out[]; pad fills
+ * a missing end from g_zero_block, otherwise it is left off */
+static int iov_take(struct iov_cur *c, size_t n, struct iovec *out, int pad)
+{
+    int k = 0;
+    while (n > 0)
+    {
+        if (iov_at_end(c))
+        {
+            if (!pad) break;
+            size_t z = n < g_block_size ? n : g_block_size;
+            out[k].iov_base = g_zero_block;
+            out[k].iov_len  = z;
+            k++;
+            n -= z;
+            continue;
+        }
+
+        size_t len = c->iov[c->i].iov_len - c->off;
+        if (len > n) len = n;
+        out[k].iov_base = (uint8_t *)c->iov[c->i].iov_base + c->off;
+        out[k].iov_len  = len;
+        k++;
+        c->off += len;
+        n -= len;
+    }
+    return k;
+}
+
+static int vec_check(const int *blknos, size_t nblk, const struct iovec *iov, int iovcnt)
+{
+    if (!blknos || iovcnt < 0 || (iovcnt > 0 && !iov) || iovcnt > VEC_IOV_MAX) return -1;
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+    if (total > nblk * g_block_size) return -1;
+
+    for (size_t i = 0; i < nblk; i++)
+    {
+        if (!block_valid(blknos[i])) return -1;
+    }
+    return 0;
+}
+
+/* mmap: copy run by run straight between the map and the iovecs */
+static int vec_map(int write, const int *blknos, size_t nblk, struct iov_cur *c)
+{
+    size_t i = 0;
+    while (i < nblk)
+    {
+        int b = blknos[i];
+        if (!write && unwritten_test((size_t)b))
+        {
+            iov_copy(c, NULL, g_block_size, 1);
+            i++;
+            continue;
+        }
+
+        size_t k = 1;
+        while (i + k < nblk && blknos[i + k] == b + (int)k &&
+               (write || !unwritten_test((size_t)b + k))) {
+            k++;
+        }
+
+        for (size_t j = 0; !write && j < k; j++)
+        {
+            if (block_csum_check(b + (int)j, block_ptr(b + (int)j)) != 0) return -1;
+        }
+
+        iov_copy(c, block_ptr(b), k * g_block_size, write ? 0 : 1);
+        if (write)
+        {
+            for (size_t j = 0; j < k; j++)
+            {
+                dset_mark(&g_dirty_data, (size_t)b + j);
+                mark_written((size_t)b + j);
+            }
+        }
+        i += k;
+    }
+    return 0;
+}
+
+/* file: blocks the cache or the unwritten map can serve are copied; the
+ * rest go to the device in runs of adjacent blocks, one vectored
+ * transfer each, all queued before a single wait */
+static int vec_file(int write, const int *blknos, size_t nblk, struct iov_cur *c)
+{
+    /* each run may split one caller iovec and pad with zero blocks */
+    struct iovec *seg = malloc(((size_t)c->cnt + 2 * nblk) * sizeof(*seg));
+    if (!seg) return -1;
+
+    int rc = 0;
+    size_t used = 0;
+    size_t i = 0;
+    while (i < nblk)
+    {
+        int b = blknos[i];
+        busy_claim(b);
+
+        if (!write && unwritten_test((size_t)b))
+        {
+            iov_copy(c, NULL, g_block_size, 1);
+            block_io_retire(b, 1);
+            i++;
+            continue;
+        }
+
+        /* a block still to be verified is read through the cache, which
+         * checks it; only verified blocks go to the device directly */
+        int cflags = write ? BCACHE_DIRTY : 0;
+        if (write || !needs_check((size_t)b)) cflags |= BCACHE_CACHED;
+
+        uint8_t *p = bcache_get(b, cflags);
+        if (!p && !(cflags & BCACHE_CACHED))
+        {
+            block_io_retire(b, 1);
+            rc = -1;
+            break;
+        }
+        if (p)
+        {
+            iov_copy(c, p, g_block_size, write ? 0 : 1);
+            bcache_put(b);
+            if (write) mark_written((size_t)b);
+            block_io_retire(b, 1);
+            i++;
+            continue;
+        }
+
+        /* a run: adjacent, uncached, and (reading) written blocks */
+        size_t k = 1;
+        while (k < VEC_RUN_MAX && i + k < nblk && blknos[i + k] == b + (int)k)
+        {
+            size_t nb = (size_t)b + k;
+            if (!write && (unwritten_test(nb) || needs_check(nb))) break;
+            if (bcache_cached((int)nb)) break;
+            busy_claim((int)nb);
+            k++;
+        }
+
+        if (write)
+        {
+            /* checksum the run from the caller's buffers, on a copy of
+             * the cursor that iov_take then walks again */
+            struct iov_cur at = *c;
+            for (size_t j = 0; j < k; j++)
+            {
+                mark_written((size_t)b + j);
+                if (g_csum) csum_store((size_t)b + j, iov_crc(&at, g_block_size));
+            }
+        }
+
+        int n = iov_take(c, k * g_block_size, seg + used, write);
+        if (n == 0)
+        {
+            /* read past the end of the caller's buffers */
+            block_io_retire(b, k);
+        }
+        else if (bio_queue_v(write, b, k, seg + used, n, NULL, NULL) != 0)
+        {
+            block_io_retire(b, k);
+            rc = -1;
+            break;
+        }
+        used += (size_t)n;
+        i += k;
+    }
+
+    if (bio_wait() != 0) rc = -1;
+    free(seg);
+    return rc;
+}
+
+/* compressed: block by block through the cache, which inflates and
+ * deflates them; there are no device runs to merge */
+static int vec_cached(int write, const int *blknos, size_t nblk, struct iov_cur *c)
+{
+    for (size_t i = 0; i < nblk; i++)
+    {
+        int b = blknos[i];
+        if (!write && unwritten_test((size_t)b))
+        {
+            iov_copy(c, NULL, g_block_size, 1);
+            continue;
+        }
+
+        /* writev covers whole blocks, the last one zero padded */
+        uint8_t *p = bcache_get(b, write ? BCACHE_NOREAD | BCACHE_DIRTY : 0);
+        if (!p) return -1;
+        iov_copy(c, p, g_block_size, write ? 0 : 1);
+        bcache_put(b);
+        if (write) mark_written((size_t)b);
+    }
+    return 0;
+}
+
+static int block_xferv(int write, const int *blknos, size_t nblk,
+                       const struct iovec *iov, int iovcnt)
+{
+    if (vec_check(blknos, nblk, iov, iovcnt) != 0) return -1;
+    for (size_t i = 0; write && i < nblk; i++)
+    {
+        if (dedup_write(blknos[i]) != 0) return -1;
+    }
+
+    uint64_t t0 = bstat_now();
+    struct iov_cur c = { iov, iovcnt, 0, 0 };
+    int rc;
+    if (g_backend == BLOCK_BACKEND_MMAP)
+    {
+        rc = vec_map(write, blknos, nblk, &c);
+    }
+    else if (g_lzmap)
+    {
+        rc = vec_cached(write, blknos, nblk, &c);
+    }
+    else
+    {
+        rc = vec_file(write, blknos, nblk, &c);
+    }
+    /* a read stops at the end of the caller's buffers, a write pads */
+    size_t bytes = nblk * g_block_size;
+    if (!write)
+    {
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            len += iov[i].iov_len;
+        }
+        if (len < bytes) bytes = len;
+    }
+    bstat_op(write ? BLOCK_OP_WRITE : BLOCK_OP_READ, t0, rc == 0 ? bytes : 0);
+    return rc;
+}
+
+int block_readv(const int *blknos, size_t nblk, const struct iovec *iov, int iovcnt)
+{
+    return block_xferv(0, blknos, nblk, iov, iovcnt);
+}
+
+int block_writev(const int *blknos, size_t nblk, const struct iovec *iov, int iovcnt)
+{
+    return block_xferv(1, blknos, nblk, iov, iovcnt);
+}
+
+/* ---------- readahead ---------- */
+
+/* file: runs of adjacent, written, uncached blocks each become one read
+ * into the cache, submitted together; nobody waits for them. Compressed
+ * images inflate block by block in the cache, there is nothing to merge. */
+static void prefetch(const int *map, size_t n)
+{
+    size_t i = 0;
+    while (i < n)
+    {
+        int b = map[i];
+        if (!block_valid(b) || unwritten_test((size_t)b) || bcache_cached(b))
+        {
+            i++;
+            continue;
+        }
+
+        size_t k = 1;
+        while (k < BCACHE_FILL_MAX && i + k < n && map[i + k] == b + (int)k)
+        {
+            size_t nb = (size_t)b + k;
+            if (unwritten_test(nb) || bcache_cached((int)nb)) break;
+            k++;
+        }
+
+        for (size_t j = 0; j < k; j++)
+        {
+            busy_claim(b + (int)j);
+        }
+        size_t got = bcache_prefetch(b, k);
+        if (got < k)
+        {
+            /* the cache is full of pinned blocks */
+            block_io_retire(b + (int)got, k - got);
+            break;
+        }
+        i += k;
+    }
+    bio_submit();
+}
+
+void block_ra_init(struct block_ra *ra)
+{
+    ra->next   = 0;
+    ra->window = 0;
+    ra->ahead  = 0;
+}
+
+/* prefetched blocks the reader now asks for that the cache no longer
+ * holds: the window outran the cache */
+static int ra_thrashed(const int *map, size_t pos, size_t end)
+{
+    for (size_t i = pos; i < end; i++)
+    {
+        if (block_valid(map[i]) && !unwritten_test((size_t)map[i]) && !bcache_cached(map[i]))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void block_readahead(struct block_ra *ra, const int *map, size_t count,
+                     size_t pos, size_t n)
+{
+    /* the kernel already reads ahead on faults in the mapping */
+    if (!ra || !map || pos >= count || g_backend != BLOCK_BACKEND_FILE) return;
+    if (n > count - pos) n = count - pos;
+    size_t end = pos + n;
+
+    /* the window and what the reader holds must fit the cache together */
+    size_t max = BLOCK_RA_MAX;
+    if (bcache_slots() / 2 < max) max = bcache_slots() / 2;
+
+    if (pos != ra->next)
+    {
+        /* a seek: back off, and off altogether if it keeps seeking */
+        ra->window /= 4;
+        if (ra->window < BLOCK_RA_MIN) ra->window = 0;
+        ra->ahead = end;
+    }
+    else if (ra->window == 0)
+    {
+        ra->window = BLOCK_RA_MIN;
+        ra->ahead  = end;
+    }
+    else if (pos < ra->ahead && ra_thrashed(map, pos, end < ra->ahead ? end : ra->ahead))
+    {
+        ra->window /= 2;
+        if (ra->window < BLOCK_RA_MIN) ra->window = BLOCK_RA_MIN;
+        ra->ahead = end;
+    }
+    ra->next = end;
+
+    if (ra->window == 0 || g_lzmap) return;
+    if (ra->window > max) ra->window = max;
+    if (ra->ahead < end) ra->ahead = end;
+
+    /* refill once the reader is half way into what was fetched */
+    if (ra->ahead - end > ra->window / 2 || ra->ahead >= count) return;
+
+    size_t target = end + ra->window;
+    if (target > count) target = count;
+    prefetch(map + ra->ahead, target - ra->ahead);
+    ra->ahead = target;
+
+    /* still sequential: the next refill goes further */
+    ra->window *= 2;
+    if (ra->window > max) ra->window = max;
+}
+
+/* define function */
+
+/* ---------- scrub ---------- */
+
+#define SCRUB_CHUNK_BYTES (1u << 20)    /* unit of work a thread takes */
+
+struct scrub_job
+{
+    size_t chunk;               /* blocks per chunk */
+    size_t nchunks;
+    size_t next;                /* next chunk to take (atomic) */
+    pthread_mutex_t lock;       /* guards rep */
+    struct block_scrub_report *rep;
+};
+
+static void scrub_bad(struct scrub_job *j, size_t b)
+{
+    pthread_mutex_lock(&j->lock);
+    if (j->rep->errors < BLOCK_SCRUB_BAD_MAX)
+    {
+        j->rep->bad[j->rep->errors] = (int)b;
+    }
+    j->rep->errors++;
+    pthread_mutex_unlock(&j->lock);
+}
+
+/* the shell is blocked while the workers run: the bitmaps and the map
+ * hold still, so they are read without locks */
+static void *scrub_worker(void *arg)
+{
+    struct scrub_job *j = arg;
+    size_t checked = 0, skipped = 0;
+    uint8_t *buf = NULL;
+
+    uint8_t *scratch = NULL;
+
+    if (g_lzmap)
+    {
+        buf     = malloc(g_block_size);
+        scratch = malloc(g_block_size);
+    }
+    else if (g_backend == BLOCK_BACKEND_FILE)
+    {
+        buf = malloc(j->chunk * g_block_size);
+    }
+
+    for (;;)
+    {
+        size_t c = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED);
+        if (c >= j->nchunks) break;
+
+        size_t first = c * j->chunk;
+        size_t end   = first + j->chunk;
+        if (end > g_block_count) end = g_block_count;
+
+        /* only the span between the first and last block holding data */
+        while (first < end && !block_has_data(first)) first++;
+        while (end > first && !block_has_data(end - 1)) end--;
+        if (first == end) continue;
+
+        if (g_lzmap)
+        {
+            /* compressed blocks are not at their own offset: one by one */
+            for (size_t b = first; b < end; b++)
+            {
+                if (!block_has_data(b)) continue;
+                checked++;
+                if (!buf || !scratch || blz_read((int)b, buf, scratch) != 0 ||
+                    crc32c(0, buf, g_block_size) != g_csum[b]) {
+                    scrub_bad(j, b);
+                }
+            }
+            continue;
+        }
+
+        const uint8_t *data;
+        if (g_backend == BLOCK_BACKEND_MMAP)
+        {
+            data = block_ptr((int)first);
+        }
+        else
+        {
+            size_t len = (end - first) * g_block_size;
+            off_t off  = (off_t)g_hdr.data_off + (off_t)first * (off_t)g_block_size;
+            if (!buf || pread(g_fd, buf, len, off) != (ssize_t)len)
+            {
+                for (size_t b = first; b < end; b++)
+                {
+                    if (block_has_data(b)) scrub_bad(j, b);
+                }
+                continue;
+            }
+            data = buf;
+        }
+
+        for (size_t b = first; b < end; b++)
+        {
+            if (!block_has_data(b)) continue;
+            /* mmap: the table describes the last save, not the map */
+            if (dset_test(&g_dirty_data, b))
+            {
+                skipped++;
+                continue;
+            }
+            checked++;
+            if (crc32c(0, data + (b - first) * g_block_size, g_block_size) != g_csum[b])
+            {
+                scrub_bad(j, b);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&j->lock);
+    j->rep->checked += checked;
+    j->rep->skipped += skipped;
+    pthread_mutex_unlock(&j->lock);
+    free(buf);
+    free(scratch);
+    return NULL;
+}
+
+int block_scrub(unsigned threads, struct block_scrub_report *rep)
+{
+    if (!rep) return -1;
+    memset(rep, 0, sizeof(*rep));
+    if (!g_csum) return -1;
+
+    /* file backend: get the cache's dirty blocks (and their checksums)
+     * to the device first, so the device is what the table describes */
+    if (g_backend == BLOCK_BACKEND_FILE && bcache_flush() != 0) return -1;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    struct scrub_job job;
+    job.chunk = SCRUB_CHUNK_BYTES / g_block_size;
+    if (job.chunk < BITMAP_WORD_BITS) job.chunk = BITMAP_WORD_BITS;
+    job.nchunks = (g_block_count + job.chunk - 1) / job.chunk;
+    job.next    = 0;
+    job.rep     = rep;
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (threads == 0)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (unsigned)n : 1;
+    }
+    if (threads > job.nchunks) threads = (unsigned)job.nchunks;
+    if (threads > 64) threads = 64;
+
+    /* the calling thread is worker 0 */
+    pthread_t tid[64];
+    unsigned started = 1;
+    for (; started < threads; started++)
+    {
+        if (pthread_create(&tid[started], NULL, scrub_worker, &job) != 0) break;
+    }
+    scrub_worker(&job);
+    for (unsigned i = 1; i < started; i++)
+    {
+        pthread_join(tid[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    rep->threads = started;
+    rep->seconds = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    g_csum_errors += rep->errors;
+    return rep->errors ? -1 : 0;
+}
@@ -3,33 +3,207 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>    /* struct iovec */
 
-#define BLOCK_SIZE     512          /* bytes per block */
-#define BLOCK_COUNT    1024         /* total blocks (512 KB total) */
+/* device geometry is stored in the disk.img header and read at load time;
+ * these only bound what block_format() accepts */
+#define BLOCK_SIZE_MIN       512          /* bytes per block */
+#define BLOCK_SIZE_MAX       65536
+#define BLOCK_SIZE_DEFAULT   512
+#define BLOCK_COUNT_MIN      64
+#define BLOCK_COUNT_MAX      0x40000000u  /* 1G blocks, fits an int blkno */
+#define BLOCK_COUNT_DEFAULT  1024         /* 512 KB with default blocks */
+
+
+/* backends: where the block storage lives */
+#define BLOCK_BACKEND_MMAP   0            /* whole image mapped (default) */
+#define BLOCK_BACKEND_FILE   1            /* pread/pwrite + bounded buffer cache */
+#define BLOCK_CACHE_DEFAULT  256          /* cache slots (blocks), file backend */
+#define BLOCK_QUEUE_DEPTH_DEFAULT 64      /* io_uring entries, file backend */
 
 
 // Init / info
 int  block_init(void);
+/* choose the backend for the next load/format; cache_blocks 0 = keep */
+int  block_set_backend(int backend, size_t cache_blocks);
+/* io_uring queue depth for the next file backend; 0 = pread/pwrite */
+int  block_set_queue_depth(unsigned depth);
+const char *block_io_engine(void);  /* "mmap", "io_uring" or "pread" */
+/* per-block CRC32C for images formatted from now on (default on) */
+int  block_set_checksums(int on);
+int  block_checksums(void);         /* the current image has them */
+size_t block_csum_errors(void);     /* mismatches seen since load */
+/* transparent compression for images formatted from now on: the image
+ * file keeps block_count blocks' worth of storage and offers `ratio`
+ * times as many blocks, stored compressed (0 or 1 = off). Compressed
+ * images always use the file backend. */
+#define BLOCK_LZ_RATIO_MAX   8
+int  block_set_compression(unsigned ratio);
+int  block_compressed(void);
+size_t block_stored_size(void);     /* bytes the used blocks take on disk
+                                     * (writes back the cache first) */
+size_t block_phys_size(void);       /* bytes of storage in the image */
+/* deduplication for images formatted from now on (default off): blocks
+ * stored through block_store() are found again by content, and
+ * block_share() lets another owner reference a block without a copy.
+ * A block with several owners is read only: block_cow() returns a block
+ * the caller may write (a private copy, or the same block once it has a
+ * single owner). block_free() drops one owner. */
+int  block_set_dedup(int on);
+int  block_dedup(void);
+/* the reference counts alone, for images formatted from now on (default
+ * off): block_share() and block_cow() work, so snapshots and cp can
+ * share blocks, but nothing is hashed or found by content. Dedup images
+ * have them too. */
+int  block_set_refcounts(int on);
+int  block_refcounts(void);
+size_t block_dedup_saved(void);     /* blocks not stored thanks to sharing */
+void block_close(void);             /* unmap device, close disk.img */
+size_t block_size(void);            /* bytes per block */
 size_t block_total_size(void);      /* total bytes */
 size_t block_used_size(void);       /* used bytes */
 size_t block_free_size(void);       /* free bytes */
 size_t block_total_blocks(void);
 size_t block_used_blocks(void);
 size_t block_free_blocks(void);
-int block_load_image(const char *filename);
-int block_save_image(const char *filename);
 
 // Allocate / free
 int  block_alloc(void);              /* return block index, -1 if full */
+/* contiguous run of up to `want` blocks: first run long enough, else the
+ * longest free run; *got < want means call again for the rest */
+int  block_alloc_range(size_t want, int *start, size_t *got);
 void block_free(int blkno);
+/* deferred frees: while on, block_free keeps the block allocated (not
+ * reusable) until block_commit_frees(), so storage an older on-disk
+ * state may still point at is not overwritten before that state is
+ * superseded (see the metadata journal). Turning it off commits. */
+void block_defer_frees(int on);
+void block_commit_frees(void);
+int  block_allocated(int blkno);    /* bit set in the bitmap */
+/* allocation groups: the device is split into groups of adjacent blocks,
+ * each with its own free space and lock, so threads allocating in
+ * different groups do not contend. Allocation starts in the goal group
+ * and spills into the following ones; BLOCK_GROUP_ANY is the calling
+ * CPU's group, which is also what block_alloc and block_alloc_range use.
+ * Allocation and block_free may run on several threads on the mmap
+ * backend without dedup; block I/O, the buffer cache and the dedup index
+ * still expect one. */
+#define BLOCK_GROUP_ANY (-1)
+unsigned block_groups(void);
+int  block_group_of(int blkno);
+int  block_alloc_group(int group);
+int  block_alloc_range_group(int group, size_t want, int *start, size_t *got);
 int  block_reserve(int blkno); 
+/* contents no longer needed: the blocks read as zeros from now on and
+ * their storage is released where whole pages allow (holes) */
+int  block_discard(int start, size_t n);
 
 // IO
 int  block_read(int blkno, void *buf);
 int  block_write(int blkno, const void *buf);
+/* allocate a block holding buf, or share one that already does (dedup) */
+int  block_store(const void *buf);
+int  block_share(int blkno);        /* one more owner; -1 without refcounts */
+int  block_cow(int blkno);          /* writable block with blkno's contents */
+
+/* zero-copy access: pointer to the block's storage, valid until unpin.
+ * A BLOCK_PIN_WRITE pin may be written through and marks the block dirty.
+ * Add BLOCK_PIN_WHOLE when the caller stores every byte of the block: the
+ * old contents are then neither read nor zeroed. */
+#define BLOCK_PIN_READ   0x1
+#define BLOCK_PIN_WRITE  0x2
+#define BLOCK_PIN_WHOLE  0x4
+void *block_pin(int blkno, int flags);
+void  block_unpin(int blkno);
+
+/* asynchronous I/O: queue many transfers, let the file backend submit
+ * them together (io_uring when the kernel allows it). buf must stay valid
+ * until done() runs, which may happen before the call returns (mmap,
+ * cache hit, pread fallback). block_io_wait() submits whatever is queued
+ * and waits for all of it; -1 if any transfer since the last wait failed. */
+typedef void (*block_io_done)(int blkno, int err, void *arg);
+int  block_read_async(int blkno, void *buf, block_io_done done, void *arg);
+int  block_write_async(int blkno, const void *buf, block_io_done done, void *arg);
+int  block_io_wait(void);
+
+/* vectored I/O: the blocks blknos[0..nblk) taken in order form one byte
+ * stream, scattered into / gathered from iov. Adjacent block numbers are
+ * merged into single transfers. readv may ask for less than nblk blocks'
+ * worth of bytes (a file's tail); writev zero-fills the rest of the last
+ * block. Both wait for completion, including earlier async transfers. */
+int  block_readv(const int *blknos, size_t nblk, const struct iovec *iov, int iovcnt);
+int  block_writev(const int *blknos, size_t nblk, const struct iovec *iov, int iovcnt);
+
+/* readahead: one struct block_ra per stream reading a file's block map.
+ * Before reading map[pos..pos+n), call block_readahead(): a read that
+ * continues where the last one ended is sequential and grows the window
+ * (doubling from BLOCK_RA_MIN up to BLOCK_RA_MAX blocks), a seek shrinks
+ * it and turns it off when it gets below the minimum. With a window, the
+ * blocks after the read are queued into the buffer cache and read in the
+ * background. The window is refilled once the reader is half way through
+ * it, and halved when prefetched blocks were evicted before being read.
+ * File backend only (the kernel reads ahead in the mmap one); nothing
+ * here fails, readahead is a hint. */
+#define BLOCK_RA_MIN 4
+#define BLOCK_RA_MAX 128
+struct block_ra
+{
+    size_t next;        /* map index a sequential read starts at */
+    size_t window;      /* blocks fetched ahead, 0 = off */
+    size_t ahead;       /* map index up to which blocks were fetched */
+};
+void block_ra_init(struct block_ra *ra);
+void block_readahead(struct block_ra *ra, const int *map, size_t count,
+                     size_t pos, size_t n);
+
+/* scrub: verify every block holding data against its checksum, spread
+ * over `threads` workers (0 = one per CPU). Blocks changed since the
+ * last save (mmap backend) are counted as skipped. 0 if all matched. */
+#define BLOCK_SCRUB_BAD_MAX 8
+struct block_scrub_report
+{
+    size_t   checked;
+    size_t   skipped;
+    size_t   errors;
+    int      bad[BLOCK_SCRUB_BAD_MAX];  /* first mismatching blocks */
+    unsigned threads;
+    double   seconds;
+};
+int  block_scrub(unsigned threads, struct block_scrub_report *rep);
+
+/* statistics: calls, bytes moved, buffer cache hits and misses and
+ * latency histograms since start (or the last block_stats_reset). Each
+ * thread counts on its own, block_stats_get() sums them. Latency bucket i
+ * holds calls that took [2^i, 2^(i+1)) ns, the last bucket everything
+ * slower; asynchronous calls are counted but not timed. */
+enum { BLOCK_OP_READ, BLOCK_OP_WRITE, BLOCK_OP_ALLOC, BLOCK_OP_FREE, BLOCK_OP_COUNT };
+#define BLOCK_LAT_BUCKETS 32
+struct block_stats
+{
+    uint64_t ops[BLOCK_OP_COUNT];
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t cache_hits;        /* file backend */
+    uint64_t cache_misses;
+    uint64_t alloc_failed;
+    uint64_t lat_ns[BLOCK_OP_COUNT];    /* total time of the timed calls */
+    uint64_t lat[BLOCK_OP_COUNT][BLOCK_LAT_BUCKETS];
+};
+void block_stats_get(struct block_stats *st);
+void block_stats_reset(void);
+const char *block_op_name(int op);
 
-int block_load_image(const char *path);  /* disk.img -> memory */
-int block_save_image(const char *path);  /* memory -> disk.img */
+/* mkfs: create (or overwrite) disk.img with the given geometry and map it */
+int block_format(const char *path, size_t block_size, size_t block_count);
+/* map disk.img as the device: 0, BLOCK_NO_IMAGE when there is no file
+ * at path, -1 when it exists but cannot be used (left untouched) */
+#define BLOCK_NO_IMAGE 1
+int block_load_image(const char *path);
+int block_save_image(const char *path);  /* msync, or full dump to another file */
+/* make blocks [start, start+n) durable in the image now: their data,
+ * their checksum / compression / dedup entries and the bitmap words that
+ * mark them used. The rest waits for the next save. */
+int block_sync(int start, size_t n);
 
 
 
@@ -0,0 +1,756 @@
+#define _GNU_SOURCE /* sched_getcpu */
+
+/*standard lib */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+/*standard lib done*/
+
+#include "block.h"
+#include "block_internal.h"
+
+/* free-space bitmap
+ * packed 64 blocks per word; the search skips full words and uses ctz on
+ * the first word with a hole. The hint rotates (next-fit) so consecutive
+ * allocations continue where the last one stopped instead of rescanning
+ * the front of the group. */
+static uint64_t *g_bitmap;
+static size_t    g_words;
+static size_t    g_count;
+
+#define WORD_FULL (~(uint64_t)0)
+
+/* free-extent index
+ * every run of free blocks is one node of a treap keyed by start block.
+ * Each node also carries the longest run in its subtree, so "first run of
+ * at least n blocks" is a single O(log n) descent. The bitmap stays the
+ * source of truth on disk; the index is rebuilt from it at attach. */
+struct fext
+{
+    uint32_t start;
+    uint32_t len;
+    uint32_t maxlen;    /* max len in this subtree */
+    uint32_t prio;
+    struct fext *l;
+    struct fext *r;
+};
+
+/* allocation groups
+ * the device is cut into groups of whole bitmap words, each with its own
+ * slice of the bitmap, free-extent treap, hint and lock; a free run never
+ * crosses a group. Threads allocating in different groups share nothing
+ * but the dirty marks, which block.c sets atomically. The group count
+ * depends only on the device size, so an image lays out the same way on
+ * any machine. */
+#define GROUP_MIN_BLOCKS  512
+#define GROUPS_MAX        64
+
+struct bgroup
+{
+    _Alignas(64) pthread_mutex_t lock;
+    size_t   first;         /* block */
+    size_t   count;
+    size_t   used;          /* read without the lock for totals */
+    size_t   hint;          /* word index to start the next search at */
+    struct fext *root;
+    uint32_t seed;          /* treap priorities */
+};
+
+static struct bgroup *g_groups;
+static size_t         g_ngroups;
+static size_t         g_group_blocks;
+
+/* deferred frees (block_defer_frees): blocks stay allocated, and so not
+ * reusable, until block_commit_frees() */
+static pthread_mutex_t g_defer_lock = PTHREAD_MUTEX_INITIALIZER;
+static int    g_defer;
+static int   *g_deferred;
+static size_t g_ndeferred;
+static size_t g_deferred_cap;
+
+static inline unsigned bit_popcount64(uint64_t v)
+{
+#if defined(__GNUC__)
+    return (unsigned)__builtin_popcountll(v);
+#else
+    unsigned n = 0;
+    while (v) { v &= v - 1; n++; }
+    return n;
+#endif
+}
+
+static inline int bit_test(size_t blk)
+{
+    return (g_bitmap[blk / BITMAP_WORD_BITS] >> (blk % BITMAP_WORD_BITS)) & 1;
+}
+
+/* every bitmap change marks its word for the next incremental save */
+static inline void bit_set(size_t blk)
+{
+    g_bitmap[blk / BITMAP_WORD_BITS] |= (uint64_t)1 << (blk % BITMAP_WORD_BITS);
+    block_bitmap_dirty(blk / BITMAP_WORD_BITS);
+}
+
+static inline void bit_clear(size_t blk)
+{
+    g_bitmap[blk / BITMAP_WORD_BITS] &= ~((uint64_t)1 << (blk % BITMAP_WORD_BITS));
+    block_bitmap_dirty(blk / BITMAP_WORD_BITS);
+}
+
+static inline struct bgroup *group_of(size_t blk)
+{
+    return &g_groups[blk / g_group_blocks];
+}
+
+static inline size_t group_word_end(const struct bgroup *g)
+{
+    return BITMAP_WORDS(g->first + g->count);
+}
+
+/* first word in [from, to) with a free bit, or `to` */
+static size_t find_free_word(size_t from, size_t to)
+{
+    size_t w = from;
+
+    /* four full words at a time; the AND folds to one compare */
+    while (w + 4 <= to &&
+           (g_bitmap[w] & g_bitmap[w + 1] & g_bitmap[w + 2] & g_bitmap[w + 3]) == WORD_FULL)
+    {
+        w += 4;
+    }
+    while (w < to && g_bitmap[w] == WORD_FULL)
+    {
+        w++;
+    }
+    return w;
+}
+
+/* ---------- free-extent treap ---------- */
+
+static uint32_t fext_prio(struct bgroup *g)
+{
+    /* xorshift32: only needs to look random to the treap */
+    g->seed ^= g->seed << 13;
+    g->seed ^= g->seed >> 17;
+    g->seed ^= g->seed << 5;
+    return g->seed;
+}
+
+static inline uint32_t fext_max(const struct fext *t)
+{
+    return t ? t->maxlen : 0;
+}
+
+static void fext_update(struct fext *t)
+{
+    uint32_t m = t->len;
+    if (fext_max(t->l) > m) m = fext_max(t->l);
+    if (fext_max(t->r) > m) m = fext_max(t->r);
+    t->maxlen = m;
+}
+
+static struct fext *fext_new(struct bgroup *g, uint32_t start, uint32_t len)
+{
+    struct fext *n = malloc(sizeof(*n));
+    if (!n) return NULL;
+    n->start  = start;
+    n->len    = len;
+    n->maxlen = len;
+    n->prio   = fext_prio(g);
+    n->l = n->r = NULL;
+    return n;
+}
+
+/* l: start < key, r: start >= key */
+static void fext_split(struct fext *t, uint32_t key, struct fext **l, struct fext **r)
+{
+    if (!t) { *l = *r = NULL; return; }
+
+    if (t->start < key)
+    {
+        fext_split(t->r, key, &t->r, r);
+        *l = t;
+    }
+    else
+    {
+        fext_split(t->l, key, l, &t->l);
+        *r = t;
+    }
+    fext_update(t);
+}
+
+/* every start in a is below every start in b */
+static struct fext *fext_merge(struct fext *a, struct fext *b)
+{
+    if (!a) return b;
+    if (!b) return a;
+
+    if (a->prio > b->prio)
+    {
+        a->r = fext_merge(a->r, b);
+        fext_update(a);
+        return a;
+    }
+    b->l = fext_merge(a, b->l);
+    fext_update(b);
+    return b;
+}
+
+static struct fext *fext_pop_last(struct fext **t)
+{
+    if (!*t) return NULL;
+    if ((*t)->r)
+    {
+        struct fext *n = fext_pop_last(&(*t)->r);
+        fext_update(*t);
+        return n;
+    }
+    struct fext *n = *t;
+    *t = n->l;
+    n->l = NULL;
+    return n;
+}
+
+static struct fext *fext_pop_first(struct fext **t)
+{
+    if (!*t) return NULL;
+    if ((*t)->l)
+    {
+        struct fext *n = fext_pop_first(&(*t)->l);
+        fext_update(*t);
+        return n;
+    }
+    struct fext *n = *t;
+    *t = n->r;
+    n->r = NULL;
+    return n;
+}
+
+static void fext_destroy(struct fext *t)
+{
+    if (!t) return;
+    fext_destroy(t->l);
+    fext_destroy(t->r);
+    free(t);
+}
+
+/* put [start, start+len) back, merging with the neighbours */
+static void fext_insert(struct bgroup *g, uint32_t start, uint32_t len)
+{
+    struct fext *l, *r;
+    fext_split(g->root, start, &l, &r);
+
+    struct fext *node = fext_pop_last(&l);
+    if (node && node->start + node->len == start)
+    {
+        node->len += len;
+    }
+    else
+    {
+        l = fext_merge(l, node);
+        node = fext_new(g, start, len);
+        if (!node)
+        {
+            /* out of memory: the bitmap is still right, the index just
+             * forgets this run until the next attach */
+            g->root = fext_merge(l, r);
+            return;
+        }
+    }
+
+    struct fext *next = fext_pop_first(&r);
+    if (next && node->start + node->len == next->start)
+    {
+        node->len += next->len;
+        free(next);
+    }
+    else
+    {
+        r = fext_merge(next, r);
+    }
+
+    node->l = node->r = NULL;
+    fext_update(node);
+    g->root = fext_merge(fext_merge(l, node), r);
+}
+
+/* remove [start, start+len) which must lie inside one free run */
+static void fext_take(struct bgroup *g, uint32_t start, uint32_t len)
+{
+    struct fext *l, *r;
+    fext_split(g->root, start + 1, &l, &r);
+
+    struct fext *node = fext_pop_last(&l);
+    if (!node || node->start + node->len < start + len)
+    {
+        /* not indexed (see fext_insert); nothing to carve */
+        g->root = fext_merge(fext_merge(l, node), r);
+        return;
+    }
+
+    uint32_t end  = node->start + node->len;
+    uint32_t head = start - node->start;
+    uint32_t tail = end - (start + len);
+
+    struct fext *tail_node = NULL;
+    if (head && tail)
+    {
+        tail_node = fext_new(g, start + len, tail);
+        if (!tail_node) tail = 0;       /* forget the tail, see above */
+    }
+
+    if (head)
+    {
+        node->len = head;
+        fext_update(node);
+        l = fext_merge(l, node);
+    }
+    else if (tail)
+    {
+        node->start = start + len;
+        node->len   = tail;
+        fext_update(node);
+        l = fext_merge(l, node);
+    }
+    else
+    {
+        free(node);
+    }
+
+    g->root = fext_merge(fext_merge(l, tail_node), r);
+}
+
+/* leftmost run with len >= want */
+static const struct fext *fext_first_fit(const struct bgroup *g, uint32_t want)
+{
+    const struct fext *t = g->root;
+    while (t && t->maxlen >= want)
+    {
+        if (fext_max(t->l) >= want) t = t->l;
+        else if (t->len >= want) return t;
+        else t = t->r;
+    }
+    return NULL;
+}
+
+static const struct fext *fext_largest(const struct bgroup *g)
+{
+    const struct fext *t = g->root;
+    while (t)
+    {
+        if (t->len == t->maxlen) return t;
+        t = (fext_max(t->l) == t->maxlen) ? t->l : t->r;
+    }
+    return NULL;
+}
+
+/* runs end at the group's end: groups never share a run */
+static void fext_build(struct bgroup *g)
+{
+    size_t b     = g->first;
+    size_t end   = g->first + g->count;
+    size_t words = group_word_end(g);
+
+    while (b < end)
+    {
+        /* next free bit */
+        size_t w = find_free_word(b / BITMAP_WORD_BITS, words);
+        if (w == words) break;
+        uint64_t v = ~g_bitmap[w];
+        if (w == b / BITMAP_WORD_BITS) v &= WORD_FULL << (b % BITMAP_WORD_BITS);
+        if (!v) { b = (w + 1) * BITMAP_WORD_BITS; continue; }
+        size_t start = w * BITMAP_WORD_BITS + bit_ctz64(v);
+
+        /* next used bit (padding bits are used, so this stops at g_count) */
+        size_t e = start;
+        size_t ew = e / BITMAP_WORD_BITS;
+        uint64_t u = g_bitmap[ew] & (WORD_FULL << (e % BITMAP_WORD_BITS));
+        while (!u && ++ew < words) u = g_bitmap[ew];
+        e = (ew < words) ? ew * BITMAP_WORD_BITS + bit_ctz64(u) : end;
+        if (e > end) e = end;
+
+        /* runs come in ascending order: append on the right */
+        struct fext *n = fext_new(g, (uint32_t)start, (uint32_t)(e - start));
+        if (n) g->root = fext_merge(g->root, n);
+        b = e;
+    }
+}
+
+/* ---------- attach ---------- */
+
+/* no memory for the groups: the device is left without free space */
+void balloc_attach(uint64_t *bitmap, size_t block_count)
+{
+    g_bitmap = bitmap;
+    g_count  = block_count;
+    g_words  = BITMAP_WORDS(block_count);
+
+    /* bits past the last block are permanently "used" so the search never
+     * returns them; they are not counted */
+    size_t tail = block_count % BITMAP_WORD_BITS;
+    if (tail)
+    {
+        g_bitmap[g_words - 1] |= WORD_FULL << tail;
+    }
+
+    size_t n = block_count / GROUP_MIN_BLOCKS;
+    if (n < 1) n = 1;
+    if (n > GROUPS_MAX) n = GROUPS_MAX;
+    size_t per = BITMAP_WORDS((block_count + n - 1) / n) * BITMAP_WORD_BITS;
+    n = (block_count + per - 1) / per;
+
+    g_groups = aligned_alloc(_Alignof(struct bgroup), n * sizeof(struct bgroup));
+    if (!g_groups) return;
+    g_ngroups      = n;
+    g_group_blocks = per;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        struct bgroup *g = &g_groups[i];
+        memset(g, 0, sizeof(*g));
+        pthread_mutex_init(&g->lock, NULL);
+        g->first = i * per;
+        g->count = (i + 1 == n) ? block_count - g->first : per;
+        g->hint  = g->first / BITMAP_WORD_BITS;
+        g->seed  = 0x9e3779b9u + (uint32_t)i;
+
+        size_t used = 0;
+        for (size_t w = g->hint; w < group_word_end(g); w++)
+        {
+            used += bit_popcount64(g_bitmap[w]);
+        }
+        g->used = used - ((i + 1 == n && tail) ? BITMAP_WORD_BITS - tail : 0);
+
+        fext_build(g);
+    }
+}
+
+void balloc_detach(void)
+{
+    free(g_deferred);
+    g_deferred     = NULL;
+    g_ndeferred    = 0;
+    g_deferred_cap = 0;
+    g_defer        = 0;
+
+    for (size_t i = 0; i < g_ngroups; i++)
+    {
+        fext_destroy(g_groups[i].root);
+        pthread_mutex_destroy(&g_groups[i].lock);
+    }
+    free(g_groups);
+    g_groups  = NULL;
+    g_ngroups = 0;
+
+    g_bitmap = NULL;
+    g_words  = 0;
+    g_count  = 0;
+}
+
+int balloc_test(size_t blk)
+{
+    return bit_test(blk);
+}
+
+/* ---------- per-group allocation (caller holds g->lock) ---------- */
+
+static int group_alloc(struct bgroup *g)
+{
+    if (g->used >= g->count) return -1;
+
+    size_t from = g->first / BITMAP_WORD_BITS;
+    size_t to   = group_word_end(g);
+    size_t w = find_free_word(g->hint, to);
+    if (w == to)
+    {
+        w = find_free_word(from, g->hint);
+        if (w == g->hint) return -1;
+    }
+
+    size_t blk = w * BITMAP_WORD_BITS + bit_ctz64(~g_bitmap[w]);
+    bit_set(blk);
+    __atomic_store_n(&g->used, g->used + 1, __ATOMIC_RELAXED);
+    g->hint = w;
+    fext_take(g, (uint32_t)blk, 1);
+    return (int)blk;
+}
+
+static void group_take(struct bgroup *g, uint32_t s, uint32_t n)
+{
+    for (uint32_t b = s; b < s + n; b++)
+    {
+        bit_set(b);
+    }
+    __atomic_store_n(&g->used, g->used + n, __ATOMIC_RELAXED);
+    fext_take(g, s, n);
+}
+
+/* goal group: BLOCK_GROUP_ANY is the calling CPU's */
+static size_t group_goal(int group)
+{
+    if (group >= 0) return (size_t)group % g_ngroups;
+
+    int cpu = sched_getcpu();
+    return cpu > 0 ? (size_t)cpu % g_ngroups : 0;
+}
+
+/* define function */
+size_t block_used_blocks(void)
+{
+    size_t used = 0;
+    for (size_t i = 0; i < g_ngroups; i++)
+    {
+        used += __atomic_load_n(&g_groups[i].used, __ATOMIC_RELAXED);
+    }
+    return used;
+}
+
+size_t block_free_blocks(void)
+{
+    return g_count - block_used_blocks();
+}
+
+size_t block_used_size(void)
+{
+    return block_used_blocks() * block_size();
+}
+
+size_t block_free_size(void)
+{
+    return block_free_blocks() * block_size();
+}
+
+unsigned block_groups(void)
+{
+    return (unsigned)g_ngroups;
+}
+
+int block_group_of(int blkno)
+{
+    if (!block_valid(blkno) || !g_groups) return -1;
+    return (int)((size_t)blkno / g_group_blocks);
+}
+
+int block_reserve(int blkno)
+{
+    if (!block_valid(blkno) || !g_groups) return -1;
+
+    struct bgroup *g = group_of((size_t)blkno);
+    pthread_mutex_lock(&g->lock);
+    int fresh = !bit_test((size_t)blkno);
+    if (fresh)
+    {
+        group_take(g, (uint32_t)blkno, 1);
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    if (fresh) block_claim(blkno, 1);
+    return 0;
+}
+
+/* the goal group first, then the ones after it: a full group spills into
+ * its neighbours, not to the front of the device */
+static int alloc_one(int group)
+{
+    if (!g_groups) return -1;
+
+    size_t goal = group_goal(group);
+    for (size_t k = 0; k < g_ngroups; k++)
+    {
+        struct bgroup *g = &g_groups[(goal + k) % g_ngroups];
+        if (__atomic_load_n(&g->used, __ATOMIC_RELAXED) >= g->count) continue;
+
+        pthread_mutex_lock(&g->lock);
+        int blk = group_alloc(g);
+        pthread_mutex_unlock(&g->lock);
+
+        if (blk >= 0)
+        {
+            /* no memset: a free block is unwritten and reads as zeros already */
+            block_claim(blk, 1);
+            return blk;
+        }
+    }
+    return -1;
+}
+
+int block_alloc_group(int group)
+{
+    uint64_t t0 = bstat_now();
+    int blk = alloc_one(group);
+    bstat_op(BLOCK_OP_ALLOC, t0, 0);
+    if (blk < 0) bstat_alloc_failed();
+    return blk;
+}
+
+int block_alloc(void)
+{
+    return block_alloc_group(BLOCK_GROUP_ANY);
+}
+
+/* caller holds g->lock, which this drops */
+static void range_take(struct bgroup *g, const struct fext *e, size_t want,
+                       int *start, size_t *got)
+{
+    uint32_t s = e->start;
+    uint32_t n = e->len < want ? e->len : (uint32_t)want;
+    group_take(g, s, n);
+    pthread_mutex_unlock(&g->lock);
+
+    block_claim((int)s, n);
+    *start = (int)s;
+    *got   = n;
+}
+
+static int alloc_run(int group, size_t want, int *start, size_t *got)
+{
+    if (!start || !got || want == 0 || !g_groups) return -1;
+
+    /* first run long enough, nearest group first; runs never span groups */
+    size_t goal = group_goal(group);
+    struct bgroup *best = NULL;
+    uint32_t best_len = 0;
+    for (size_t k = 0; k < g_ngroups; k++)
+    {
+        struct bgroup *g = &g_groups[(goal + k) % g_ngroups];
+        if (__atomic_load_n(&g->used, __ATOMIC_RELAXED) >= g->count) continue;
+
+        pthread_mutex_lock(&g->lock);
+        const struct fext *e = fext_first_fit(g, (uint32_t)want);
+        if (e)
+        {
+            range_take(g, e, want, start, got);
+            return 0;
+        }
+        e = fext_largest(g);
+        if (e && e->len > best_len)
+        {
+            best     = g;
+            best_len = e->len;
+        }
+        pthread_mutex_unlock(&g->lock);
+    }
+    if (!best) return -1;
+
+    /* no run is long enough: hand out the longest one (another thread
+     * may have shortened it since) */
+    pthread_mutex_lock(&best->lock);
+    const struct fext *e = fext_largest(best);
+    if (!e)
+    {
+        pthread_mutex_unlock(&best->lock);
+        return -1;
+    }
+    range_take(best, e, want, start, got);
+    return 0;
+}
+
+int block_alloc_range_group(int group, size_t want, int *start, size_t *got)
+{
+    uint64_t t0 = bstat_now();
+    int rc = alloc_run(group, want, start, got);
+    bstat_op(BLOCK_OP_ALLOC, t0, 0);
+    if (rc != 0) bstat_alloc_failed();
+    return rc;
+}
+
+int block_alloc_range(size_t want, int *start, size_t *got)
+{
+    return block_alloc_range_group(BLOCK_GROUP_ANY, want, start, got);
+}
+
+static void free_now(int blkno)
+{
+    /* discard while the block is still ours: once its bit is clear
+     * another thread may allocate and write it */
+    block_discard(blkno, 1);
+
+    struct bgroup *g = group_of((size_t)blkno);
+    pthread_mutex_lock(&g->lock);
+    if (bit_test((size_t)blkno))
+    {
+        bit_clear((size_t)blkno);
+        __atomic_store_n(&g->used, g->used - 1, __ATOMIC_RELAXED);
+        fext_insert(g, (uint32_t)blkno, 1);
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+/* queue a deferred free; 0: not deferring (or no memory), free it now */
+static int defer_push(int blkno)
+{
+    pthread_mutex_lock(&g_defer_lock);
+    int ok = g_defer;
+    if (ok && g_ndeferred == g_deferred_cap)
+    {
+        size_t cap = g_deferred_cap ? g_deferred_cap * 2 : 64;
+        int *n = realloc(g_deferred, cap * sizeof(*n));
+        if (n)
+        {
+            g_deferred     = n;
+            g_deferred_cap = cap;
+        }
+        else
+        {
+            ok = 0;
+        }
+    }
+    if (ok) g_deferred[g_ndeferred++] = blkno;
+    pthread_mutex_unlock(&g_defer_lock);
+    return ok;
+}
+
+static void free_one(int blkno)
+{
+    if (!block_valid(blkno) || !g_groups)
+        return;
+
+    /* a shared block only loses one of its owners */
+    if (block_unref(blkno))
+        return;
+
+    if (defer_push(blkno))
+        return;
+    free_now(blkno);
+}
+
+void block_free(int blkno)
+{
+    uint64_t t0 = bstat_now();
+    free_one(blkno);
+    bstat_op(BLOCK_OP_FREE, t0, 0);
+}
+
+void block_defer_frees(int on)
+{
+    pthread_mutex_lock(&g_defer_lock);
+    g_defer = on ? 1 : 0;
+    pthread_mutex_unlock(&g_defer_lock);
+    if (!on) block_commit_frees();
+}
+
+void block_commit_frees(void)
+{
+    pthread_mutex_lock(&g_defer_lock);
+    int   *list = g_deferred;
+    size_t n    = g_ndeferred;
+    g_deferred     = NULL;
+    g_ndeferred    = 0;
+    g_deferred_cap = 0;
+    pthread_mutex_unlock(&g_defer_lock);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        free_now(list[i]);
+    }
+    free(list);
+}
+
+int block_allocated(int blkno)
+{
+    return block_valid(blkno) && g_groups && bit_test((size_t)blkno);
+}
+
+/* define function */
@@ -0,0 +1,435 @@
+#define _GNU_SOURCE /* pread / pwrite */
+
+/*standard lib */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+/*standard lib done*/
+
+#include "block.h"
+#include "block_internal.h"
+
+/* buffer cache for the file backend
+ * a fixed array of slots, each holding one block. Lookup is a chained
+ * hash on the block number; replacement is CLOCK (second chance), and
+ * pinned slots are never chosen. Dirty slots are written back when they
+ * are evicted or on bcache_flush(). */
+struct bslot
+{
+    int      blkno;     /* -1 = empty */
+    int      next;      /* hash chain, slot index or -1 */
+    uint32_t pins;
+    uint8_t  ref;       /* CLOCK reference bit */
+    uint8_t  dirty;
+    uint8_t  loading;   /* readahead still in flight, see bcache_prefetch */
+};
+
+static struct bslot *g_slots;
+static uint8_t      *g_mem;         /* nslots * bsize */
+static size_t        g_nslots;
+static int          *g_hash;        /* bucket -> first slot, -1 = empty */
+static size_t        g_hmask;
+static size_t        g_hand;        /* CLOCK hand */
+
+static int    g_fd = -1;
+static size_t g_bsize;
+static off_t  g_data_off;
+
+static inline size_t hash_blk(int blkno)
+{
+    return ((uint32_t)blkno * 2654435761u) & g_hmask;
+}
+
+static inline uint8_t *slot_mem(size_t i)
+{
+    return g_mem + i * g_bsize;
+}
+
+/* a transfer still in flight on the ring may target this very block.
+ * Every block entering the cache is checked against its checksum, every
+ * block leaving it updates the checksum. Compressed images store blocks
+ * through block_lz.c instead of at their own offset. */
+static int dev_read(int blkno, uint8_t *buf)
+{
+    if (bio_inflight()) bio_drain();
+
+    if (blz_active())
+    {
+        if (blz_read(blkno, buf, NULL) != 0) return -1;
+    }
+    else
+    {
+        off_t off = g_data_off + (off_t)blkno * (off_t)g_bsize;
+        if (pread(g_fd, buf, g_bsize, off) != (ssize_t)g_bsize) return -1;
+    }
+    return block_csum_check(blkno, buf);
+}
+
+static int dev_write(int blkno, const uint8_t *buf)
+{
+    if (bio_inflight()) bio_drain();
+
+    if (blz_active())
+    {
+        if (blz_write(blkno, buf) != 0) return -1;
+    }
+    else
+    {
+        off_t off = g_data_off + (off_t)blkno * (off_t)g_bsize;
+        if (pwrite(g_fd, buf, g_bsize, off) != (ssize_t)g_bsize) return -1;
+    }
+    block_csum_write(blkno, buf);
+    return 0;
+}
+
+static int slot_lookup(int blkno)
+{
+    for (int i = g_hash[hash_blk(blkno)]; i >= 0; i = g_slots[i].next)
+    {
+        if (g_slots[i].blkno == blkno) return i;
+    }
+    return -1;
+}
+
+/* a slot still being filled by readahead is waited for; the load may
+ * fail and drop it, so look again */
+static int slot_find(int blkno)
+{
+    int i = slot_lookup(blkno);
+    if (i >= 0 && g_slots[i].loading)
+    {
+        bio_drain();
+        i = slot_lookup(blkno);
+    }
+    return i;
+}
+
+static void hash_remove(size_t i)
+{
+    int *pp = &g_hash[hash_blk(g_slots[i].blkno)];
+    while (*pp >= 0 && *pp != (int)i)
+    {
+        pp = &g_slots[*pp].next;
+    }
+    if (*pp == (int)i)
+    {
+        *pp = g_slots[i].next;
+    }
+    g_slots[i].next = -1;
+}
+
+static void hash_insert(size_t i)
+{
+    size_t h = hash_blk(g_slots[i].blkno);
+    g_slots[i].next = g_hash[h];
+    g_hash[h] = (int)i;
+}
+
+/* pick a victim with CLOCK, write it back if dirty, unhash it */
+static int slot_evict(void)
+{
+    /* two sweeps: the first may only clear reference bits */
+    for (size_t n = 0; n < 2 * g_nslots; n++)
+    {
+        size_t i = g_hand;
+        g_hand = (g_hand + 1) % g_nslots;
+
+        struct bslot *s = &g_slots[i];
+        if (s->pins) continue;
+        if (s->ref) { s->ref = 0; continue; }
+
+        if (s->blkno >= 0)
+        {
+            if (s->dirty && dev_write(s->blkno, slot_mem(i)) != 0) continue;
+            hash_remove(i);
+            s->blkno = -1;
+            s->dirty = 0;
+        }
+        return (int)i;
+    }
+    return -1; /* everything pinned */
+}
+
+int bcache_init(int fd, size_t bsize, uint64_t data_off, size_t nslots)
+{
+    if (nslots < BLOCK_CACHE_MIN) nslots = BLOCK_CACHE_MIN;
+
+    size_t hsize = 1;
+    while (hsize < nslots * 2) hsize <<= 1;
+
+    g_slots = calloc(nslots, sizeof(*g_slots));
+    g_mem   = malloc(nslots * bsize);
+    g_hash  = malloc(hsize * sizeof(*g_hash));
+    if (!g_slots || !g_mem || !g_hash)
+    {
+        bcache_destroy();
+        return -1;
+    }
+
+    for (size_t i = 0; i < nslots; i++)
+    {
+        g_slots[i].blkno = -1;
+        g_slots[i].next  = -1;
+    }
+    for (size_t h = 0; h < hsize; h++)
+    {
+        g_hash[h] = -1;
+    }
+
+    g_nslots   = nslots;
+    g_hmask    = hsize - 1;
+    g_hand     = 0;
+    g_fd       = fd;
+    g_bsize    = bsize;
+    g_data_off = (off_t)data_off;
+    return 0;
+}
+
+void bcache_destroy(void)
+{
+    free(g_slots);
+    free(g_mem);
+    free(g_hash);
+    g_slots  = NULL;
+    g_mem    = NULL;
+    g_hash   = NULL;
+    g_nslots = 0;
+    g_fd     = -1;
+}
+
+uint8_t *bcache_get(int blkno, int flags)
+{
+    int i = slot_find(blkno);
+    bstat_cache(i >= 0);
+
+    if (i < 0)
+    {
+        if (flags & BCACHE_CACHED) return NULL;
+
+        i = slot_evict();
+        if (i < 0) return NULL;
+
+        /* a block about to be overwritten whole need not be read first */
+        if (!(flags & BCACHE_NOREAD) && dev_read(blkno, slot_mem((size_t)i)) != 0)
+        {
+            return NULL;
+        }
+        g_slots[i].blkno = blkno;
+        hash_insert((size_t)i);
+    }
+
+    struct bslot *s = &g_slots[i];
+    s->pins++;
+    s->ref = 1;
+    if (flags & BCACHE_DIRTY)
+    {
+        s->dirty = 1;
+    }
+    return slot_mem((size_t)i);
+}
+
+void bcache_put(int blkno)
+{
+    int i = slot_lookup(blkno);
+    if (i >= 0 && g_slots[i].pins > 0)
+    {
+        g_slots[i].pins--;
+    }
+}
+
+int bcache_peek(int blkno, void *buf)
+{
+    int i = slot_find(blkno);
+    bstat_cache(i >= 0);
+    if (i < 0) return -1;
+
+    memcpy(buf, slot_mem((size_t)i), g_bsize);
+    g_slots[i].ref = 1;
+    return 0;
+}
+
+int bcache_update(int blkno, const void *buf)
+{
+    int i = slot_find(blkno);
+    bstat_cache(i >= 0);
+    if (i < 0) return -1;
+
+    memcpy(slot_mem((size_t)i), buf, g_bsize);
+    g_slots[i].ref   = 1;
+    g_slots[i].dirty = 1;
+    return 0;
+}
+
+void bcache_discard(int blkno)
+{
+    int i = slot_find(blkno);
+    if (i < 0 || g_slots[i].pins > 0) return;
+
+    hash_remove((size_t)i);
+    g_slots[i].blkno = -1;
+    g_slots[i].dirty = 0;
+    g_slots[i].ref   = 0;
+}
+
+/* write one block back now if the cache holds it dirty */
+int bcache_sync(int blkno)
+{
+    int i = slot_find(blkno);
+    if (i < 0 || !g_slots[i].dirty) return 0;
+
+    if (dev_write(blkno, slot_mem((size_t)i)) != 0) return -1;
+    g_slots[i].dirty = 0;
+    return 0;
+}
+
+/* ---------- readahead ---------- */
+
+struct bfill
+{
+    int    blkno;
+    size_t n;
+    int    slot[BCACHE_FILL_MAX];
+    struct iovec iov[BCACHE_FILL_MAX];
+};
+
+/* the slots become ordinary clean ones, or empty again when the read or
+ * the checksum failed: the reader then loads the block itself and sees
+ * the error. A mismatch is not counted here, the reader counts it. */
+static void fill_done(int blkno, int err, void *arg)
+{
+    struct bfill *f = arg;
+    (void)blkno;
+
+    for (size_t k = 0; k < f->n; k++)
+    {
+        struct bslot *sl = &g_slots[f->slot[k]];
+        sl->loading = 0;
+        if (sl->pins > 0) sl->pins--;
+        if (err || block_csum_match(sl->blkno, slot_mem((size_t)f->slot[k])) != 0)
+        {
+            hash_remove((size_t)f->slot[k]);
+            sl->blkno = -1;
+            sl->ref   = 0;
+        }
+    }
+    free(f);
+}
+
+size_t bcache_prefetch(int blkno, size_t n)
+{
+    if (!g_slots || n == 0) return 0;
+    if (n > BCACHE_FILL_MAX) n = BCACHE_FILL_MAX;
+
+    struct bfill *f = malloc(sizeof(*f));
+    if (!f) return 0;
+    f->blkno = blkno;
+    f->n     = 0;
+
+    /* the caller passes uncached blocks; victims may be written back */
+    for (size_t k = 0; k < n; k++)
+    {
+        int i = slot_evict();
+        if (i < 0) break;
+
+        struct bslot *sl = &g_slots[i];
+        sl->blkno   = blkno + (int)k;
+        sl->pins    = 1;
+        sl->ref     = 1;
+        sl->loading = 1;
+        hash_insert((size_t)i);
+        f->slot[k] = i;
+        f->iov[k].iov_base = slot_mem((size_t)i);
+        f->iov[k].iov_len  = g_bsize;
+        f->n++;
+    }
+
+    size_t got = f->n;
+    if (got == 0)
+    {
+        free(f);
+        return 0;
+    }
+    if (bio_queue_hint(blkno, got, f->iov, (int)got, fill_done, f) != 0)
+    {
+        fill_done(blkno, -1, f);
+        return 0;
+    }
+    return got;
+}
+
+int bcache_cached(int blkno)
+{
+    return slot_lookup(blkno) >= 0;
+}
+
+size_t bcache_slots(void)
+{
+    return g_nslots;
+}
+
+static int cmp_slot_blk(const void *a, const void *b)
+{
+    int x = g_slots[*(const size_t *)a].blkno;
+    int y = g_slots[*(const size_t *)b].blkno;
+    return (x > y) - (x < y);
+}
+
+static void flush_done(int blkno, int err, void *arg)
+{
+    struct bslot *sl = &g_slots[(intptr_t)arg];
+    (void)blkno;
+
+    if (!err) sl->dirty = 0;
+    if (sl->pins > 0) sl->pins--;
+}
+
+int bcache_flush_queue(void)
+{
+    if (!g_slots) return 0;
+
+    size_t *dirty = malloc(g_nslots * sizeof(*dirty));
+    if (!dirty) return -1;
+
+    size_t n = 0;
+    for (size_t i = 0; i < g_nslots; i++)
+    {
+        if (g_slots[i].blkno >= 0 && g_slots[i].dirty) dirty[n++] = i;
+    }
+
+    /* ascending block order keeps the writeback sequential on disk */
+    qsort(dirty, n, sizeof(*dirty), cmp_slot_blk);
+
+    /* each slot stays pinned until its write completes */
+    int rc = 0;
+    for (size_t k = 0; k < n; k++)
+    {
+        size_t i = dirty[k];
+
+        /* compressed: where the block goes is known only after
+         * compressing it, write it the synchronous way */
+        if (blz_active())
+        {
+            if (dev_write(g_slots[i].blkno, slot_mem(i)) == 0) g_slots[i].dirty = 0;
+            else rc = -1;
+            continue;
+        }
+        g_slots[i].pins++;
+        block_csum_write(g_slots[i].blkno, slot_mem(i));
+        if (bio_queue(1, g_slots[i].blkno, 1, slot_mem(i), flush_done, (void *)(intptr_t)i) != 0)
+        {
+            g_slots[i].pins--;
+            rc = -1;
+        }
+    }
+
+    free(dirty);
+    return rc;
+}
+
+int bcache_flush(void)
+{
+    int rc = bcache_flush_queue();
+    if (bio_wait() != 0) rc = -1;
+    return rc;
+}
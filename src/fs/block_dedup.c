@@ -0,0 +1,155 @@
+/*standard lib */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+/*standard lib done*/
+
+#include "block.h"
+#include "block_internal.h"
+
+/* reference counts for IMG_F_DEDUP and IMG_F_REFS images, and the
+ * content index for IMG_F_DEDUP ones
+ * block.c owns the per-block table (saved with the image); this keeps an
+ * in-memory hash from content hash to the indexed blocks, rebuilt from the
+ * table at load. Blocks with the same hash are chained; callers compare
+ * the bytes before sharing, so a collision only costs a compare. */
+static struct bdd_ent *g_tab;
+static size_t  g_count;
+static int    *g_head;      /* bucket -> first block, -1 = empty */
+static int    *g_next;      /* block -> next in its bucket */
+static size_t  g_mask;
+
+static inline size_t bucket(uint32_t hash)
+{
+    return (hash * 2654435761u) & g_mask;
+}
+
+/* without memory for the index the table still counts references;
+ * nothing new is found by content, so nothing new gets shared. That is
+ * all an image without dedup (index 0) asks for. */
+int bdd_init(struct bdd_ent *tab, size_t count, int index)
+{
+    /* about four blocks per bucket when every block is indexed */
+    size_t nb = 64;
+    while (nb < count / 4) nb <<= 1;
+
+    bdd_destroy();
+    g_tab   = tab;
+    g_count = count;
+    if (!index) return 0;
+
+    int *head = malloc(nb * sizeof(*head));
+    int *next = malloc(count * sizeof(*next));
+    if (!head || !next)
+    {
+        free(head);
+        free(next);
+        return -1;
+    }
+    g_head  = head;
+    g_next  = next;
+    g_mask  = nb - 1;
+
+    for (size_t i = 0; i < nb; i++)
+    {
+        g_head[i] = -1;
+    }
+    for (size_t b = 0; b < count; b++)
+    {
+        g_next[b] = -1;
+        if (g_tab[b].refs & BDD_INDEXED)
+        {
+            size_t h = bucket(g_tab[b].hash);
+            g_next[b] = g_head[h];
+            g_head[h] = (int)b;
+        }
+    }
+    return 0;
+}
+
+void bdd_destroy(void)
+{
+    free(g_head);
+    free(g_next);
+    g_tab   = NULL;
+    g_head  = NULL;
+    g_next  = NULL;
+    g_count = 0;
+}
+
+int bdd_first(uint32_t hash)
+{
+    if (!g_head) return -1;
+
+    int b = g_head[bucket(hash)];
+    while (b >= 0 && g_tab[b].hash != hash) b = g_next[b];
+    return b;
+}
+
+int bdd_next(int blk, uint32_t hash)
+{
+    int b = g_next[blk];
+    while (b >= 0 && g_tab[b].hash != hash) b = g_next[b];
+    return b;
+}
+
+void bdd_insert(int blk, uint32_t hash)
+{
+    if (!g_head) return;
+    if (g_tab[blk].refs & BDD_INDEXED) bdd_remove(blk);
+
+    size_t h = bucket(hash);
+    g_tab[blk].hash  = hash;
+    g_tab[blk].refs |= BDD_INDEXED;
+    g_next[blk] = g_head[h];
+    g_head[h]   = blk;
+    block_dedup_dirty((size_t)blk);
+}
+
+void bdd_remove(int blk)
+{
+    if (!g_head || !(g_tab[blk].refs & BDD_INDEXED)) return;
+
+    int *pp = &g_head[bucket(g_tab[blk].hash)];
+    while (*pp >= 0 && *pp != blk)
+    {
+        pp = &g_next[*pp];
+    }
+    if (*pp == blk)
+    {
+        *pp = g_next[blk];
+    }
+    g_next[blk] = -1;
+    g_tab[blk].hash  = 0;
+    g_tab[blk].refs &= ~BDD_INDEXED;
+    block_dedup_dirty((size_t)blk);
+}
+
+uint32_t bdd_refs(int blk)
+{
+    return g_tab[blk].refs & ~BDD_INDEXED;
+}
+
+void bdd_ref(int blk)
+{
+    g_tab[blk].refs++;
+    block_dedup_dirty((size_t)blk);
+}
+
+int bdd_unref(int blk)
+{
+    if (bdd_refs(blk) == 0) return 0;
+    g_tab[blk].refs--;
+    block_dedup_dirty((size_t)blk);
+    return 1;
+}
+
+size_t bdd_saved_blocks(void)
+{
+    size_t n = 0;
+    for (size_t b = 0; b < g_count; b++)
+    {
+        n += bdd_refs((int)b);
+    }
+    return n;
+}
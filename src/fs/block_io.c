@@ -0,0 +1,422 @@
+#define _GNU_SOURCE /* pread / pwrite, preadv / pwritev, syscall */
+
+/*standard lib */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+/*standard lib done*/
+
+#include <linux/io_uring.h>
+
+#include "block.h"
+#include "block_internal.h"
+
+/* I/O engine for the file backend
+ * transfers are queued with a completion callback and go to the kernel
+ * together: with io_uring one io_uring_enter submits a whole batch and
+ * reaps whatever has finished. Without it (old kernel, seccomp, depth 0)
+ * every transfer is a pread/pwrite done at queue time, callback included,
+ * so callers never need a second code path. */
+#define BIO_DEPTH_MAX 4096
+
+struct bio_req
+{
+    block_io_done done;
+    void   *arg;
+    int     blkno;      /* -1: raw transfer, not block data */
+    size_t  nblk;
+    size_t  len;
+    int     quiet;      /* failure not sticky, see bio_queue_hint */
+    int     next;       /* free list */
+};
+
+struct bio_ring
+{
+    int       fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void     *sq_ptr;
+    void     *cq_ptr;
+    size_t    sq_size;
+    size_t    cq_size;
+    size_t    sqe_size;
+    unsigned  entries;
+};
+
+static struct bio_ring g_ring = { .fd = -1 };
+
+static int      g_fd = -1;
+static size_t   g_bsize;
+static uint64_t g_data_off;
+
+static struct bio_req *g_reqs;
+static int      g_free = -1;
+static unsigned g_queued;       /* in the SQ ring, not yet submitted */
+static unsigned g_inflight;     /* queued or submitted, not completed */
+static unsigned g_hints;        /* ... of which readahead, see bio_queue_hint */
+static int      g_err;          /* sticky until bio_wait */
+
+/* ---------- io_uring ---------- */
+
+static int ring_setup(unsigned depth)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+    if (fd < 0) return -1;
+
+    struct bio_ring *r = &g_ring;
+    r->fd       = fd;
+    r->entries  = p.sq_entries;
+    r->sq_size  = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size  = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+    {
+        if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) goto fail_sq;
+
+    r->cq_ptr = single ? r->sq_ptr
+                       : mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED) goto fail_cq;
+
+    r->sqes = mmap(NULL, r->sqe_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail_sqes;
+
+    uint8_t *sq = r->sq_ptr;
+    uint8_t *cq = r->cq_ptr;
+    r->sq_head  = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail_sqes:
+    if (!single) munmap(r->cq_ptr, r->cq_size);
+fail_cq:
+    munmap(r->sq_ptr, r->sq_size);
+fail_sq:
+    close(fd);
+    r->fd = -1;
+    return -1;
+}
+
+static void ring_destroy(void)
+{
+    struct bio_ring *r = &g_ring;
+    if (r->fd < 0) return;
+
+    munmap(r->sqes, r->sqe_size);
+    if (r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+    munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+    r->fd = -1;
+}
+
+static int ring_enter(unsigned submit, unsigned min_complete)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+
+    do
+    {
+        ret = (int)syscall(__NR_io_uring_enter, g_ring.fd, submit, min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret > 0) g_queued -= (unsigned)ret;
+    return ret < 0 ? -1 : 0;
+}
+
+/* ---------- requests ---------- */
+
+static void req_complete(int id, int res)
+{
+    struct bio_req *q = &g_reqs[id];
+    block_io_done done = q->done;
+    void *arg = q->arg;
+    int blkno = q->blkno;
+    size_t nblk = q->nblk;
+    int err = (res < 0 || (size_t)res != q->len) ? -1 : 0;
+    int quiet = q->quiet;
+
+    /* free the slot first: the callback may queue more */
+    q->next = g_free;
+    g_free  = id;
+    g_inflight--;
+    if (quiet) g_hints--;
+
+    if (err && !quiet) g_err = 1;
+    if (blkno >= 0) block_io_retire(blkno, nblk);
+    if (done) done(blkno, err, arg);
+}
+
+static void ring_reap(void)
+{
+    struct bio_ring *r = &g_ring;
+    unsigned head = *r->cq_head;
+
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        int id  = (int)cqe->user_data;
+        int res = cqe->res;
+
+        /* hand the entry back before the callback can reap again */
+        head++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        req_complete(id, res);
+    }
+}
+
+/* sync engine, vectored: one call; a regular file doesn't come up short
+ * inside its size */
+static int xfer_sync_v(int write, const struct iovec *iov, int cnt, off_t off)
+{
+    ssize_t n;
+    do
+    {
+        n = write ? pwritev(g_fd, iov, cnt, off) : preadv(g_fd, iov, cnt, off);
+    } while (n < 0 && errno == EINTR);
+    return n < 0 ? -1 : (int)n;
+}
+
+/* sync engine: the whole transfer now */
+static int xfer_sync(int write, uint8_t *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = write ? pwrite(g_fd, buf + done, len - done, off + (off_t)done)
+                          : pread(g_fd, buf + done, len - done, off + (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (size_t)n;
+    }
+    return (int)done;
+}
+
+static int req_get(void)
+{
+    while (g_free < 0)
+    {
+        /* ring full: push what is queued and take at least one back */
+        if (ring_enter(g_queued, 1) != 0) return -1;
+        ring_reap();
+    }
+    int id = g_free;
+    g_free = g_reqs[id].next;
+    return id;
+}
+
+/* buf is the data, or the iovec array when cnt > 0 */
+static int queue_xfer(int write, int blkno, size_t nblk, void *buf, int cnt, size_t len,
+                      off_t off, int quiet, block_io_done done, void *arg)
+{
+    if (g_fd < 0) return -1;
+
+    if (g_ring.fd < 0)
+    {
+        int res = cnt > 0 ? xfer_sync_v(write, buf, cnt, off)
+                          : xfer_sync(write, buf, len, off);
+        if (res < 0 || (size_t)res != len)
+        {
+            res = -1;
+            if (!quiet) g_err = 1;
+        }
+        if (blkno >= 0) block_io_retire(blkno, nblk);
+        if (done) done(blkno, res < 0 ? -1 : 0, arg);
+        return 0;
+    }
+
+    int id = req_get();
+    if (id < 0) return -1;
+
+    struct bio_req *q = &g_reqs[id];
+    q->done  = done;
+    q->arg   = arg;
+    q->blkno = blkno;
+    q->nblk  = nblk;
+    q->len   = len;
+    q->quiet = quiet;
+
+    struct bio_ring *r = &g_ring;
+    unsigned tail = *r->sq_tail;
+    unsigned idx  = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (cnt > 0)
+    {
+        sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->len    = (uint32_t)cnt;
+    }
+    else
+    {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->len    = (uint32_t)len;
+    }
+    sqe->fd        = g_fd;
+    sqe->addr      = (uint64_t)(uintptr_t)buf;
+    sqe->off       = (uint64_t)off;
+    sqe->user_data = (uint64_t)id;
+
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    g_queued++;
+    g_inflight++;
+    if (quiet) g_hints++;
+    return 0;
+}
+
+/* ---------- interface ---------- */
+
+int bio_init(int fd, size_t bsize, uint64_t data_off, unsigned depth)
+{
+    g_fd       = fd;
+    g_bsize    = bsize;
+    g_data_off = data_off;
+    g_err      = 0;
+    g_queued   = 0;
+    g_inflight = 0;
+    g_hints    = 0;
+
+    if (depth == 0) return 0;       /* pread / pwrite only */
+    if (depth > BIO_DEPTH_MAX) depth = BIO_DEPTH_MAX;
+
+    if (ring_setup(depth) != 0) return 0;   /* fall back quietly */
+
+    g_reqs = calloc(g_ring.entries, sizeof(*g_reqs));
+    if (!g_reqs)
+    {
+        ring_destroy();
+        return 0;
+    }
+    for (unsigned i = 0; i < g_ring.entries; i++)
+    {
+        g_reqs[i].next = (int)i + 1 < (int)g_ring.entries ? (int)i + 1 : -1;
+    }
+    g_free = 0;
+    return 0;
+}
+
+void bio_destroy(void)
+{
+    if (g_ring.fd >= 0) bio_drain();
+    ring_destroy();
+    free(g_reqs);
+    g_reqs = NULL;
+    g_free = -1;
+    g_fd   = -1;
+}
+
+const char *bio_engine(void)
+{
+    return g_ring.fd >= 0 ? "io_uring" : "pread";
+}
+
+int bio_queue(int write, int blkno, size_t nblk, void *buf, block_io_done done, void *arg)
+{
+    off_t off = (off_t)(g_data_off + (uint64_t)blkno * g_bsize);
+    return queue_xfer(write, blkno, nblk, buf, 0, nblk * g_bsize, off, 0, done, arg);
+}
+
+int bio_queue_v(int write, int blkno, size_t nblk, const struct iovec *iov, int cnt,
+                block_io_done done, void *arg)
+{
+    size_t len = 0;
+    for (int i = 0; i < cnt; i++)
+    {
+        len += iov[i].iov_len;
+    }
+    if (cnt <= 0 || len > nblk * g_bsize) return -1;
+
+    off_t off = (off_t)(g_data_off + (uint64_t)blkno * g_bsize);
+    return queue_xfer(write, blkno, nblk, (void *)iov, cnt, len, off, 0, done, arg);
+}
+
+int bio_queue_hint(int blkno, size_t nblk, const struct iovec *iov, int cnt,
+                   block_io_done done, void *arg)
+{
+    size_t len = 0;
+    for (int i = 0; i < cnt; i++)
+    {
+        len += iov[i].iov_len;
+    }
+    if (cnt <= 0 || len > nblk * g_bsize) return -1;
+
+    off_t off = (off_t)(g_data_off + (uint64_t)blkno * g_bsize);
+    return queue_xfer(0, blkno, nblk, (void *)iov, cnt, len, off, 1, done, arg);
+}
+
+int bio_queue_at(int write, uint64_t off, size_t len, void *buf, block_io_done done, void *arg)
+{
+    return queue_xfer(write, -1, 0, buf, 0, len, (off_t)off, 0, done, arg);
+}
+
+int bio_submit(void)
+{
+    if (g_ring.fd < 0 || g_queued == 0) return 0;
+    if (ring_enter(g_queued, 0) != 0) return -1;
+    ring_reap();
+    return 0;
+}
+
+/* wait for every transfer, or (hints) for all but readahead */
+static void drain(int hints)
+{
+    while (g_inflight > (hints ? g_hints : 0))
+    {
+        if (ring_enter(g_queued, 1) != 0)
+        {
+            /* the ring is unusable: nothing will complete */
+            g_err = 1;
+            break;
+        }
+        ring_reap();
+    }
+}
+
+void bio_drain(void)
+{
+    drain(0);
+}
+
+/* readahead is nobody's to wait for: it keeps running */
+int bio_wait(void)
+{
+    drain(1);
+    int rc = g_err ? -1 : 0;
+    g_err = 0;
+    return rc;
+}
+
+size_t bio_inflight(void)
+{
+    return g_inflight - g_hints;
+}
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE /* pread / pwrite, fallocate */
+
+/*standard lib */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+/*standard lib done*/
+
+#include "block.h"
+#include "block_internal.h"
+#include "lz.h"
+
+/* compressed storage for IMG_F_LZ images (file backend, under the cache)
+ * The data area is cut into units of 1/BLZ_UNITS_PER_BLOCK block. A
+ * logical block is stored compressed in a run of whole units, or raw when
+ * compressing would not save a unit; all-zero blocks take no space at
+ * all. Its map entry (owned by block.c, saved with the image) says where.
+ * Unit allocation is next-fit, so blocks written in order are stored in
+ * order.
+ * Units a block moves away from are pending, not free: until the next
+ * save the map on disk may still point at them. blz_commit() frees them
+ * once the new map is on disk. */
+#define BLZ_UNITS_PER_BLOCK 8
+
+static struct blz_ent *g_map;
+static size_t    g_count;           /* logical blocks */
+static uint64_t *g_used;            /* unit bitmap, 1 = taken (live or pending) */
+static uint64_t *g_pending;         /* released since the last commit */
+static size_t    g_units;
+static size_t    g_unit;            /* bytes per unit */
+static size_t    g_cursor;          /* next-fit start */
+static size_t    g_live;            /* units referenced by the map */
+static size_t    g_npending;
+
+static int      g_fd = -1;
+static size_t   g_bsize;
+static off_t    g_data_off;
+static uint8_t *g_scratch;          /* one block, for the calling thread */
+
+static inline int unit_test(const uint64_t *bm, size_t u)
+{
+    return (bm[u / BITMAP_WORD_BITS] >> (u % BITMAP_WORD_BITS)) & 1;
+}
+
+static void unit_mark(uint64_t *bm, size_t u, size_t n, int on)
+{
+    for (size_t i = u; i < u + n; i++)
+    {
+        uint64_t bit = (uint64_t)1 << (i % BITMAP_WORD_BITS);
+        if (on) bm[i / BITMAP_WORD_BITS] |= bit;
+        else    bm[i / BITMAP_WORD_BITS] &= ~bit;
+    }
+}
+
+static inline int ent_mapped(const struct blz_ent *e)
+{
+    return e->len != 0 || (e->flags & BLZ_RAW);
+}
+
+static size_t ent_units(const struct blz_ent *e)
+{
+    if (e->flags & BLZ_RAW) return BLZ_UNITS_PER_BLOCK;
+    return (e->len + g_unit - 1) / g_unit;
+}
+
+static inline off_t unit_off(size_t u)
+{
+    return g_data_off + (off_t)u * (off_t)g_unit;
+}
+
+int blz_init(int fd, size_t bsize, uint64_t data_off, size_t phys_blocks,
+             struct blz_ent *map, size_t count)
+{
+    size_t units = phys_blocks * BLZ_UNITS_PER_BLOCK;
+    uint64_t *used    = calloc(BITMAP_WORDS(units), sizeof(uint64_t));
+    uint64_t *pending = calloc(BITMAP_WORDS(units), sizeof(uint64_t));
+    uint8_t  *scratch = malloc(bsize);
+    if (!used || !pending || !scratch) goto fail;
+
+    g_unit = bsize / BLZ_UNITS_PER_BLOCK;
+
+    /* rebuild the unit bitmap from the map; a map that points outside
+     * the data area or at the same units twice is not ours */
+    size_t live = 0;
+    for (size_t b = 0; b < count; b++)
+    {
+        const struct blz_ent *e = &map[b];
+        if (!ent_mapped(e)) continue;
+
+        size_t n = ent_units(e);
+        if (!(e->flags & BLZ_RAW) && e->len >= bsize) goto fail;
+        if (e->unit > units || n > units - e->unit) goto fail;
+        for (size_t u = e->unit; u < e->unit + n; u++)
+        {
+            if (unit_test(used, u)) goto fail;
+        }
+        unit_mark(used, e->unit, n, 1);
+        live += n;
+    }
+
+    blz_destroy();
+    g_map      = map;
+    g_count    = count;
+    g_used     = used;
+    g_pending  = pending;
+    g_units    = units;
+    g_cursor   = 0;
+    g_live     = live;
+    g_npending = 0;
+    g_fd       = fd;
+    g_bsize    = bsize;
+    g_data_off = (off_t)data_off;
+    g_scratch  = scratch;
+    return 0;
+
+fail:
+    free(used);
+    free(pending);
+    free(scratch);
+    return -1;
+}
+
+void blz_destroy(void)
+{
+    free(g_used);
+    free(g_pending);
+    free(g_scratch);
+    g_map     = NULL;
+    g_used    = NULL;
+    g_pending = NULL;
+    g_scratch = NULL;
+    g_count   = 0;
+    g_units   = 0;
+    g_live    = 0;
+    g_npending = 0;
+    g_fd      = -1;
+}
+
+int blz_active(void)
+{
+    return g_map != NULL;
+}
+
+size_t blz_stored_bytes(void)
+{
+    return g_live * g_unit;
+}
+
+/* n free units in a row, next-fit from the cursor; -1 if none */
+static long unit_alloc(size_t n)
+{
+    size_t run = 0;
+    for (size_t k = 0; k < g_units; k++)
+    {
+        size_t u = (g_cursor + k) % g_units;
+        if (u == 0) run = 0;    /* runs do not wrap */
+
+        /* a full word ends any run: skip it whole */
+        if (u % BITMAP_WORD_BITS == 0 && g_used[u / BITMAP_WORD_BITS] == ~(uint64_t)0 &&
+            u + BITMAP_WORD_BITS <= g_units) {
+            k += BITMAP_WORD_BITS - 1;
+            run = 0;
+            continue;
+        }
+
+        if (unit_test(g_used, u))
+        {
+            run = 0;
+            continue;
+        }
+        if (++run == n)
+        {
+            size_t first = u + 1 - n;
+            unit_mark(g_used, first, n, 1);
+            g_cursor = u + 1;
+            return (long)first;
+        }
+    }
+    return -1;
+}
+
+/* the block's old units stay taken until the next commit */
+static void ent_release(size_t blk)
+{
+    struct blz_ent *e = &g_map[blk];
+    if (!ent_mapped(e)) return;
+
+    size_t n = ent_units(e);
+    unit_mark(g_pending, e->unit, n, 1);
+    g_live     -= n;
+    g_npending += n;
+    memset(e, 0, sizeof(*e));
+    block_lzmap_dirty(blk);
+}
+
+/* free pending units; punch: also return their whole pages to the
+ * filesystem */
+static void release_pending(int punch)
+{
+    size_t per_page = (size_t)sysconf(_SC_PAGESIZE) / g_unit;
+    if (per_page < 1) per_page = 1;
+
+    size_t u = 0;
+    while (g_npending && u < g_units)
+    {
+        if (!g_pending[u / BITMAP_WORD_BITS])
+        {
+            u = (u / BITMAP_WORD_BITS + 1) * BITMAP_WORD_BITS;
+            continue;
+        }
+        if (!unit_test(g_pending, u)) { u++; continue; }
+
+        size_t s = u, e = u;
+        while (e < g_units && unit_test(g_pending, e)) e++;
+        unit_mark(g_pending, s, e - s, 0);
+        unit_mark(g_used, s, e - s, 0);
+        g_npending -= e - s;
+        u = e;
+
+        if (!punch) continue;
+
+        /* widen over free neighbours, then keep whole pages only */
+        while (s > 0 && !unit_test(g_used, s - 1) && s % per_page) s--;
+        while (e < g_units && !unit_test(g_used, e) && e % per_page) e++;
+        s = (s + per_page - 1) / per_page * per_page;
+        e = e / per_page * per_page;
+        if (s < e)
+        {
+            fallocate(g_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      unit_off(s), (off_t)((e - s) * g_unit));
+        }
+    }
+}
+
+void blz_commit(void)
+{
+    if (g_map) release_pending(1);
+}
+
+static int all_zero(const uint8_t *p, size_t n)
+{
+    uint64_t acc = 0;
+    for (size_t i = 0; i < n; i += sizeof(uint64_t))
+    {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        acc |= v;
+    }
+    return acc == 0;
+}
+
+int blz_write(int blkno, const void *buf)
+{
+    size_t blk = (size_t)blkno;
+    if (all_zero(buf, g_bsize))
+    {
+        ent_release(blk);
+        return 0;
+    }
+
+    /* keep it compressed only if that saves at least one unit */
+    struct blz_ent e = { 0, 0, 0 };
+    const void *src = g_scratch;
+    size_t len = lz_compress(buf, g_bsize, g_scratch, g_bsize - g_unit);
+    size_t n;
+    if (len)
+    {
+        e.len = (uint16_t)len;
+        n = ent_units(&e);
+    }
+    else
+    {
+        e.flags = BLZ_RAW;
+        src = buf;
+        len = g_bsize;
+        n = BLZ_UNITS_PER_BLOCK;
+    }
+
+    /* out of space: give up the crash safety of pending units first */
+    long u = unit_alloc(n);
+    if (u < 0 && g_npending)
+    {
+        release_pending(0);
+        u = unit_alloc(n);
+    }
+    if (u < 0) return -1;
+
+    if (pwrite(g_fd, src, len, unit_off((size_t)u)) != (ssize_t)len)
+    {
+        unit_mark(g_used, (size_t)u, n, 0);
+        return -1;
+    }
+
+    ent_release(blk);
+    e.unit = (uint32_t)u;
+    g_map[blk] = e;
+    g_live += n;
+    block_lzmap_dirty(blk);
+    return 0;
+}
+
+void blz_unmap(int blkno)
+{
+    ent_release((size_t)blkno);
+}
+
+int blz_read(int blkno, void *buf, void *scratch)
+{
+    const struct blz_ent *e = &g_map[blkno];
+
+    if (!ent_mapped(e))
+    {
+        memset(buf, 0, g_bsize);
+        return 0;
+    }
+    if (e->flags & BLZ_RAW)
+    {
+        return pread(g_fd, buf, g_bsize, unit_off(e->unit)) == (ssize_t)g_bsize ? 0 : -1;
+    }
+
+    if (!scratch) scratch = g_scratch;
+    if (pread(g_fd, scratch, e->len, unit_off(e->unit)) != (ssize_t)e->len) return -1;
+    return lz_decompress(scratch, e->len, buf, g_bsize);
+}
+
+int blz_copy_packed(int fd, uint64_t data_off, struct blz_ent *out, int (*keep)(size_t blk))
+{
+    size_t next = 0;
+    for (size_t b = 0; b < g_count; b++)
+    {
+        struct blz_ent e = g_map[b];
+        memset(&out[b], 0, sizeof(out[b]));
+        if (!ent_mapped(&e) || !keep(b)) continue;
+
+        size_t len = (e.flags & BLZ_RAW) ? g_bsize : e.len;
+        off_t  dst = (off_t)data_off + (off_t)next * (off_t)g_unit;
+        if (pread(g_fd, g_scratch, len, unit_off(e.unit)) != (ssize_t)len ||
+            pwrite(fd, g_scratch, len, dst) != (ssize_t)len) {
+            return -1;
+        }
+        e.unit = (uint32_t)next;
+        out[b] = e;
+        next += ent_units(&e);
+    }
+    return 0;
+}
@@ -0,0 +1,177 @@
+/*standard lib */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+/*standard lib done*/
+
+#include "block.h"
+#include "block_internal.h"
+
+/* block layer statistics
+ * every thread counts into a struct of its own, found through a
+ * thread-local pointer: a counted call costs a few plain adds and two
+ * clock reads, no lock and no cache line shared with other threads.
+ * Only the owner writes its counters (relaxed stores, so the reader
+ * never sees a torn value); block_stats_get() sums them all under the
+ * list lock. A thread's counts move to g_retired when it exits. Reset
+ * does not touch anyone's counters, it just records a baseline. */
+struct bstat_thread
+{
+    struct block_stats st;
+    struct bstat_thread *next;
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bstat_thread *g_threads;
+static struct block_stats   g_retired;  /* threads that exited */
+static struct block_stats   g_base;     /* totals at the last reset */
+
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static pthread_key_t  g_key;
+static int            g_key_ok;
+
+static _Thread_local struct bstat_thread *t_self;
+
+static const char *g_op_names[BLOCK_OP_COUNT] = { "read", "write", "alloc", "free" };
+
+#define STAT_WORDS (sizeof(struct block_stats) / sizeof(uint64_t))
+
+static inline void stat_add(uint64_t *c, uint64_t v)
+{
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+/* struct block_stats is all uint64_t: sum word by word */
+static void stat_sum(struct block_stats *to, const struct block_stats *from)
+{
+    uint64_t *t = (uint64_t *)to;
+    const uint64_t *f = (const uint64_t *)from;
+    for (size_t i = 0; i < STAT_WORDS; i++)
+    {
+        t[i] += __atomic_load_n(&f[i], __ATOMIC_RELAXED);
+    }
+}
+
+static void thread_exit(void *arg)
+{
+    struct bstat_thread *t = arg;
+
+    pthread_mutex_lock(&g_lock);
+    struct bstat_thread **pp = &g_threads;
+    while (*pp && *pp != t)
+    {
+        pp = &(*pp)->next;
+    }
+    if (*pp) *pp = t->next;
+    stat_sum(&g_retired, &t->st);
+    pthread_mutex_unlock(&g_lock);
+    free(t);
+}
+
+static void key_init(void)
+{
+    g_key_ok = pthread_key_create(&g_key, thread_exit) == 0;
+}
+
+/* NULL without memory: that thread is just not counted */
+static struct bstat_thread *self(void)
+{
+    if (t_self) return t_self;
+
+    pthread_once(&g_once, key_init);
+    struct bstat_thread *t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+
+    pthread_mutex_lock(&g_lock);
+    t->next   = g_threads;
+    g_threads = t;
+    pthread_mutex_unlock(&g_lock);
+
+    if (g_key_ok) pthread_setspecific(g_key, t);
+    t_self = t;
+    return t;
+}
+
+/* bucket i: [2^i, 2^(i+1)) ns, the last one open ended */
+static unsigned lat_bucket(uint64_t ns)
+{
+    if (ns == 0) return 0;
+    unsigned b = 63u - (unsigned)__builtin_clzll(ns);
+    return b < BLOCK_LAT_BUCKETS ? b : BLOCK_LAT_BUCKETS - 1;
+}
+
+uint64_t bstat_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void bstat_op(int op, uint64_t t0, size_t bytes)
+{
+    struct bstat_thread *t = self();
+    if (!t || op < 0 || op >= BLOCK_OP_COUNT) return;
+
+    stat_add(&t->st.ops[op], 1);
+    if (op == BLOCK_OP_READ)  stat_add(&t->st.bytes_read, bytes);
+    if (op == BLOCK_OP_WRITE) stat_add(&t->st.bytes_written, bytes);
+    if (t0)
+    {
+        uint64_t ns = bstat_now() - t0;
+        stat_add(&t->st.lat_ns[op], ns);
+        stat_add(&t->st.lat[op][lat_bucket(ns)], 1);
+    }
+}
+
+void bstat_cache(int hit)
+{
+    struct bstat_thread *t = self();
+    if (!t) return;
+    stat_add(hit ? &t->st.cache_hits : &t->st.cache_misses, 1);
+}
+
+void bstat_alloc_failed(void)
+{
+    struct bstat_thread *t = self();
+    if (!t) return;
+    stat_add(&t->st.alloc_failed, 1);
+}
+
+static void stats_total(struct block_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+
+    pthread_mutex_lock(&g_lock);
+    stat_sum(st, &g_retired);
+    for (struct bstat_thread *t = g_threads; t; t = t->next)
+    {
+        stat_sum(st, &t->st);
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+void block_stats_get(struct block_stats *st)
+{
+    if (!st) return;
+    stats_total(st);
+
+    uint64_t *s = (uint64_t *)st;
+    const uint64_t *b = (const uint64_t *)&g_base;
+    for (size_t i = 0; i < STAT_WORDS; i++)
+    {
+        s[i] -= b[i];
+    }
+}
+
+void block_stats_reset(void)
+{
+    stats_total(&g_base);
+}
+
+const char *block_op_name(int op)
+{
+    if (op < 0 || op >= BLOCK_OP_COUNT) return "?";
+    return g_op_names[op];
+}
@@ -0,0 +1,14 @@
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32C (Castagnoli), as used by iSCSI / ext4 / btrfs.
+ * crc32c(0, buf, len) checksums one buffer; pass the previous result to
+ * continue over several pieces. SSE4.2 when the CPU has it, slicing-by-8
+ * otherwise. */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+const char *crc32c_impl(void);      /* "sse4.2" or "slice8" */
+
+#endif /* _CRC32C_H_ */
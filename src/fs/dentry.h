@@ -2,13 +2,15 @@
 
 #define _DENRTY_H_
 
+#include "types.h"
+
 struct inode;
 
 struct dentry 
 {
   char *d_name;
   struct dentry *d_parent;
-  struct inode  *d_inode;
+  fs_ino_t       d_ino;     // inode number, 0: none; d_inode() fetches it
   struct dentry *d_child;   // next child
   struct dentry *d_sibling; // next brother
 };
@@ -0,0 +1,487 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "vfs_internal.h"
+#include "inode.h"
+#include "dentry.h"
+#include "block.h"
+
+/* inode table and inode cache
+ * Inodes live on disk in a table of fixed-size records indexed by inode
+ * number, one contiguous run of blocks the metadata header points at:
+ * inode n is record n % per-block of block start + n / per-block, so
+ * fetching one is a single block read. Dentries hold inode numbers;
+ * d_inode() looks the number up here.
+ *
+ * The cache is a hash table over the inodes in memory plus an LRU list.
+ * A lookup that misses reads the record in and puts the inode at the
+ * front. fs_icache_trim() evicts from the back down to ICACHE_INODES, and
+ * skips pinned inodes (inode_hold) and dirty ones. It runs between
+ * shell commands, so a pointer from d_inode() stays good for the rest of
+ * the operation that got it.
+ *
+ * Changes reach the table at checkpoint (icache_flush). Until then the
+ * journal has them: each record carries the whole inode.
+ *
+ * Free numbers come from a bitmap. It is not kept on disk but rebuilt
+ * from the namespace at load (inode_claim), so no crash can leak a
+ * number. The bitmap spans every number up to the limit, the table only
+ * as many as it was made for: a number past the table is handed out
+ * when the table is full, its inode stays dirty in the cache (and in the
+ * journal), and the next checkpoint moves the table to a bigger run
+ * (icache_table_need) before flushing. */
+
+#define ICACHE_INODES  256     /* clean, unpinned inodes kept */
+#define ICACHE_HASH    512     /* buckets, a power of 2 */
+
+#define ITABLE_REC_SIZE 128
+
+typedef struct
+{
+  uint8_t  used;
+  uint8_t  type;
+  uint16_t reserved0;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t nlink;
+  uint32_t reserved1;
+  uint64_t size;
+  uint64_t mtime;
+  int32_t  blocks[N_BLOCKS];
+  uint8_t  pad[ITABLE_REC_SIZE - 40 - N_BLOCKS * sizeof(int32_t)];
+} itable_rec_t;
+
+_Static_assert(sizeof(itable_rec_t) == ITABLE_REC_SIZE, "inode record size");
+
+static struct inode *g_hash[ICACHE_HASH];
+static struct inode *g_lru_head;    /* most recently used */
+static struct inode *g_lru_tail;
+static size_t        g_cached;
+
+static uint8_t *g_used;             /* inode number bitmap */
+static uint32_t g_count;            /* numbers 0..g_count-1 have records; 0 is never used */
+static uint32_t g_max;              /* numbers 0..g_max-1 can be handed out */
+static uint32_t g_hint;             /* next-fit cursor */
+static int      g_table = -1;       /* first block of the table, -1: none yet */
+
+static size_t recs_per_block(void)
+{
+  return block_size() / ITABLE_REC_SIZE;
+}
+
+size_t icache_table_blocks(uint32_t count)
+{
+  size_t per = recs_per_block();
+  return (count + per - 1) / per;
+}
+
+/* ---------- bitmap ---------- */
+
+static int bit_test(uint32_t ino)
+{
+  return (g_used[ino / 8] >> (ino % 8)) & 1;
+}
+
+static void bit_set(uint32_t ino)
+{
+  g_used[ino / 8] |= (uint8_t)(1u << (ino % 8));
+}
+
+static void bit_clear(uint32_t ino)
+{
+  g_used[ino / 8] &= (uint8_t)~(1u << (ino % 8));
+}
+
+int icache_setup(uint32_t count, uint32_t max)
+{
+  if (count <= ROOT_INO || max < count)
+  {
+    return -1;
+  }
+
+  uint8_t *used = calloc(max / 8 + 1, 1);
+  if (!used)
+  {
+    return -1;
+  }
+  free(g_used);
+  g_used  = used;
+  g_count = count;
+  g_max   = max;
+  g_hint  = ROOT_INO + 1;
+  bit_set(0);
+  bit_set(ROOT_INO);
+  return 0;
+}
+
+int inode_claim(fs_ino_t ino)
+{
+  if (!g_used || ino == 0 || ino >= g_max)
+  {
+    return -1;
+  }
+  bit_set((uint32_t)ino);
+  return 0;
+}
+
+/* ---------- hash + LRU ---------- */
+
+static struct inode **bucket(fs_ino_t ino)
+{
+  return &g_hash[ino & (ICACHE_HASH - 1)];
+}
+
+static void lru_unlink(struct inode *inode)
+{
+  if (inode->i_lprev) inode->i_lprev->i_lnext = inode->i_lnext;
+  else g_lru_head = inode->i_lnext;
+  if (inode->i_lnext) inode->i_lnext->i_lprev = inode->i_lprev;
+  else g_lru_tail = inode->i_lprev;
+  inode->i_lprev = inode->i_lnext = NULL;
+}
+
+static void lru_push(struct inode *inode)
+{
+  inode->i_lprev = NULL;
+  inode->i_lnext = g_lru_head;
+  if (g_lru_head) g_lru_head->i_lprev = inode;
+  g_lru_head = inode;
+  if (!g_lru_tail) g_lru_tail = inode;
+}
+
+static void cache_insert(struct inode *inode)
+{
+  struct inode **b = bucket(inode->i_ino);
+  inode->i_hnext = *b;
+  *b = inode;
+  lru_push(inode);
+  g_cached++;
+}
+
+static void cache_remove(struct inode *inode)
+{
+  struct inode **pp = bucket(inode->i_ino);
+  while (*pp && *pp != inode)
+  {
+    pp = &(*pp)->i_hnext;
+  }
+  if (*pp)
+  {
+    *pp = inode->i_hnext;
+  }
+  inode->i_hnext = NULL;
+  lru_unlink(inode);
+  g_cached--;
+}
+
+static struct inode *cache_find(fs_ino_t ino)
+{
+  for (struct inode *i = *bucket(ino); i; i = i->i_hnext)
+  {
+    if (i->i_ino == ino)
+    {
+      return i;
+    }
+  }
+  return NULL;
+}
+
+/* ---------- records ---------- */
+
+static int rec_block(fs_ino_t ino)
+{
+  return g_table + (int)(ino / recs_per_block());
+}
+
+static size_t rec_offset(fs_ino_t ino)
+{
+  return (ino % recs_per_block()) * ITABLE_REC_SIZE;
+}
+
+static void rec_to_inode(const itable_rec_t *r, struct inode *inode)
+{
+  inode->i_type  = (fs_inode_type_t)r->type;
+  inode->i_mode  = (fs_mode_t)r->mode;
+  inode->i_uid   = (fs_uid_t)r->uid;
+  inode->i_gid   = (fs_gid_t)r->gid;
+  inode->i_nlink = (fs_nlink_t)r->nlink;
+  inode->i_size  = (size_t)r->size;
+  inode->i_mtime = r->mtime;
+  inode_set_ptrs(inode, r->blocks);
+}
+
+static void inode_to_rec(const struct inode *inode, itable_rec_t *r)
+{
+  memset(r, 0, sizeof(*r));
+  r->used  = 1;
+  r->type  = (uint8_t)inode->i_type;
+  r->mode  = (uint32_t)inode->i_mode;
+  r->uid   = (uint32_t)inode->i_uid;
+  r->gid   = (uint32_t)inode->i_gid;
+  r->nlink = (uint32_t)inode->i_nlink;
+  r->size  = (uint64_t)inode->i_size;
+  r->mtime = inode->i_mtime;
+  for (int k = 0; k < N_BLOCKS; k++)
+  {
+    r->blocks[k] = inode->i_block[k];
+  }
+}
+
+static int rec_read(fs_ino_t ino, itable_rec_t *r)
+{
+  const uint8_t *p = block_pin(rec_block(ino), BLOCK_PIN_READ);
+  if (!p)
+  {
+    return -1;
+  }
+  memcpy(r, p + rec_offset(ino), sizeof(*r));
+  block_unpin(rec_block(ino));
+  return 0;
+}
+
+static int rec_write(const struct inode *inode)
+{
+  itable_rec_t r;
+  inode_to_rec(inode, &r);
+
+  uint8_t *p = block_pin(rec_block(inode->i_ino), BLOCK_PIN_WRITE);
+  if (!p)
+  {
+    return -1;
+  }
+  memcpy(p + rec_offset(inode->i_ino), &r, sizeof(r));
+  block_unpin(rec_block(inode->i_ino));
+  return 0;
+}
+
+int icache_set_table(int start, uint32_t count)
+{
+  if (count <= ROOT_INO || count > g_max)
+  {
+    return -1;
+  }
+  g_table = start;
+  g_count = count;
+
+  /* the root exists before the table is known: it takes the attributes
+   * saved for it, if any */
+  struct inode *root = cache_find(ROOT_INO);
+  itable_rec_t r;
+  if (root && start >= 0 && rec_read(ROOT_INO, &r) == 0 && r.used &&
+      r.type == FS_INODE_DIR) {
+    rec_to_inode(&r, root);
+  }
+  return 0;
+}
+
+int icache_flush(void)
+{
+  if (g_table < 0)
+  {
+    return -1;
+  }
+
+  int dirty = 0;
+  for (struct inode *i = g_lru_head; i; i = i->i_lnext)
+  {
+    if (!i->i_dirty)
+    {
+      continue;
+    }
+    if (i->i_ino >= g_count || rec_write(i) != 0)
+    {
+      return -1;
+    }
+    dirty = 1;
+  }
+  if (dirty && block_sync(g_table, icache_table_blocks(g_count)) != 0)
+  {
+    return -1;
+  }
+
+  for (struct inode *i = g_lru_head; i; i = i->i_lnext)
+  {
+    i->i_dirty = 0;
+  }
+  return 0;
+}
+
+uint32_t icache_table_need(void)
+{
+  uint32_t n = g_max;
+  while (n > g_count && !bit_test(n - 1))
+  {
+    n--;
+  }
+  return n;
+}
+
+size_t fs_inodes_free(void)
+{
+  size_t n = 0;
+  for (uint32_t ino = 0; g_used && ino < g_max; ino++)
+  {
+    n += !bit_test(ino);
+  }
+  return n;
+}
+
+/* ---------- inodes ---------- */
+
+struct inode *inode_get(fs_ino_t ino)
+{
+  struct inode *inode = cache_find(ino);
+  if (inode)
+  {
+    if (inode != g_lru_head)
+    {
+      lru_unlink(inode);
+      lru_push(inode);
+    }
+    return inode;
+  }
+
+  if (g_table < 0 || ino == 0 || ino >= g_count || !bit_test((uint32_t)ino))
+  {
+    return NULL;
+  }
+
+  itable_rec_t r;
+  if (rec_read(ino, &r) != 0 || !r.used)
+  {
+    return NULL;
+  }
+
+  inode = calloc(1, sizeof(*inode));
+  if (!inode)
+  {
+    return NULL;
+  }
+  inode->i_ino = ino;
+  inode_init_blocks(inode);
+  rec_to_inode(&r, inode);
+  cache_insert(inode);
+  return inode;
+}
+
+struct inode *d_inode(const struct dentry *d)
+{
+  return (d && d->d_ino) ? inode_get(d->d_ino) : NULL;
+}
+
+static struct inode *inode_create(fs_ino_t ino, fs_inode_type_t type)
+{
+  struct inode *inode = calloc(1, sizeof(*inode));
+  if (!inode)
+  {
+    return NULL;
+  }
+  inode->i_ino   = ino;
+  inode->i_type  = type;
+  inode->i_nlink = 1;
+  inode->i_dirty = 1;
+  inode_init_blocks(inode);
+  if (g_used)
+  {
+    bit_set((uint32_t)ino);   /* the root's is set by icache_setup */
+  }
+  cache_insert(inode);
+  return inode;
+}
+
+struct inode *inode_new(fs_inode_type_t type)
+{
+  if (!g_used)
+  {
+    return NULL;
+  }
+
+  /* next fit: in a session, numbers go round the table before any is
+   * reused; past it only once the table is full */
+  for (uint32_t k = 0; k < g_count; k++)
+  {
+    uint32_t ino = (g_hint + k) % g_count;
+    if (!bit_test(ino))
+    {
+      g_hint = ino + 1;
+      return inode_create(ino, type);
+    }
+  }
+  for (uint32_t ino = g_count; ino < g_max; ino++)
+  {
+    if (!bit_test(ino))
+    {
+      return inode_create(ino, type);
+    }
+  }
+  return NULL;
+}
+
+struct inode *inode_new_at(fs_ino_t ino, fs_inode_type_t type)
+{
+  struct inode *inode = cache_find(ino);
+  if (inode)
+  {
+    return inode;
+  }
+  if (ino == 0 || (g_used && ino >= g_max))
+  {
+    return NULL;
+  }
+  return inode_create(ino, type);
+}
+
+void inode_delete(struct inode *inode)
+{
+  if (!inode || inode->i_ino == ROOT_INO)
+  {
+    return;
+  }
+  cache_remove(inode);
+  if (g_used && inode->i_ino < g_max)
+  {
+    bit_clear((uint32_t)inode->i_ino);
+  }
+  inode_release(inode);
+}
+
+void inode_mark_dirty(struct inode *inode)
+{
+  if (inode)
+  {
+    inode->i_dirty = 1;
+  }
+}
+
+void inode_hold(struct inode *inode)
+{
+  if (inode)
+  {
+    inode->i_count++;
+  }
+}
+
+void inode_put(struct inode *inode)
+{
+  if (inode && inode->i_count > 0)
+  {
+    inode->i_count--;
+  }
+}
+
+void fs_icache_trim(void)
+{
+  struct inode *i = g_lru_tail;
+  while (i && g_cached > ICACHE_INODES)
+  {
+    struct inode *prev = i->i_lprev;
+    if (i->i_count == 0 && !i->i_dirty)
+    {
+      cache_remove(i);
+      inode_release(i);
+    }
+    i = prev;
+  }
+}
@@ -0,0 +1,207 @@
+/*standard lib */
+#include <stdint.h>
+#include <string.h>
+/*standard lib done*/
+
+#include "lz.h"
+
+/* sequence: token (literal length << 4 | match length - 4), extra
+ * literal length bytes, literals, 2-byte offset, extra match length
+ * bytes. A length field of 15 continues in bytes of 255 until a smaller
+ * one. The last sequence has literals only. */
+#define LZ_MIN_MATCH    4
+#define LZ_MAX_OFFSET   65535
+#define LZ_HASH_BITS    12      /* at most; smaller inputs use fewer */
+#define LZ_MAX_INPUT    65536   /* positions fit the 16-bit table */
+#define LZ_SKIP_SHIFT   5       /* skip faster through incompressible data */
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v, unsigned bits)
+{
+    return (v * 2654435761u) >> (32 - bits);
+}
+
+/* extra length bytes for a field that saturated at 15 */
+static uint8_t *put_len(uint8_t *op, const uint8_t *oend, size_t len)
+{
+    for (len -= 15; len >= 255; len -= 255)
+    {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *put_seq(uint8_t *op, const uint8_t *oend, const uint8_t *lit, size_t nlit,
+                        size_t offset, size_t mlen)
+{
+    if (op >= oend) return NULL;
+
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15 && !(op = put_len(op, oend, nlit))) return NULL;
+
+    if ((size_t)(oend - op) < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen == 0) return op;   /* last sequence */
+
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+
+    mlen -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(mlen < 15 ? mlen : 15);
+    if (mlen >= 15 && !(op = put_len(op, oend, mlen))) return NULL;
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const uint8_t *base   = src;
+    const uint8_t *ip     = base;
+    const uint8_t *anchor = base;
+    const uint8_t *end    = base + len;
+    uint8_t *op   = dst;
+    uint8_t *oend = op + cap;
+
+    if (len > LZ_MAX_INPUT) return 0;
+
+    /* about one slot per input byte: clearing the table is a real part
+     * of the cost for small blocks. Empty slots point at position 0 and
+     * fail the compare like any stale slot. */
+    unsigned bits = 6;
+    while (bits < LZ_HASH_BITS && ((size_t)1 << bits) < len) bits++;
+
+    uint16_t tab[1u << LZ_HASH_BITS];
+    memset(tab, 0, sizeof(tab[0]) << bits);
+
+    while (end - ip >= LZ_MIN_MATCH)
+    {
+        uint32_t v = read32(ip);
+        uint32_t h = hash4(v, bits);
+        const uint8_t *ref = base + tab[h];
+        int hit = ref < ip && ip - ref <= LZ_MAX_OFFSET && read32(ref) == v;
+        tab[h] = (uint16_t)(ip - base);
+
+        if (!hit)
+        {
+            ip += 1 + ((size_t)(ip - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        /* extend 8 bytes a step, the first differing byte from the xor */
+        const uint8_t *mp = ip + LZ_MIN_MATCH;
+        const uint8_t *rp = ref + LZ_MIN_MATCH;
+        uint64_t a = 0, b = 0;
+        while (end - mp >= 8)
+        {
+            memcpy(&a, mp, 8);
+            memcpy(&b, rp, 8);
+            if (a != b) break;
+            mp += 8;
+            rp += 8;
+        }
+        if (a != b)
+        {
+            mp += (size_t)__builtin_ctzll(a ^ b) / 8;       /* little endian */
+        }
+        else
+        {
+            while (mp < end && *mp == *rp)
+            {
+                mp++;
+                rp++;
+            }
+        }
+
+        op = put_seq(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref),
+                     (size_t)(mp - ip));
+        if (!op) return 0;
+        ip = anchor = mp;
+    }
+
+    op = put_seq(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - (uint8_t *)dst) : 0;
+}
+
+/* length field continuation; -1 on truncated input */
+static int get_len(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t b;
+    do
+    {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const void *src, size_t len, void *dst, size_t out_len)
+{
+    const uint8_t *ip   = src;
+    const uint8_t *iend = ip + len;
+    uint8_t *op   = dst;
+    uint8_t *oend = op + out_len;
+
+    for (;;)
+    {
+        if (ip >= iend) return -1;
+        uint8_t token = *ip++;
+
+        size_t nlit = token >> 4;
+        if (nlit == 15 && get_len(&ip, iend, &nlit) != 0) return -1;
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) return -1;
+        if (nlit < 16 && iend - ip >= 16 && oend - op >= 16)
+        {
+            memcpy(op, ip, 16);     /* fixed size: one move, extra is rewritten */
+        }
+        else
+        {
+            memcpy(op, ip, nlit);
+        }
+        ip += nlit;
+        op += nlit;
+
+        if (ip == iend) break;      /* literals-only last sequence */
+
+        if (iend - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) return -1;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_len(&ip, iend, &mlen) != 0) return -1;
+        mlen += LZ_MIN_MATCH;
+        if ((size_t)(oend - op) < mlen) return -1;
+
+        const uint8_t *ref = op - offset;
+        if (offset >= 8 && (size_t)(oend - op) >= mlen + 8)
+        {
+            /* 8 bytes a step; may run past the match into space the
+             * next sequence overwrites */
+            uint8_t *mend = op + mlen;
+            for (; op < mend; op += 8, ref += 8)
+            {
+                memcpy(op, ref, 8);
+            }
+            op = mend;
+        }
+        else
+        {
+            /* overlapping: the match repeats its own output */
+            while (mlen--) *op++ = *ref++;
+        }
+    }
+    return op == oend ? 0 : -1;
+}
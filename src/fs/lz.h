@@ -0,0 +1,15 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#include <stddef.h>
+
+/* small LZ77 codec in the LZ4 block format: byte-aligned sequences of
+ * literals and 16-bit offset matches, no entropy stage. Meant for one
+ * block at a time; speed over ratio.
+ * lz_compress returns the compressed size, 0 if it would exceed cap.
+ * lz_decompress returns 0 only if src decodes to exactly out_len bytes;
+ * it never reads or writes out of bounds, whatever src holds. */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+int    lz_decompress(const void *src, size_t len, void *dst, size_t out_len);
+
+#endif /* _LZ_H_ */
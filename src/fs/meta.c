@@ -1,89 +1,324 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 
 #include "meta.h"
 #include "block.h"
+#include "crc32c.h"
 #include "vfs_internal.h"
 #include "dentry.h"
 #include "inode.h"
 
 /* ---------- on-disk layout ---------- */
 #define META_MAGIC 0x4D455441u /* 'META' */
-#define META_VER   1
+#define META_VER   7            /* v1: table at blocks 1.., no journal;
+                                 * v2: direct block pointers only;
+                                 * v3: block pointers, no extents;
+                                 * v4: no inline data;
+                                 * v5: inodes in the table entries;
+                                 * v6: 32-bit file sizes */
 
 #define META_BLK_HEADER 0
-#define META_BLK_ENTRIES_START 1
+#define META_BLK_ENTRIES_START 1    /* v1 table */
 #define META_MAX_ENTRIES 1024
 
-/* root entries only (for Phase 4-2) */
-typedef struct 
+#define META_F_CLEAN 0x1u       /* saved at exit: nothing to replay or sweep */
+
+/* the table is written to freshly allocated blocks at each checkpoint,
+ * so it may come in pieces */
+#define META_TABLE_RUNS 16
+
+/* journal: about this much, but no more than 1/16 of the device */
+#define META_JOURNAL_BYTES  16384
+#define META_JOURNAL_MIN    2   /* blocks */
+
+/* inode table: one inode per this many bytes of device to start with, no
+ * fewer than MIN; a checkpoint grows it (at least doubling) once numbers
+ * past it are in use, up to MAX (a rollback holds two trees for a moment) */
+#define META_INODE_BYTES    8192
+#define META_INODES_MIN     64
+#define META_INODES_MAX     (2 * META_MAX_ENTRIES + 2)
+
+typedef struct
+{
+    uint32_t start;
+    uint32_t len;
+} meta_run_t;
+
+typedef struct
 {
     uint32_t magic;
     uint32_t ver;
     uint32_t entry_count;
-    uint32_t reserved;
+    uint32_t flags;             /* META_F_*; v1: reserved, 0 */
+    /* v2 */
+    uint32_t hdr_crc;           /* CRC32C of the header, this field 0 */
+    uint32_t gen;               /* journal records of other generations are stale */
+    uint32_t table_crc;         /* CRC32C of the entries */
+    uint32_t table_runs;
+    uint32_t journal_start;
+    uint32_t journal_blocks;    /* 0: no journal, the table is saved at exit only */
+    uint32_t snap_count;
+    uint32_t snap_start;        /* the snapshot list, contiguous */
+    meta_run_t runs[META_TABLE_RUNS];
+    /* v6 */
+    uint32_t itable_start;      /* the inode table, contiguous */
+    uint32_t itable_count;      /* inode numbers 0..count-1 */
 } meta_header_t;
 
 #define NAME_MAX_ONDISK 60
 
-typedef struct 
+/* the live table names inodes by number (ino), size and blocks unused;
+ * a snapshot's entries carry the inode itself (ino 0), as v3-v5 ones do */
+typedef struct
 {
     uint8_t  used;          /* 0 free, 1 used */
     uint8_t  type;          /* FS_INODE_FILE / FS_INODE_DIR */
     uint16_t reserved0;
-    uint32_t size;          /* file size */
-    int32_t  blocks[DIRECT_BLOCKS]; /* direct blocks */
+    uint32_t ino;
+    uint64_t size;          /* file size */
+    int32_t  blocks[N_BLOCKS]; /* pointers, extents or data, see vfs_bmap.c */
     int32_t  parent;
     char     name[NAME_MAX_ONDISK]; /* null-terminated if fits */
 } meta_entry_t;
+_Static_assert(sizeof(meta_entry_t) == 20 + N_BLOCKS * sizeof(int32_t) + NAME_MAX_ONDISK,
+               "table entry: no padding");
+
+/* v3-v6 entries: a 32-bit size, the inode number last (v6 only) */
+typedef struct
+{
+    uint8_t  used;
+    uint8_t  type;
+    uint16_t reserved0;
+    uint32_t size;
+    int32_t  blocks[N_BLOCKS];
+    int32_t  parent;
+    char     name[NAME_MAX_ONDISK];
+    /* v6 */
+    uint32_t ino;
+} meta_entry_v6_t;
+
+/* v1/v2 entries: the same, with the direct blocks only */
+#define META_V2_BLOCKS 12
+
+typedef struct
+{
+    uint8_t  used;
+    uint8_t  type;
+    uint16_t reserved0;
+    uint32_t size;
+    int32_t  blocks[META_V2_BLOCKS];
+    int32_t  parent;
+    char     name[NAME_MAX_ONDISK];
+} meta_entry_v2_t;
+
+/* snapshot: a table of its own, frozen. Its entries own one reference
+ * to each block they name, so the live tree's writes (new blocks, the
+ * old ones unref'd) never touch it. */
+#define META_SNAP_MAX 32
 
-static void entry_clear(meta_entry_t *e) 
+typedef struct
+{
+    char       name[META_SNAP_NAME];
+    uint64_t   created;
+    uint32_t   entry_count;
+    uint32_t   table_crc;
+    uint32_t   table_runs;
+    uint32_t   data_blocks;     /* block references held */
+    meta_run_t runs[META_TABLE_RUNS];
+} meta_snap_t;
+
+/* journal record: the new state of one path, followed by the path
+ * ("/a/b", not terminated) and zero padding to a multiple of 8 */
+#define META_REC_MAGIC 0x4A524E4Cu /* 'JRNL' */
+#define META_PATH_MAX  1024
+
+enum
+{
+    META_OP_UPDATE = 1,     /* create, or set type / size / blocks */
+    META_OP_REMOVE = 2,     /* unlink the path and everything below it */
+};
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t gen;
+    uint32_t len;           /* whole record, bytes */
+    uint32_t crc;           /* CRC32C of the whole record, this field 0 */
+    uint8_t  op;
+    uint8_t  type;
+    uint16_t path_len;
+    uint32_t ino;
+    uint64_t size;
+    int32_t  blocks[N_BLOCKS];
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t reserved0;
+    uint64_t mtime;
+} meta_rec_t;
+_Static_assert(sizeof(meta_rec_t) == 56 + N_BLOCKS * sizeof(int32_t), "journal record: no padding");
+
+/* v3-v6 records: a 32-bit size, the rest of the inode after the blocks
+ * (v6 only) */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t gen;
+    uint32_t len;
+    uint32_t crc;
+    uint8_t  op;
+    uint8_t  type;
+    uint16_t path_len;
+    uint32_t size;
+    int32_t  blocks[N_BLOCKS];
+    /* v6 */
+    uint32_t ino;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t mtime;
+} meta_rec_v6_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t gen;
+    uint32_t len;
+    uint32_t crc;
+    uint8_t  op;
+    uint8_t  type;
+    uint16_t path_len;
+    uint32_t size;
+    int32_t  blocks[META_V2_BLOCKS];
+} meta_rec_v2_t;
+
+static void entry_clear(meta_entry_t *e)
 {
     memset(e, 0, sizeof(*e));
-    for (int i = 0; i < DIRECT_BLOCKS; i++) e->blocks[i] = -1;
+    for (int i = 0; i < N_BLOCKS; i++) e->blocks[i] = -1;
+}
+
+/* a v1/v2 entry or record: its direct blocks, nothing indirect */
+static void blocks_upgrade(int32_t *to, const int32_t *from)
+{
+    for (int i = 0; i < N_BLOCKS; i++) to[i] = i < META_V2_BLOCKS ? from[i] : -1;
+}
+
+static void entry_upgrade(meta_entry_t *e, const meta_entry_v2_t *old)
+{
+    entry_clear(e);
+    e->used   = old->used;
+    e->type   = old->type;
+    e->size   = old->size;
+    e->parent = old->parent;
+    blocks_upgrade(e->blocks, old->blocks);
+    memcpy(e->name, old->name, NAME_MAX_ONDISK);
+}
+
+static void entry_upgrade_v6(meta_entry_t *e, const meta_entry_v6_t *old)
+{
+    entry_clear(e);
+    e->used   = old->used;
+    e->type   = old->type;
+    e->ino    = old->ino;
+    e->size   = old->size;
+    e->parent = old->parent;
+    memcpy(e->blocks, old->blocks, sizeof(e->blocks));
+    memcpy(e->name, old->name, NAME_MAX_ONDISK);
+}
+
+static void rec_upgrade_v6(meta_rec_t *r, const meta_rec_v6_t *old)
+{
+    memset(r, 0, sizeof(*r));
+    r->magic    = old->magic;
+    r->gen      = old->gen;
+    r->len      = old->len;
+    r->crc      = old->crc;
+    r->op       = old->op;
+    r->type     = old->type;
+    r->path_len = old->path_len;
+    r->ino      = old->ino;
+    r->size     = old->size;
+    memcpy(r->blocks, old->blocks, sizeof(r->blocks));
+    r->mode     = old->mode;
+    r->uid      = old->uid;
+    r->gid      = old->gid;
+    r->mtime    = old->mtime;
 }
 
-static void inode_init_blocks(struct inode *ino) 
+static size_t entry_size(uint32_t ver)
 {
-    for (int i = 0; i < DIRECT_BLOCKS; i++) ino->i_block[i] = -1;
+    if (ver < 3) return sizeof(meta_entry_v2_t);
+    if (ver < 6) return offsetof(meta_entry_v6_t, ino);
+    return ver < 7 ? sizeof(meta_entry_v6_t) : sizeof(meta_entry_t);
+}
+
+static size_t rec_size(uint32_t ver)
+{
+    if (ver < 3) return sizeof(meta_rec_v2_t);
+    if (ver < 6) return offsetof(meta_rec_v6_t, ino);
+    return ver < 7 ? sizeof(meta_rec_v6_t) : sizeof(meta_rec_t);
 }
 
 static meta_entry_t g_entries[META_MAX_ENTRIES];
+static meta_run_t   g_itable_old;  /* a grown table's old run: free once the header moves */
 static uint32_t g_entry_count;
 
+static meta_header_t g_hdr;     /* as on disk */
+static meta_snap_t g_snaps[META_SNAP_MAX];
+static uint32_t    g_nsnaps;
+static uint32_t    g_snap_start;
+static uint32_t    g_snap_ver = META_VER;   /* format of the snapshot tables */
+static uint8_t *g_jbuf;         /* the journal region, as on disk */
+static size_t   g_jsize;        /* bytes */
+static size_t   g_jtail;        /* next record goes here */
+
 
 /* count root children */
-static uint32_t count_root_children(void) 
+static uint32_t count_root_children(void)
 {
     struct super_block *sb = fs_get_super();
     if (!sb || !sb->s_root) return 0;
 
     uint32_t n = 0;
     for (struct dentry *cur = sb->s_root->d_child; cur; cur = cur->d_sibling) {
-        if (cur->d_name && cur->d_inode) n++;
+        if (cur->d_name && cur->d_ino) n++;
     }
     return n;
 }
 
-//DFS
-static void save_dentry_recursive(struct dentry *d, int parent_idx)
+//DFS; full: the inode in the entry (a snapshot), else its number
+/* -1 if an inode the tree names cannot be read: a table without it
+ * would drop the name for good */
+static int save_dentry_recursive(struct dentry *d, int parent_idx, int full)
 {
-    if (!d || !d->d_inode || !d->d_name) return;
-    if (g_entry_count >= META_MAX_ENTRIES) return;
+    struct inode *inode = d_inode(d);
+    if (d && d->d_ino && !inode) return -1;
+    if (!d || !inode || !d->d_name) return 0;
+    if (g_entry_count >= META_MAX_ENTRIES) return 0;
 
     int my_idx = g_entry_count++;
     meta_entry_t *e = &g_entries[my_idx];
     entry_clear(e);
 
     e->used   = 1;
-    e->type   = (uint8_t)d->d_inode->i_type;
-    e->size   = (uint32_t)d->d_inode->i_size;
+    e->type   = (uint8_t)inode->i_type;
     e->parent = parent_idx;
 
-    for (int i = 0; i < DIRECT_BLOCKS; i++) {
-        e->blocks[i] = d->d_inode->i_block[i];
+    if (full)
+    {
+        e->size = (uint64_t)inode->i_size;
+        /* directories own no blocks (mkdir used to leave zeros there) */
+        for (int i = 0; e->type == FS_INODE_FILE && i < N_BLOCKS; i++) {
+            e->blocks[i] = inode->i_block[i];
+        }
+    }
+    else
+    {
+        e->ino = (uint32_t)inode->i_ino;
     }
 
     strncpy(e->name, d->d_name, NAME_MAX_ONDISK - 1);
@@ -91,175 +326,1387 @@ static void save_dentry_recursive(struct dentry *d, int parent_idx)
 
     /* recurse into children */
     for (struct dentry *c = d->d_child; c; c = c->d_sibling) {
-        save_dentry_recursive(c, my_idx);
+        if (save_dentry_recursive(c, my_idx, full) != 0) return -1;
     }
+    return 0;
 }
 
-int meta_save(void)
+static uint32_t entries_per_block(size_t bsize, uint32_t ver)
 {
-    uint8_t buf[BLOCK_SIZE];
-    meta_header_t hdr;
+    return (uint32_t)(bsize / entry_size(ver));
+}
 
-    struct super_block *sb = fs_get_super();
-    if (!sb || !sb->s_root) return -1;
+static uint32_t table_blocks(uint32_t entry_count, size_t bsize, uint32_t ver)
+{
+    uint32_t per = entries_per_block(bsize, ver);
+    return (entry_count + per - 1) / per;
+}
 
-    /* 1) DFS collect */
-    g_entry_count = 0;
-    for (struct dentry *c = sb->s_root->d_child; c; c = c->d_sibling) {
-        save_dentry_recursive(c, -1);
+/* k-th block of a table stored in runs */
+static int table_block(const meta_run_t *runs, uint32_t nruns, uint32_t k)
+{
+    for (uint32_t r = 0; r < nruns; r++)
+    {
+        if (k < runs[r].len) return (int)(runs[r].start + k);
+        k -= runs[r].len;
+    }
+    return -1;
+}
+
+static uint32_t header_crc(const meta_header_t *hdr)
+{
+    meta_header_t h = *hdr;
+    h.hdr_crc = 0;
+    return crc32c(0, &h, hdr->ver < 6 ? offsetof(meta_header_t, itable_start) : sizeof(h));
+}
+
+static int header_write(uint8_t *buf, size_t bsize)
+{
+    g_hdr.hdr_crc = header_crc(&g_hdr);
+
+    memset(buf, 0, bsize);
+    memcpy(buf, &g_hdr, sizeof(g_hdr));
+    if (block_write(META_BLK_HEADER, buf) != 0) return -1;
+    return block_sync(META_BLK_HEADER, 1);
+}
+
+/* ---------- checkpoint ---------- */
+
+static void free_runs(const meta_run_t *runs, uint32_t n)
+{
+    for (uint32_t r = 0; r < n; r++)
+    {
+        for (uint32_t k = 0; k < runs[r].len; k++)
+        {
+            /* the meta area (and a v1 table in it) stays reserved */
+            if (runs[r].start + k >= META_RESERVED_BLOCKS) block_free((int)(runs[r].start + k));
+        }
     }
+}
 
-    /* 2) reserve meta blocks */
-    block_reserve(META_BLK_HEADER);
+static int collect_tree(int full)
+{
+    struct super_block *sb = fs_get_super();
 
-    uint32_t entry_bytes  = g_entry_count * sizeof(meta_entry_t);
-    uint32_t entry_blocks = (entry_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    /* DFS collect (nothing before fs_init: a fresh image) */
+    g_entry_count = 0;
+    if (sb && sb->s_root)
+    {
+        for (struct dentry *c = sb->s_root->d_child; c; c = c->d_sibling) {
+            if (save_dentry_recursive(c, -1, full) != 0) return -1;
+        }
+    }
+    return 0;
+}
 
-    for (uint32_t b = 0; b < entry_blocks; b++) {
-        block_reserve(META_BLK_ENTRIES_START + b);
+/* entries to freshly allocated blocks near the header, on disk when this
+ * returns 0 */
+static int table_store(uint8_t *buf, size_t bsize, const meta_entry_t *list, uint32_t count,
+                       meta_run_t *runs, uint32_t *nruns)
+{
+    uint32_t need = table_blocks(count, bsize, META_VER);
+    uint32_t have = 0;
+    *nruns = 0;
+    while (have < need)
+    {
+        int start;
+        size_t got;
+        if (*nruns == META_TABLE_RUNS ||
+            block_alloc_range_group(0, need - have, &start, &got) != 0) {
+            goto fail;
+        }
+        runs[*nruns].start = (uint32_t)start;
+        runs[*nruns].len   = (uint32_t)got;
+        (*nruns)++;
+        have += (uint32_t)got;
     }
 
-    /* 3) write header */
-    memset(&hdr, 0, sizeof(hdr));
-    hdr.magic = META_MAGIC;
-    hdr.ver   = META_VER;
-    hdr.entry_count = g_entry_count;
+    /* whole blocks */
+    uint32_t per = entries_per_block(bsize, META_VER);
+    for (uint32_t k = 0; k < need; k++)
+    {
+        uint32_t first = k * per;
+        uint32_t n = count - first < per ? count - first : per;
 
-    memset(buf, 0, sizeof(buf));
-    memcpy(buf, &hdr, sizeof(hdr));
-    if (block_write(META_BLK_HEADER, buf) != 0) return -1;
+        memset(buf, 0, bsize);
+        memcpy(buf, &list[first], n * sizeof(meta_entry_t));
+        if (block_write(table_block(runs, *nruns, k), buf) != 0) goto fail;
+    }
+    for (uint32_t r = 0; r < *nruns; r++)
+    {
+        if (block_sync((int)runs[r].start, runs[r].len) != 0) goto fail;
+    }
+    return 0;
 
-    /* 4) write entries */
-    uint32_t blkno = META_BLK_ENTRIES_START;
-    uint32_t offset = 0;
-    memset(buf, 0, sizeof(buf));
+fail:
+    /* never on disk: freed with the next change that commits */
+    free_runs(runs, *nruns);
+    *nruns = 0;
+    return -1;
+}
 
-    for (uint32_t i = 0; i < g_entry_count; i++) 
+/* a table written in format ver, as current entries; crc: of the
+ * entries as stored */
+static int table_load(uint8_t *buf, size_t bsize, const meta_run_t *runs, uint32_t nruns,
+                      uint32_t count, uint32_t ver, meta_entry_t *out, uint32_t *crc)
+{
+    size_t esize = entry_size(ver);
+    uint32_t per = entries_per_block(bsize, ver);
+    *crc = 0;
+    for (uint32_t k = 0; k * per < count; k++)
     {
-        if (offset + sizeof(meta_entry_t) > BLOCK_SIZE) 
+        uint32_t first = k * per;
+        uint32_t n = count - first < per ? count - first : per;
+        if (block_read(table_block(runs, nruns, k), buf) != 0) return -1;
+        *crc = crc32c(*crc, buf, n * esize);
+        if (ver >= 7)
+        {
+            memcpy(&out[first], buf, n * sizeof(meta_entry_t));
+            continue;
+        }
+        for (uint32_t j = 0; j < n && ver >= 3; j++)
+        {
+            /* v3-v5: no inode number, the rest stays 0 */
+            meta_entry_v6_t old;
+            memset(&old, 0, sizeof(old));
+            memcpy(&old, buf + j * esize, esize);
+            entry_upgrade_v6(&out[first + j], &old);
+        }
+        for (uint32_t j = 0; j < n && ver < 3; j++)
         {
-            if (block_write(blkno, buf) != 0) return -1;
-            blkno++;
-            offset = 0;
-            memset(buf, 0, sizeof(buf));
+            meta_entry_v2_t old;
+            memcpy(&old, buf + j * esize, sizeof(old));
+            entry_upgrade(&out[first + j], &old);
         }
+    }
+    return 0;
+}
+
+/* ---------- inode table ---------- */
+
+static uint32_t itable_count(size_t bsize)
+{
+    uint64_t bytes = (uint64_t)block_total_blocks() * bsize;
+    uint32_t count = (uint32_t)(bytes / META_INODE_BYTES);
+    if (count < META_INODES_MIN) count = META_INODES_MIN;
+    if (count > META_INODES_MAX) count = META_INODES_MAX;
+    return count;
+}
+
+/* the inode table: contiguous near the header. The first keep blocks
+ * are copied from the current table, the rest zeroed (no record is in
+ * use until a checkpoint writes it). */
+static int itable_create(uint8_t *buf, size_t bsize, uint32_t count, size_t keep)
+{
+    size_t want = icache_table_blocks(count);
+    int start;
+    size_t got;
+    if (block_alloc_range_group(0, want, &start, &got) != 0) return -1;
+
+    int rc = got < want ? -1 : 0;
+    for (size_t k = 0; k < got && rc == 0; k++)
+    {
+        if (k < keep) rc = block_read((int)g_hdr.itable_start + (int)k, buf);
+        else if (k == keep) memset(buf, 0, bsize);
+        if (rc == 0) rc = block_write(start + (int)k, buf);
+    }
+    if (rc == 0) rc = block_sync(start, got);
+    if (rc != 0)
+    {
+        for (size_t k = 0; k < got; k++) block_free(start + (int)k);
+        return -1;
+    }
+
+    g_hdr.itable_start = (uint32_t)start;
+    g_hdr.itable_count = count;
+    return icache_set_table(start, count);
+}
+
+/* numbers past the table are in use: move it to a bigger run. The
+ * header on disk keeps the old one until the checkpoint that follows. */
+static int itable_grow(uint8_t *buf, size_t bsize)
+{
+    uint32_t need = icache_table_need();
+    if (need <= g_hdr.itable_count) return 0;
+    if (g_itable_old.len > 0) return -1;    /* the last move is not on disk yet */
+
+    uint32_t count = g_hdr.itable_count * 2;
+    if (count < need) count = need;
+    if (count > META_INODES_MAX) count = META_INODES_MAX;
+
+    meta_run_t old = { g_hdr.itable_start, (uint32_t)icache_table_blocks(g_hdr.itable_count) };
+    if (itable_create(buf, bsize, count, old.len) != 0)
+    {
+        printf("meta: no room to grow the inode table to %u inodes\n", count);
+        return -1;
+    }
+    g_itable_old = old;
+    return 0;
+}
+
+/* write the whole tree as a new table, then point the header at it:
+ * the old table and every journal record stay valid until the header
+ * is on disk, and are dropped (gen + 1) by that same write. The header
+ * also takes the snapshot list as it is in memory. */
+static int checkpoint(uint8_t *buf, size_t bsize, uint32_t flags)
+{
+    /* inodes first: in place, but every change since the last
+     * checkpoint is in the journal too, so a torn write replays away */
+    if (itable_grow(buf, bsize) != 0 || icache_flush() != 0) return -1;
+
+    meta_header_t hdr = g_hdr;
 
-        memcpy(buf + offset, &g_entries[i], sizeof(meta_entry_t));
-        offset += sizeof(meta_entry_t);
+    if (collect_tree(0) != 0) return -1;
+    if (table_store(buf, bsize, g_entries, g_entry_count, hdr.runs, &hdr.table_runs) != 0)
+    {
+        return -1;
     }
 
-    if (g_entry_count > 0) 
+    hdr.magic       = META_MAGIC;
+    hdr.ver         = META_VER;
+    hdr.entry_count = g_entry_count;
+    hdr.flags       = flags;
+    hdr.gen         = g_hdr.gen + 1;
+    hdr.table_crc   = crc32c(0, g_entries, g_entry_count * sizeof(meta_entry_t));
+    hdr.snap_count  = g_nsnaps;
+    hdr.snap_start  = g_snap_start;
+
+    meta_header_t prev = g_hdr;
+    g_hdr = hdr;
+    if (header_write(buf, bsize) != 0)
     {
-        if (block_write(blkno, buf) != 0) return -1;
+        g_hdr = prev;
+        free_runs(hdr.runs, hdr.table_runs);
+        return -1;
     }
 
+    /* what the old header pointed at is garbage now */
+    free_runs(prev.runs, prev.table_runs);
+    free_runs(&g_itable_old, g_itable_old.len > 0);
+    g_itable_old.len = 0;
+    g_jtail = 0;
+    block_commit_frees();
     return 0;
 }
 
+/* ---------- journal ---------- */
+
+/* a contiguous region near the header, zeroed so no stale record can
+ * pass for a current one; without room the table is saved at exit only */
+static int journal_create(uint8_t *buf, size_t bsize)
+{
+    size_t want = META_JOURNAL_BYTES / bsize;
+    if (want > block_total_blocks() / 16) want = block_total_blocks() / 16;
+    if (want < META_JOURNAL_MIN) want = META_JOURNAL_MIN;
 
+    int start;
+    size_t got;
+    if (block_alloc_range_group(0, want, &start, &got) != 0) return -1;
+    if (got < want)
+    {
+        for (size_t k = 0; k < got; k++) block_free(start + (int)k);
+        return -1;
+    }
 
-int meta_load(void)
+    uint8_t *jbuf = calloc(got, bsize);
+    if (!jbuf)
+    {
+        for (size_t k = 0; k < got; k++) block_free(start + (int)k);
+        return -1;
+    }
+
+    int rc = 0;
+    memset(buf, 0, bsize);
+    for (size_t k = 0; k < got && rc == 0; k++)
+    {
+        rc = block_write(start + (int)k, buf);
+    }
+    if (rc == 0) rc = block_sync(start, got);
+    if (rc != 0)
+    {
+        for (size_t k = 0; k < got; k++) block_free(start + (int)k);
+        free(jbuf);
+        return -1;
+    }
+
+    free(g_jbuf);
+    g_jbuf  = jbuf;
+    g_jsize = got * bsize;
+    g_jtail = 0;
+    g_hdr.journal_start  = (uint32_t)start;
+    g_hdr.journal_blocks = (uint32_t)got;
+    return 0;
+}
+
+static int journal_append(const meta_rec_t *rec, const char *path)
 {
-    struct dentry *dent_list[META_MAX_ENTRIES] = {0};
-    meta_entry_t   entry_list[META_MAX_ENTRIES];
+    size_t bsize = block_size();
+    size_t len = (sizeof(*rec) + rec->path_len + 7) & ~(size_t)7;
 
-    uint8_t buf[BLOCK_SIZE];
-    meta_header_t hdr;
+    uint8_t *buf = malloc(bsize);
+    if (!buf) return -1;
+
+    /* full: the table takes this change along with everything before it */
+    if (len > g_jsize - g_jtail)
+    {
+        int rc = checkpoint(buf, bsize, 0);
+        free(buf);
+        return rc;
+    }
+
+    meta_rec_t r = *rec;
+    r.magic = META_REC_MAGIC;
+    r.gen   = g_hdr.gen;
+    r.len   = (uint32_t)len;
+    r.crc   = 0;
+
+    uint8_t *p = g_jbuf + g_jtail;
+    memset(p, 0, len);
+    memcpy(p, &r, sizeof(r));
+    memcpy(p + sizeof(r), path, rec->path_len);
+    r.crc = crc32c(0, p, len);
+    memcpy(p + offsetof(meta_rec_t, crc), &r.crc, sizeof(r.crc));
+
+    int rc = 0;
+    size_t first = g_jtail / bsize;
+    size_t last  = (g_jtail + len - 1) / bsize;
+    for (size_t k = first; k <= last && rc == 0; k++)
+    {
+        rc = block_write((int)(g_hdr.journal_start + k), g_jbuf + k * bsize);
+    }
+    if (rc == 0) rc = block_sync((int)(g_hdr.journal_start + first), last - first + 1);
+    free(buf);
+    if (rc != 0) return -1;
+
+    /* the record is on disk: storage the older state used can go */
+    g_jtail += len;
+    block_commit_frees();
+    return 0;
+}
 
+/* "/a/b" for d; length, or -1 if it does not fit or d is not in the tree */
+static int dentry_path(const struct dentry *d, char *out, size_t cap)
+{
     struct super_block *sb = fs_get_super();
-    if (!sb || !sb->s_root) return -1;
+    size_t pos = cap;
 
-    if (block_read(META_BLK_HEADER, buf) != 0) return -1;
-    memcpy(&hdr, buf, sizeof(hdr));
+    for (; d && d != sb->s_root; d = d->d_parent)
+    {
+        size_t n = strlen(d->d_name);
+        if (n + 1 > pos) return -1;
+        pos -= n;
+        memcpy(out + pos, d->d_name, n);
+        out[--pos] = '/';
+    }
+    if (!d) return -1;
+
+    memmove(out, out + pos, cap - pos);
+    return (int)(cap - pos);
+}
 
-    if (hdr.magic != META_MAGIC || hdr.ver != META_VER) 
+struct sync_run
+{
+    int    start;
+    size_t len;
+};
+
+static int sync_one(int blk, void *arg)
+{
+    struct sync_run *run = arg;
+    if (run->len > 0 && blk == run->start + (int)run->len)
     {
-        return 0; // empty fs
+        run->len++;
+        return 0;
     }
+    if (run->len > 0 && block_sync(run->start, run->len) != 0) return -1;
+    run->start = blk;
+    run->len   = 1;
+    return 0;
+}
 
-    // reserve meta blocks
-    block_reserve(META_BLK_HEADER);
-    uint32_t entry_bytes  = hdr.entry_count * (uint32_t)sizeof(meta_entry_t);
-    uint32_t entry_blocks = (entry_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    for (uint32_t b = 0; b < entry_blocks; b++) 
+/* ordered: the blocks a record points at, indirect ones included, reach
+ * the disk before it; adjacent blocks go in one sync */
+static int sync_file_blocks(const struct inode *inode)
+{
+    struct sync_run run = { -1, 0 };
+    if (bmap_walk(inode->i_block, inode->i_size, sync_one, &run) != 0) return -1;
+    return run.len > 0 ? block_sync(run.start, run.len) : 0;
+}
+
+int meta_log_update(const struct dentry *d)
+{
+    struct inode *inode = d_inode(d);
+    if (!inode) return 0;
+
+    /* for the next checkpoint, journal or not */
+    inode_mark_dirty(inode);
+    if (!g_jbuf) return 0;
+
+    char path[META_PATH_MAX];
+    meta_rec_t rec;
+    memset(&rec, 0, sizeof(rec));
+
+    int n = dentry_path(d, path, sizeof(path));
+    if (n < 0)
     {
-        block_reserve((int)(META_BLK_ENTRIES_START + b));
+        /* not expressible as a record: fold everything into the table */
+        uint8_t *buf = malloc(block_size());
+        int rc = buf ? checkpoint(buf, block_size(), 0) : -1;
+        free(buf);
+        return rc;
     }
 
-    uint32_t to_load = hdr.entry_count;
-    if (to_load == 0) return 0;
+    int file = inode->i_type == FS_INODE_FILE;
+    if (file && sync_file_blocks(inode) != 0) return -1;
 
-    // 讀 entries：先填 entry_list[]
-    uint32_t blkno = META_BLK_ENTRIES_START;
-    uint32_t offset = 0;
-    if (block_read((int)blkno, buf) != 0) return -1;
+    rec.op       = META_OP_UPDATE;
+    rec.type     = (uint8_t)inode->i_type;
+    rec.path_len = (uint16_t)n;
+    rec.size     = (uint64_t)inode->i_size;
+    for (int i = 0; i < N_BLOCKS; i++) rec.blocks[i] = file ? inode->i_block[i] : -1;
+    rec.ino      = (uint32_t)inode->i_ino;
+    rec.mode     = (uint32_t)inode->i_mode;
+    rec.uid      = (uint32_t)inode->i_uid;
+    rec.gid      = (uint32_t)inode->i_gid;
+    rec.mtime    = inode->i_mtime;
+    return journal_append(&rec, path);
+}
+
+int meta_log_remove(const struct dentry *parent, const char *name)
+{
+    if (!g_jbuf || !parent || !name) return 0;
+
+    char path[META_PATH_MAX];
+    meta_rec_t rec;
+    memset(&rec, 0, sizeof(rec));
 
-    for (uint32_t i = 0; i < to_load; i++) 
+    int n = dentry_path(parent, path, sizeof(path));
+    size_t nl = strlen(name);
+    if (n < 0 || (size_t)n + 1 + nl > sizeof(path))
     {
-        if (offset + sizeof(meta_entry_t) > BLOCK_SIZE) 
+        uint8_t *buf = malloc(block_size());
+        int rc = buf ? checkpoint(buf, block_size(), 0) : -1;
+        free(buf);
+        return rc;
+    }
+    path[n] = '/';
+    memcpy(path + n + 1, name, nl);
+
+    rec.op       = META_OP_REMOVE;
+    rec.path_len = (uint16_t)(n + 1 + nl);
+    for (int i = 0; i < N_BLOCKS; i++) rec.blocks[i] = -1;
+    return journal_append(&rec, path);
+}
+
+/* ---------- replay ---------- */
+
+static void dentry_free_tree(struct dentry *d)
+{
+    while (d->d_child)
+    {
+        struct dentry *c = d->d_child;
+        d->d_child = c->d_sibling;
+        dentry_free_tree(c);
+    }
+    inode_delete(d_inode(d));
+    free(d->d_name);
+    free(d);
+}
+
+static struct dentry *new_dentry(const char *name)
+{
+    struct dentry *dent = calloc(1, sizeof(struct dentry));
+    if (!dent) return NULL;
+
+    dent->d_name = fs_strdup(name);
+    if (!dent->d_name) { free(dent); return NULL; }
+    return dent;
+}
+
+/* an inode for an entry or record that has no number (older formats,
+ * snapshots): a fresh one, with the defaults those never stored */
+static struct inode *new_inode(fs_inode_type_t type)
+{
+    struct inode *ino = inode_new(type);
+    if (!ino) return NULL;
+
+    ino->i_mtime = (uint64_t)time(NULL);
+    ino->i_mode  = (type == FS_INODE_DIR) ? (FS_IFDIR | 0755) : (FS_IFREG | 0644);
+    return ino;
+}
+
+/* apply one record; blocks the tree stops using are left to the sweep.
+ * Nothing is reserved here: a record a later one replaced may point at
+ * extent or indirect blocks freed since and reused for data, so only
+ * the final tree is walked, by reserve_owned() after the replay. */
+static void replay_rec(const meta_rec_t *rec, const char *path)
+{
+    struct super_block *sb = fs_get_super();
+    struct dentry *dir = sb->s_root;
+    char name[NAME_MAX_ONDISK];
+    size_t i = 0;
+
+    for (;;)
+    {
+        while (i < rec->path_len && path[i] == '/') i++;
+        size_t s = i;
+        while (i < rec->path_len && path[i] != '/') i++;
+        if (i == s || i - s >= sizeof(name)) return;
+        memcpy(name, path + s, i - s);
+        name[i - s] = '\0';
+
+        struct dentry *d = dentry_find_child(dir, name);
+        struct inode *ino = d_inode(d);
+        if (i < rec->path_len)
+        {
+            /* an intermediate directory */
+            if (!ino || ino->i_type != FS_INODE_DIR) return;
+            dir = d;
+            continue;
+        }
+
+        if (rec->op == META_OP_REMOVE)
+        {
+            if (d && dentry_remove_child(dir, d) == 0) dentry_free_tree(d);
+            return;
+        }
+
+        /* the record's inode number wins over the one in the table */
+        if (rec->ino && ino && ino->i_ino != rec->ino)
+        {
+            inode_delete(ino);
+            ino = NULL;
+        }
+        if (!ino)
+        {
+            ino = rec->ino ? inode_new_at(rec->ino, (fs_inode_type_t)rec->type)
+                           : new_inode((fs_inode_type_t)rec->type);
+            if (!ino) return;
+        }
+        if (!d)
+        {
+            d = new_dentry(name);
+            if (!d) { inode_delete(ino); return; }
+            dentry_add_child(dir, d);
+        }
+        d->d_ino    = ino->i_ino;
+        ino->i_type = (fs_inode_type_t)rec->type;
+        ino->i_size = (size_t)rec->size;
+        inode_set_ptrs(ino, ino->i_type == FS_INODE_FILE ? rec->blocks : NULL);
+        if (rec->ino)
         {
-            blkno++;
-            offset = 0;
-            if (block_read((int)blkno, buf) != 0) return -1;
+            ino->i_mode  = (fs_mode_t)rec->mode;
+            ino->i_uid   = (fs_uid_t)rec->uid;
+            ino->i_gid   = (fs_gid_t)rec->gid;
+            ino->i_mtime = rec->mtime;
         }
-        memcpy(&entry_list[i], buf + offset, sizeof(meta_entry_t));
-        offset += (uint32_t)sizeof(meta_entry_t);
+        inode_mark_dirty(ino);
+        return;
     }
+}
 
-    // 第 1 pass：create dent/inode，但先不掛 tree
-    for (uint32_t i = 0; i < to_load; i++) 
+/* records of this generation, in order, up to the first torn or stale
+ * one; the next append goes there. Older journals' records are decoded
+ * as such (they are only ever replayed, never appended to). */
+static void journal_replay(void)
+{
+    size_t rsize = rec_size(g_hdr.ver);
+    size_t off = 0;
+    while (g_jsize - off >= rsize)
     {
-        meta_entry_t *e = &entry_list[i];
-        if (!e->used) continue;
+        meta_rec_t rec;
+        if (g_hdr.ver < 7)
+        {
+            meta_rec_v6_t old;
+            memset(&old, 0, sizeof(old));
+            if (g_hdr.ver < 3)
+            {
+                meta_rec_v2_t v2;
+                memcpy(&v2, g_jbuf + off, sizeof(v2));
+                memcpy(&old, &v2, offsetof(meta_rec_v6_t, blocks));
+                blocks_upgrade(old.blocks, v2.blocks);
+            }
+            else
+            {
+                /* v3-v5: no inode number, the rest stays 0 */
+                memcpy(&old, g_jbuf + off, rsize);
+            }
+            rec_upgrade_v6(&rec, &old);
+        }
+        else
+        {
+            memcpy(&rec, g_jbuf + off, sizeof(rec));
+        }
+
+        if (rec.magic != META_REC_MAGIC || rec.gen != g_hdr.gen ||
+            rec.len % 8 != 0 || rec.len < rsize + rec.path_len ||
+            rec.len > g_jsize - off) {
+            break;
+        }
+        uint32_t crc = rec.crc;
+        memset(g_jbuf + off + offsetof(meta_rec_t, crc), 0, sizeof(crc));
+        uint32_t got = crc32c(0, g_jbuf + off, rec.len);
+        memcpy(g_jbuf + off + offsetof(meta_rec_t, crc), &crc, sizeof(crc));
+        if (got != crc) break;
+
+        if (!bmap_valid(rec.blocks, (size_t)rec.size)) break;
+
+        replay_rec(&rec, (const char *)(g_jbuf + off + rsize));
+        off += rec.len;
+    }
+    g_jtail = off;
+}
+
+/* ---------- snapshots ---------- */
+
+static uint32_t snap_list_blocks(uint32_t n, size_t bsize)
+{
+    return (uint32_t)((n * sizeof(meta_snap_t) + bsize - 1) / bsize);
+}
+
+/* the list as it is in memory to a new contiguous run, on disk when this
+ * returns 0; the caller's checkpoint makes it current */
+static int snap_list_store(uint8_t *buf, size_t bsize, uint32_t *start)
+{
+    uint32_t need = snap_list_blocks(g_nsnaps, bsize);
+    *start = 0;
+    if (need == 0) return 0;
+
+    int s;
+    size_t got;
+    if (block_alloc_range_group(0, need, &s, &got) != 0) return -1;
+    meta_run_t run = { (uint32_t)s, (uint32_t)got };
+    if (got < need)
+    {
+        free_runs(&run, 1);
+        return -1;
+    }
+
+    const uint8_t *src = (const uint8_t *)g_snaps;
+    size_t left = g_nsnaps * sizeof(meta_snap_t);
+    for (uint32_t k = 0; k < need; k++)
+    {
+        size_t n = left < bsize ? left : bsize;
+        memset(buf, 0, bsize);
+        memcpy(buf, src + (size_t)k * bsize, n);
+        left -= n;
+        if (block_write(s + (int)k, buf) != 0)
+        {
+            free_runs(&run, 1);
+            return -1;
+        }
+    }
+    if (block_sync(s, need) != 0)
+    {
+        free_runs(&run, 1);
+        return -1;
+    }
+    *start = (uint32_t)s;
+    return 0;
+}
+
+static int snap_list_load(uint8_t *buf, size_t bsize, const meta_header_t *hdr)
+{
+    g_nsnaps = 0;
+    g_snap_start = hdr->snap_start;
+    if (hdr->snap_count > META_SNAP_MAX) return -1;
+
+    uint8_t *dst = (uint8_t *)g_snaps;
+    size_t left = hdr->snap_count * sizeof(meta_snap_t);
+    for (uint32_t k = 0; left > 0; k++)
+    {
+        size_t n = left < bsize ? left : bsize;
+        if (block_read((int)(hdr->snap_start + k), buf) != 0) return -1;
+        memcpy(dst + (size_t)k * bsize, buf, n);
+        left -= n;
+    }
+    for (uint32_t i = 0; i < hdr->snap_count; i++)
+    {
+        if (g_snaps[i].table_runs > META_TABLE_RUNS ||
+            g_snaps[i].entry_count > META_MAX_ENTRIES) {
+            return -1;
+        }
+        g_snaps[i].name[META_SNAP_NAME - 1] = '\0';
+    }
+    g_nsnaps = hdr->snap_count;
+    return 0;
+}
+
+static int snap_find(const char *name)
+{
+    for (uint32_t i = 0; i < g_nsnaps; i++)
+    {
+        if (strcmp(g_snaps[i].name, name) == 0) return (int)i;
+    }
+    return -1;
+}
+
+static int snap_entries(uint8_t *buf, size_t bsize, const meta_snap_t *sn, meta_entry_t *out)
+{
+    uint32_t crc;
+    if (table_load(buf, bsize, sn->runs, sn->table_runs, sn->entry_count, g_snap_ver, out, &crc) != 0)
+    {
+        return -1;
+    }
+    return crc == sn->table_crc ? 0 : -1;
+}
+
+/* the entries' blocks, as bmap_walk visits them (indirect ones too) */
+struct ref_walk
+{
+    uint32_t n;         /* blocks visited */
+    uint32_t limit;     /* release: stop after this many */
+    int      lo, hi;
+};
+
+static int release_one(int blk, void *arg)
+{
+    struct ref_walk *w = arg;
+    if (w->n == w->limit) return -1;
+    block_free(blk);
+    w->n++;
+    return 0;
+}
+
+static int share_one(int blk, void *arg)
+{
+    struct ref_walk *w = arg;
+    if (block_share(blk) != 0) return -1;
+    if (w->lo < 0 || blk < w->lo) w->lo = blk;
+    if (blk > w->hi) w->hi = blk;
+    w->n++;
+    return 0;
+}
+
+/* drop one reference to each of the first `limit` blocks the entries
+ * name */
+static void release_first(const meta_entry_t *list, uint32_t n, uint32_t limit)
+{
+    struct ref_walk w = { 0, limit, -1, -1 };
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if (list[i].type == FS_INODE_FILE && bmap_walk(list[i].blocks, (size_t)list[i].size, release_one, &w) != 0) break;
+    }
+}
+
+/* drop one reference to each block the entries name */
+static void release_blocks(const meta_entry_t *list, uint32_t n)
+{
+    release_first(list, n, UINT32_MAX);
+}
 
-        struct inode *ino = (struct inode*)calloc(1, sizeof(struct inode));
-        if (!ino) return -1;
+/* one more reference to each block the entries name, on disk when this
+ * returns 0 (the counts must be in place before anything relies on them) */
+static int share_blocks(const meta_entry_t *list, uint32_t n, uint32_t *shared)
+{
+    struct ref_walk w = { 0, 0, -1, -1 };
+    *shared = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if (list[i].type == FS_INODE_FILE && bmap_walk(list[i].blocks, (size_t)list[i].size, share_one, &w) != 0)
+        {
+            /* undo what this call took, then fail */
+            release_first(list, n, w.n);
+            return -1;
+        }
+    }
+    if (w.lo >= 0 && block_sync(w.lo, (size_t)(w.hi - w.lo + 1)) != 0)
+    {
+        release_blocks(list, n);
+        return -1;
+    }
+    *shared = w.n;
+    return 0;
+}
 
-        ino->i_type  = (fs_inode_type_t)e->type;
-        ino->i_size  = (size_t)e->size;
-        ino->i_mtime = (uint64_t)time(NULL);
-        ino->i_mode  = (ino->i_type == FS_INODE_DIR) ? (FS_IFDIR | 0755) : (FS_IFREG | 0644);
+/* new list and new header in one checkpoint; on failure the list in
+ * memory is put back as it was */
+static int snap_commit(uint8_t *buf, size_t bsize, const meta_snap_t *old, uint32_t nold)
+{
+    uint32_t prev_start = g_snap_start;
+    meta_run_t prev = { prev_start, snap_list_blocks(nold, bsize) };
+    uint32_t start;
 
-        inode_init_blocks(ino);
-        for (int k = 0; k < DIRECT_BLOCKS; k++) 
+    if (snap_list_store(buf, bsize, &start) == 0)
+    {
+        g_snap_start = start;
+        if (checkpoint(buf, bsize, 0) == 0)
         {
-            ino->i_block[k] = e->blocks[k];
-            if (e->blocks[k] >= 0) block_reserve(e->blocks[k]); // 保險：把檔案 data block 標成 used
+            free_runs(&prev, 1);
+            block_commit_frees();
+            return 0;
+        }
+        meta_run_t run = { start, snap_list_blocks(g_nsnaps, bsize) };
+        free_runs(&run, 1);
+    }
+    g_snap_start = prev_start;
+    memcpy(g_snaps, old, nold * sizeof(meta_snap_t));
+    g_nsnaps = nold;
+    return -1;
+}
+
+int meta_snapshot_create(const char *name)
+{
+    if (!name || name[0] == '\0' || strlen(name) >= META_SNAP_NAME) return -1;
+    if (snap_find(name) >= 0 || g_nsnaps >= META_SNAP_MAX) return -1;
+    if (!block_refcounts()) return -1;
+
+    size_t bsize = block_size();
+    uint8_t *buf = malloc(bsize);
+    if (!buf) return -1;
+
+    /* the tree as of now, holding its own references */
+    meta_snap_t sn;
+    memset(&sn, 0, sizeof(sn));
+    strcpy(sn.name, name);
+    sn.created = (uint64_t)time(NULL);
+
+    if (collect_tree(1) != 0)
+    {
+        free(buf);
+        return -1;
+    }
+    sn.entry_count = g_entry_count;
+    sn.table_crc   = crc32c(0, g_entries, g_entry_count * sizeof(meta_entry_t));
+    if (share_blocks(g_entries, g_entry_count, &sn.data_blocks) != 0)
+    {
+        free(buf);
+        return -1;
+    }
+    if (table_store(buf, bsize, g_entries, g_entry_count, sn.runs, &sn.table_runs) != 0)
+    {
+        release_blocks(g_entries, g_entry_count);
+        free(buf);
+        return -1;
+    }
+
+    meta_snap_t old[META_SNAP_MAX];
+    uint32_t nold = g_nsnaps;
+    memcpy(old, g_snaps, sizeof(old));
+    g_snaps[g_nsnaps++] = sn;
+
+    if (snap_commit(buf, bsize, old, nold) != 0)
+    {
+        /* the checkpoint collected the same tree, by number */
+        collect_tree(1);
+        release_blocks(g_entries, g_entry_count);
+        free_runs(sn.runs, sn.table_runs);
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    return 0;
+}
+
+int meta_snapshot_delete(const char *name)
+{
+    int i = name ? snap_find(name) : -1;
+    if (i < 0) return -1;
+
+    size_t bsize = block_size();
+    uint8_t *buf = malloc(bsize);
+    meta_entry_t *list = malloc(META_MAX_ENTRIES * sizeof(*list));
+    if (!buf || !list || snap_entries(buf, bsize, &g_snaps[i], list) != 0)
+    {
+        free(buf);
+        free(list);
+        return -1;
+    }
+
+    meta_snap_t old[META_SNAP_MAX];
+    uint32_t nold = g_nsnaps;
+    meta_snap_t sn = g_snaps[i];
+    memcpy(old, g_snaps, sizeof(old));
+    memmove(&g_snaps[i], &g_snaps[i + 1], (g_nsnaps - (uint32_t)i - 1) * sizeof(meta_snap_t));
+    g_nsnaps--;
+
+    int rc = snap_commit(buf, bsize, old, nold);
+    if (rc == 0)
+    {
+        /* gone from disk: its references and table go too */
+        release_blocks(list, sn.entry_count);
+        free_runs(sn.runs, sn.table_runs);
+        block_commit_frees();
+    }
+    free(buf);
+    free(list);
+    return rc;
+}
+
+/* older snapshot tables rewritten in the current entry format, made
+ * current by one checkpoint; the old tables go once that is on disk */
+static int snap_upgrade(uint8_t *buf, size_t bsize)
+{
+    meta_snap_t old[META_SNAP_MAX];
+    uint32_t nold = g_nsnaps;
+    uint32_t done = 0;
+    memcpy(old, g_snaps, sizeof(old));
+
+    meta_entry_t *list = malloc(META_MAX_ENTRIES * sizeof(*list));
+    if (!list) return -1;
+
+    for (; done < nold; done++)
+    {
+        meta_snap_t *sn = &g_snaps[done];
+        if (snap_entries(buf, bsize, &old[done], list) != 0 ||
+            table_store(buf, bsize, list, sn->entry_count, sn->runs, &sn->table_runs) != 0) {
+            break;
         }
+        sn->table_crc = crc32c(0, list, sn->entry_count * sizeof(meta_entry_t));
+    }
+    free(list);
+
+    meta_snap_t fresh[META_SNAP_MAX];
+    memcpy(fresh, g_snaps, sizeof(fresh));
+    if (done < nold || snap_commit(buf, bsize, old, nold) != 0)
+    {
+        for (uint32_t i = 0; i < done; i++) free_runs(fresh[i].runs, fresh[i].table_runs);
+        memcpy(g_snaps, old, sizeof(old));
+        return -1;
+    }
+    g_snap_ver = META_VER;
+    for (uint32_t i = 0; i < nold; i++) free_runs(old[i].runs, old[i].table_runs);
+    block_commit_frees();
+    return 0;
+}
 
-        struct dentry *dent = (struct dentry*)calloc(1, sizeof(struct dentry));
-        if (!dent) { free(ino); return -1; }
+/* the tree under root from entries in DFS order. Numbered entries point
+ * into the inode table, read when first used; the others get fresh
+ * inodes. Their blocks are not reserved here: the journal may have
+ * replaced these maps (see replay_rec). On failure what was built is
+ * the caller's to free, under root. */
+static int tree_build(const meta_entry_t *entry_list, uint32_t to_load, struct dentry *root)
+{
+    struct dentry **dent_list = calloc(to_load ? to_load : 1, sizeof(*dent_list));
+    if (!dent_list) return -1;
 
-        dent->d_name = fs_strdup(e->name);
-        if (!dent->d_name) { free(dent); free(ino); return -1; }
+    // 第 1 pass：create dent/inode，但先不掛 tree
+    int rc = 0;
+    for (uint32_t i = 0; i < to_load && rc == 0; i++)
+    {
+        const meta_entry_t *e = &entry_list[i];
+        if (!e->used) continue;
 
-        dent->d_inode = ino;
+        struct dentry *dent = new_dentry(e->name);
+        if (!dent) { rc = -1; break; }
         dent_list[i] = dent;
+
+        if (e->ino)
+        {
+            rc = inode_claim(e->ino);
+            dent->d_ino = e->ino;
+            continue;
+        }
+
+        struct inode *ino = new_inode((fs_inode_type_t)e->type);
+        if (!ino) { rc = -1; break; }
+        dent->d_ino = ino->i_ino;
+        ino->i_size = (size_t)e->size;
+        if (ino->i_type == FS_INODE_FILE)
+        {
+            inode_set_ptrs(ino, e->blocks);
+        }
     }
 
     // 第 2 pass：依 parent 掛起來
-    for (uint32_t i = 0; i < to_load; i++) 
+    for (uint32_t i = 0; i < to_load; i++)
     {
-        meta_entry_t *e = &entry_list[i];
+        const meta_entry_t *e = &entry_list[i];
         if (!e->used) continue;
         if (!dent_list[i]) continue;
 
-        if (e->parent < 0) 
+        if (e->parent < 0)
         {
-            dentry_add_child(sb->s_root, dent_list[i]);
+            dentry_add_child(root, dent_list[i]);
         } else {
             int p = e->parent;
-            if (p >= 0 && p < (int)to_load && dent_list[p]) 
+            if (p >= 0 && p < (int)to_load && dent_list[p])
             {
                 dentry_add_child(dent_list[p], dent_list[i]);
-            } 
-            else 
+            }
+            else
             {
                 // parent 壞掉：保底掛回 root
-                dentry_add_child(sb->s_root, dent_list[i]);
+                dentry_add_child(root, dent_list[i]);
             }
         }
     }
+    free(dent_list);
+    return rc;
+}
+
+static void tree_release(struct dentry *first)
+{
+    while (first)
+    {
+        struct dentry *d = first;
+        first = d->d_sibling;
+        d->d_sibling = NULL;
+
+        struct dentry *c = d->d_child;
+        d->d_child = NULL;
+        tree_release(c);
+
+        struct inode *ino = d_inode(d);
+        if (ino && ino->i_type == FS_INODE_FILE) inode_free_blocks(ino);
+        dentry_free_tree(d);
+    }
+}
+
+static void tree_adopt(struct dentry *root, struct dentry *first)
+{
+    root->d_child = first;
+    for (struct dentry *c = first; c; c = c->d_sibling) c->d_parent = root;
+}
+
+/* the live tree becomes a copy of the snapshot, which stays */
+int meta_snapshot_rollback(const char *name)
+{
+    struct super_block *sb = fs_get_super();
+    int i = name ? snap_find(name) : -1;
+    if (i < 0 || !sb || !sb->s_root) return -1;
+    if (vfs_open_files() > 0) return -1;    /* fds hold the live tree */
+
+    size_t bsize = block_size();
+    uint8_t *buf = malloc(bsize);
+    meta_entry_t *list = malloc(META_MAX_ENTRIES * sizeof(*list));
+    const meta_snap_t *sn = &g_snaps[i];
+    uint32_t shared;
+    struct dentry scratch;
+    memset(&scratch, 0, sizeof(scratch));
+
+    int rc = -1;
+    if (!buf || !list || snap_entries(buf, bsize, sn, list) != 0) goto out;
+    if (share_blocks(list, sn->entry_count, &shared) != 0) goto out;
+    if (tree_build(list, sn->entry_count, &scratch) != 0)
+    {
+        while (scratch.d_child)
+        {
+            struct dentry *c = scratch.d_child;
+            scratch.d_child = c->d_sibling;
+            dentry_free_tree(c);
+        }
+        release_blocks(list, sn->entry_count);
+        goto out;
+    }
 
+    /* swap, and make it the table */
+    struct dentry *old = sb->s_root->d_child;
+    tree_adopt(sb->s_root, scratch.d_child);
+    if (checkpoint(buf, bsize, 0) != 0)
+    {
+        tree_release(sb->s_root->d_child);
+        tree_adopt(sb->s_root, old);
+        goto out;
+    }
+    fs_set_cwd_dentry(sb->s_root);
+    tree_release(old);
+    block_commit_frees();
+    rc = 0;
+
+out:
+    free(buf);
+    free(list);
+    return rc;
+}
+
+int meta_snapshot_count(void)
+{
+    return (int)g_nsnaps;
+}
+
+int meta_snapshot_get(int i, struct meta_snapshot *out)
+{
+    if (i < 0 || (uint32_t)i >= g_nsnaps || !out) return -1;
+
+    memcpy(out->name, g_snaps[i].name, META_SNAP_NAME);
+    out->created = g_snaps[i].created;
+    out->entries = g_snaps[i].entry_count;
+    out->blocks  = g_snaps[i].data_blocks;
+    return 0;
+}
+
+/* ---------- sweep ---------- */
+
+static void mark(uint8_t *ref, size_t b)
+{
+    ref[b / 8] |= (uint8_t)(1u << (b % 8));
+}
+
+static void mark_runs(uint8_t *ref, const meta_run_t *runs, uint32_t n)
+{
+    for (uint32_t r = 0; r < n; r++)
+    {
+        for (uint32_t k = 0; k < runs[r].len; k++) mark(ref, runs[r].start + k);
+    }
+}
+
+static int mark_one(int blk, void *arg)
+{
+    mark(arg, (size_t)blk);
+    return 0;
+}
+
+static void mark_tree(const struct dentry *d, uint8_t *ref)
+{
+    for (; d; d = d->d_sibling)
+    {
+        struct inode *ino = d_inode(d);
+        if (ino && ino->i_type == FS_INODE_FILE)
+        {
+            bmap_walk(ino->i_block, ino->i_size, mark_one, ref);
+        }
+        mark_tree(d->d_child, ref);
+    }
+}
+
+/* every block the metadata points at: header, table, journal, snapshot
+ * list and tables, and the blocks of the tree and of each snapshot */
+static uint8_t *owned_map(uint8_t *buf, size_t bsize)
+{
+    size_t total = block_total_blocks();
+    uint8_t *ref = calloc(total / 8 + 1, 1);
+    meta_entry_t *list = malloc(META_MAX_ENTRIES * sizeof(*list));
+    if (!ref || !list)
+    {
+        free(ref);
+        free(list);
+        return NULL;
+    }
+
+    mark(ref, META_BLK_HEADER);
+    mark_runs(ref, g_hdr.runs, g_hdr.table_runs);
+    meta_run_t jrun = { g_hdr.journal_start, g_hdr.journal_blocks };
+    meta_run_t srun = { g_snap_start, snap_list_blocks(g_nsnaps, bsize) };
+    meta_run_t irun = { g_hdr.itable_start, (uint32_t)icache_table_blocks(g_hdr.itable_count) };
+    mark_runs(ref, &jrun, 1);
+    mark_runs(ref, &srun, 1);
+    mark_runs(ref, &irun, 1);
+    mark_runs(ref, &g_itable_old, g_itable_old.len > 0);
+    mark_tree(fs_get_super()->s_root->d_child, ref);
+
+    for (uint32_t i = 0; i < g_nsnaps; i++)
+    {
+        const meta_snap_t *sn = &g_snaps[i];
+        mark_runs(ref, sn->runs, sn->table_runs);
+        if (snap_entries(buf, bsize, sn, list) != 0)
+        {
+            free(ref);
+            free(list);
+            return NULL;
+        }
+        for (uint32_t e = 0; e < sn->entry_count; e++)
+        {
+            if (list[e].type == FS_INODE_FILE) bmap_walk(list[e].blocks, (size_t)list[e].size, mark_one, ref);
+        }
+    }
+    free(list);
+    return ref;
+}
+
+/* everything the metadata owns is allocated; after a crash, blocks
+ * allocated on disk that nothing owns (data written for a record that
+ * never made it, old tables, blocks freed after the last record) go
+ * back to the free pool */
+static int reserve_owned(uint8_t *buf, size_t bsize, int sweep)
+{
+    uint8_t *ref = owned_map(buf, bsize);
+    if (!ref) return -1;
+
+    size_t total = block_total_blocks();
+    for (size_t b = 0; b < total; b++)
+    {
+        if (ref[b / 8] & (1u << (b % 8)))
+        {
+            block_reserve((int)b);
+            continue;
+        }
+        if (!sweep || b < META_RESERVED_BLOCKS) continue;
+        /* a shared block goes once its last owner has */
+        while (block_allocated((int)b)) block_free((int)b);
+    }
+    free(ref);
     return 0;
 }
+
+/* mkfs: keep data allocations out of the metadata area, start a journal
+ * and an empty table */
+int meta_format(void)
+{
+    for (int b = 0; b < META_RESERVED_BLOCKS; b++)
+    {
+        if (block_reserve(b) != 0) return -1;
+    }
+
+    size_t bsize = block_size();
+    uint8_t *buf = malloc(bsize);
+    if (!buf) return -1;
+
+    free(g_jbuf);
+    g_jbuf = NULL;
+    memset(&g_hdr, 0, sizeof(g_hdr));
+    g_nsnaps = 0;
+    g_snap_start = 0;
+    g_itable_old.len = 0;
+    uint32_t count = itable_count(bsize);
+    int rc = -1;
+    if (icache_setup(count, META_INODES_MAX) == 0 && itable_create(buf, bsize, count, 0) == 0)
+    {
+        journal_create(buf, bsize);
+        rc = checkpoint(buf, bsize, META_F_CLEAN);
+    }
+    free(buf);
+    return rc;
+}
+
+int meta_save(void)
+{
+    size_t bsize = block_size();
+    uint8_t *buf = malloc(bsize);
+    if (!buf) return -1;
+
+    int rc = checkpoint(buf, bsize, META_F_CLEAN);
+    block_defer_frees(0);
+    free(buf);
+    return rc;
+}
+
+
+static int meta_load_buf(uint8_t *buf, size_t bsize)
+{
+    meta_entry_t   entry_list[META_MAX_ENTRIES];
+
+    meta_header_t hdr;
+
+    struct super_block *sb = fs_get_super();
+    if (!sb || !sb->s_root) return -1;
+
+    if (block_read(META_BLK_HEADER, buf) != 0) return -1;
+    memcpy(&hdr, buf, sizeof(hdr));
+
+    if (hdr.magic != META_MAGIC)
+    {
+        memset(&hdr, 0, sizeof(hdr)); // empty fs
+        hdr.flags = META_F_CLEAN;
+    }
+    else if (hdr.ver == 1)
+    {
+        /* v1: one run at block 1, saved at exit, nothing else */
+        memset((uint8_t *)&hdr + offsetof(meta_header_t, flags), 0,
+               sizeof(hdr) - offsetof(meta_header_t, flags));
+        hdr.flags = META_F_CLEAN;
+        hdr.table_runs  = 1;
+        hdr.runs[0].start = META_BLK_ENTRIES_START;
+        hdr.runs[0].len   = table_blocks(hdr.entry_count, bsize, 1);
+    }
+    else if (hdr.ver < 2 || hdr.ver > META_VER || hdr.hdr_crc != header_crc(&hdr) ||
+             hdr.table_runs > META_TABLE_RUNS || hdr.entry_count > META_MAX_ENTRIES)
+    {
+        return -1;
+    }
+    if (hdr.ver < 6)
+    {
+        hdr.itable_start = 0;
+        hdr.itable_count = 0;
+    }
+    else if (hdr.itable_count <= ROOT_INO || hdr.itable_count > META_INODES_MAX ||
+             hdr.itable_start + icache_table_blocks(hdr.itable_count) > block_total_blocks())
+    {
+        return -1;
+    }
+    g_hdr = hdr;
+
+    /* numbers in use are claimed as the tree is built; older images get
+     * theirs now, and a table for them below */
+    g_itable_old.len = 0;
+    if (icache_setup(hdr.ver < 6 ? itable_count(bsize) : hdr.itable_count, META_INODES_MAX) != 0) return -1;
+    if (hdr.ver >= 6 && icache_set_table((int)hdr.itable_start, hdr.itable_count) != 0) return -1;
+
+    // reserve meta blocks
+    block_reserve(META_BLK_HEADER);
+    for (uint32_t r = 0; r < hdr.table_runs; r++)
+    {
+        for (uint32_t k = 0; k < hdr.runs[r].len; k++) block_reserve((int)(hdr.runs[r].start + k));
+    }
+    for (uint32_t k = 0; k < hdr.journal_blocks; k++)
+    {
+        block_reserve((int)(hdr.journal_start + k));
+    }
+    for (size_t k = 0; k < icache_table_blocks(hdr.itable_count); k++)
+    {
+        block_reserve((int)(hdr.itable_start + k));
+    }
+
+    uint32_t to_load = hdr.entry_count;
+    if (to_load > META_MAX_ENTRIES) to_load = META_MAX_ENTRIES;
+
+    // 讀 entries：先填 entry_list[]
+    uint32_t crc;
+    if (table_load(buf, bsize, hdr.runs, hdr.table_runs, to_load, hdr.ver, entry_list, &crc) != 0)
+    {
+        return -1;
+    }
+    if (hdr.ver >= 2 && crc != hdr.table_crc) return -1;
+    g_snap_ver = hdr.ver;
+    if (snap_list_load(buf, bsize, &hdr) != 0) return -1;
+
+    if (tree_build(entry_list, to_load, sb->s_root) != 0) return -1;
+
+    /* 3) what happened after the table was written */
+    free(g_jbuf);
+    g_jbuf = NULL;
+    if (hdr.journal_blocks > 0)
+    {
+        g_jsize = (size_t)hdr.journal_blocks * bsize;
+        g_jbuf  = malloc(g_jsize);
+        if (!g_jbuf) return -1;
+        for (uint32_t k = 0; k < hdr.journal_blocks; k++)
+        {
+            if (block_read((int)(hdr.journal_start + k), g_jbuf + (size_t)k * bsize) != 0) return -1;
+        }
+        journal_replay();
+    }
+    if (reserve_owned(buf, bsize, !(hdr.flags & META_F_CLEAN)) != 0) return -1;
+    if (hdr.ver < 6)
+    {
+        /* big enough for every number the tree took, or the load fails */
+        uint32_t count = itable_count(bsize);
+        if (count < icache_table_need()) count = icache_table_need();
+        if (itable_create(buf, bsize, count, 0) != 0)
+        {
+            printf("meta: no room for an inode table of %u inodes\n", count);
+            return -1;
+        }
+    }
+    if (g_snap_ver < META_VER && snap_upgrade(buf, bsize) != 0) return -1;
+
+    /* 4) in use from now on: a crash before the next clean save means
+     * replay and sweep. Older images get a journal and move to v6. */
+    int rc;
+    if (!g_jbuf && journal_create(buf, bsize) == 0)
+    {
+        rc = checkpoint(buf, bsize, 0);
+    }
+    else if (hdr.ver != META_VER)
+    {
+        rc = checkpoint(buf, bsize, 0);
+    }
+    else
+    {
+        g_hdr.flags &= ~META_F_CLEAN;
+        rc = header_write(buf, bsize);
+    }
+    block_defer_frees(g_jbuf != NULL);
+    return rc;
+}
+
+int meta_load(void)
+{
+    size_t bsize = block_size();
+    uint8_t *buf = malloc(bsize);
+    if (!buf) return -1;
+
+    int rc = meta_load_buf(buf, bsize);
+    free(buf);
+    return rc;
+}
@@ -13,6 +13,7 @@
 #include "dentry.h"
 #include "block.h"
 #include "perm.h"
+#include "meta.h"
 /* user define library done */
 
 /* user define function*/
@@ -108,15 +109,15 @@ struct dentry *vfs_lookup(const char *path)
       struct dentry *next = cur->d_parent ? cur->d_parent : cur;
 
       /* need execute on target dir to enter */
-      if (!next || !next->d_inode)
+      if (!next || !d_inode(next))
       {
         return NULL;
       }
-      if (next->d_inode->i_type != FS_INODE_DIR)
+      if (d_inode(next)->i_type != FS_INODE_DIR)
       {
         return NULL;
       }
-      if (fs_perm_check(next->d_inode, FS_X_OK) != 0)
+      if (fs_perm_check(d_inode(next), FS_X_OK) != 0)
       {
         return NULL;
       }
@@ -126,15 +127,15 @@ struct dentry *vfs_lookup(const char *path)
     }
 
     /* normal token: must be able to search current directory (X) */
-    if (!cur || !cur->d_inode)
+    if (!cur || !d_inode(cur))
     {
       return NULL;
     }
-    if (cur->d_inode->i_type != FS_INODE_DIR)
+    if (d_inode(cur)->i_type != FS_INODE_DIR)
     {
       return NULL;
     }
-    if (fs_perm_check(cur->d_inode, FS_X_OK) != 0)
+    if (fs_perm_check(d_inode(cur), FS_X_OK) != 0)
     {
       return NULL;
     }
@@ -221,15 +222,15 @@ static int vfs_mkdir_path_internal(const char *path)
     return -1;
   }
 
-  if (!parent || !parent->d_inode)
+  if (!parent || !d_inode(parent))
   {
     return -1;
   }
-  if (parent->d_inode->i_type != FS_INODE_DIR)
+  if (d_inode(parent)->i_type != FS_INODE_DIR)
   {
     return -1;
   }
-   if (fs_perm_check(parent->d_inode, FS_W_OK | FS_X_OK) != 0)
+   if (fs_perm_check(d_inode(parent), FS_W_OK | FS_X_OK) != 0)
   {
     return -1;
   }
@@ -238,14 +239,12 @@ static int vfs_mkdir_path_internal(const char *path)
     return -1;
   }
 
-  inode = calloc(1, sizeof(struct inode));
+  inode = inode_new(FS_INODE_DIR);
   if (!inode)
   {
     return -1;
   }
 
-  inode->i_ino  = 0;
-  inode->i_type = FS_INODE_DIR;
   inode->i_mode = FS_IFDIR | 0755;
 
   inode->i_uid   = fs_get_uid();
@@ -257,7 +256,7 @@ static int vfs_mkdir_path_internal(const char *path)
   dentry = calloc(1, sizeof(struct dentry));
   if (!dentry)
   {
-    free(inode);
+    inode_delete(inode);
     return -1;
   }
 
@@ -265,20 +264,19 @@ static int vfs_mkdir_path_internal(const char *path)
   if (!dentry->d_name)
   {
     free(dentry);
-    free(inode);
+    inode_delete(inode);
     return -1;
   }
-  dentry->d_inode = inode;
+  dentry->d_ino = inode->i_ino;
 
   if (dentry_add_child(parent, dentry) != 0)
   {
     free(dentry->d_name);
     free(dentry);
-    free(inode);
+    inode_delete(inode);
     return -1;
   }
-
-  return 0;
+  return meta_log_update(dentry);
 }
 
 int vfs_mkdir(const char *path)
@@ -311,17 +309,17 @@ int vfs_rm(const char *path)
     return -1;
   }
   dent = vfs_lookup(buf);
-  if (!dent || !dent->d_inode)
+  if (!dent || !d_inode(dent))
   {
     return -1;
   }
-  inode  = dent->d_inode;
+  inode  = d_inode(dent);
   parent = dent->d_parent;
-  if (!parent || !parent->d_inode)
+  if (!parent || !d_inode(parent))
   {
     return -1;
   }
-  if (fs_perm_check(parent->d_inode, FS_W_OK | FS_X_OK) != 0)
+  if (fs_perm_check(d_inode(parent), FS_W_OK | FS_X_OK) != 0)
   {
     return -1;
   }
@@ -334,24 +332,25 @@ int vfs_rm(const char *path)
   {
     return -1;
   }
+  if (inode->i_count > 0)
+  {
+    return -1;  /* open: an fd holds it */
+  }
   if (dentry_remove_child(parent, dent) != 0)
   {
     return -1;
   }
-  for (int i = 0; i < DIRECT_BLOCKS; i++) {
-    if (inode->i_block[i] >= 0) {
-      block_free(inode->i_block[i]);
-      inode->i_block[i] = -1;
-    }
-  }
+  inode_free_blocks(inode);
+  /* gone from the tree either way; a failed record is the caller's to hear */
+  int rc = meta_log_remove(parent, dent->d_name);
 
-  free(inode);
+  inode_delete(inode);
 
   if (dent->d_name)
     free(dent->d_name);
   free(dent);
 
-  return 0;
+  return rc;
 }
 
 int vfs_rmdir(const char *path)
@@ -379,13 +378,13 @@ int vfs_rmdir(const char *path)
     return -1;
   }
   dent = vfs_lookup(buf);
-  if (!dent || !dent->d_inode)
+  if (!dent || !d_inode(dent))
   {
     return -1;
   }
-  inode  = dent->d_inode;
+  inode  = d_inode(dent);
   parent = dent->d_parent;
-  if(fs_perm_check(parent->d_inode, FS_W_OK | FS_X_OK) != 0)
+  if(fs_perm_check(d_inode(parent), FS_W_OK | FS_X_OK) != 0)
   {
     return -1;
   }
@@ -406,7 +405,8 @@ int vfs_rmdir(const char *path)
   {
     return -1;
   }
-  free(inode);
+  int rc = meta_log_remove(parent, dent->d_name);
+  inode_delete(inode);
 
   if (dent->d_name)
   {
@@ -414,7 +414,7 @@ int vfs_rmdir(const char *path)
   }
   free(dent);
 
-  return 0;
+  return rc;
 }
 
 /* =========================
@@ -438,15 +438,15 @@ int vfs_cd(const char *path)
     return -1;
   }
   target = vfs_lookup(buf);
-  if (!target || !target->d_inode)
+  if (!target || !d_inode(target))
   {
     return -1;
   }
-  if (fs_perm_check(target->d_inode, FS_X_OK) != 0)
+  if (fs_perm_check(d_inode(target), FS_X_OK) != 0)
   {
     return -1;
   }
-  if (target->d_inode->i_type != FS_INODE_DIR)
+  if (d_inode(target)->i_type != FS_INODE_DIR)
   {
     return -1;
   }
@@ -457,7 +457,8 @@ int vfs_cd(const char *path)
 int vfs_chmod(const char *path, int mode)
 {
   struct dentry *dent = vfs_lookup(path);
-  if (!dent || !dent->d_inode)
+  struct inode  *inode = d_inode(dent);
+  if (!dent || !inode)
   {
     return -1;
   }
@@ -466,9 +467,9 @@ int vfs_chmod(const char *path, int mode)
   {
     return -1;
   }
-  dent->d_inode->i_mode =
-      (dent->d_inode->i_mode & FS_IFDIR) | (mode & 0777);
+  inode->i_mode =
+      (inode->i_mode & FS_IFDIR) | (mode & 0777);
 
-  dent->d_inode->i_mtime = (uint64_t)time(NULL);
-  return 0;
+  inode->i_mtime = (uint64_t)time(NULL);
+  return meta_log_update(dent);
 }
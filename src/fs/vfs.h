@@ -5,6 +5,8 @@
 
 int fs_init(void);
 struct super_block *fs_get_super(void);
+void fs_icache_trim(void);   /* between operations: evict cold inodes */
+size_t fs_inodes_free(void);
 struct dentry *vfs_lookup(const char *path);
 
 int vfs_mkdir(const char *path);
@@ -16,6 +18,8 @@ int vfs_chmod(const char *path, int mode777);
 
 int vfs_create_file(const char *path);  /*touch*/
 int vfs_write_all(const char *path, const char *data);
+#define VFS_APPEND ((size_t)-1)  /* pwrite offset: the end of the file */
+int vfs_pwrite(const char *path, const void *buf, size_t len, size_t offset);
 int vfs_cat(const char *path);
 
 int vfs_rm(const char *path);
@@ -32,6 +36,9 @@ int vfs_cp(const char *src, const char *dest);
 int vfs_import(const char *host_path, const char *vfs_path);
 int vfs_export(const char *vfs_path, const char *host_path);
 
+/* mode as fopen: "r", "w" (create, truncate), "a" (create, append),
+ * each with an optional "+"; read and write return the bytes moved,
+ * 0 at end of file or on error */
 int vfs_open(const char *path, const char *mode);
 int vfs_close(int fd);
 size_t vfs_read(int fd, void *buf, size_t count);
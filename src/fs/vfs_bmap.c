@@ -0,0 +1,916 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "vfs_internal.h"
+#include "inode.h"
+#include "block.h"
+
+/* file block maps
+ * A file's blocks are described by i_block[] in one of two forms, or it
+ * has none: a file of at most INLINE_MAX bytes keeps them in i_block[]
+ * itself (inline data, as in ext4), so the many tiny files cost no
+ * block and no block I/O. Writers pick the form by length; a file that
+ * outgrows it is written to blocks and one that shrinks comes back.
+ *
+ * Extents, as in ext4: runs of (logical start, physical start, length)
+ * in logical order, up to EXT_INLINE of them in i_block[] itself and up
+ * to a block's worth in one extent block. The allocator hands out
+ * contiguous runs, so most files need a handful: a 10 MB import is a
+ * few extents where it would be thousands of pointers.
+ *
+ * Block pointers, as in ext2, for files too fragmented for that (dedup
+ * stores blocks wherever their contents already are): DIRECT_BLOCKS
+ * data block numbers, then an indirect block (a block of data block
+ * numbers) and a double indirect one (a block of indirect block
+ * numbers). Unused slots are -1, in the inode and in the indirect
+ * blocks alike.
+ *
+ * Extent and indirect blocks are written once, when the map is set, and
+ * never changed in place: a rewritten file gets new ones. Whoever
+ * shares a file's blocks (cp with dedup, a snapshot) holds a reference
+ * to every block its pointers reach, extent and indirect ones included,
+ * so freeing walks the whole chain whatever the reference counts are.
+ *
+ * inode_lookup() finds one block by binary search of the extents. Bulk
+ * I/O wants the whole logical -> physical map: the first inode_bmap()
+ * builds it into i_map (reading the indirect blocks, if any) and later
+ * ones reuse it until the pointers change. */
+
+static size_t ptrs_per_block(void)
+{
+  return block_size() / sizeof(int32_t);
+}
+
+static int blk_ok(int blk)
+{
+  return blk >= 0 && (size_t)blk < block_total_blocks();
+}
+
+static int is_extents(const int32_t *ptrs)
+{
+  return ptrs[0] == I_EXTENTS;
+}
+
+static int is_inline(const int32_t *ptrs)
+{
+  return ptrs[0] == I_INLINE;
+}
+
+/* an extent block holds triples, unused ones -1 */
+static size_t ext_per_block(void)
+{
+  return block_size() / (3 * sizeof(int32_t));
+}
+
+static void ext_get(const int32_t *p, struct extent *e)
+{
+  e->e_lblk = (uint32_t)p[0];
+  e->e_pblk = p[1];
+  e->e_len  = (uint32_t)p[2];
+}
+
+static void ext_put(int32_t *p, const struct extent *e)
+{
+  p[0] = (int32_t)e->e_lblk;
+  p[1] = e->e_pblk;
+  p[2] = (int32_t)e->e_len;
+}
+
+size_t inode_max_blocks(void)
+{
+  size_t p = ptrs_per_block();
+  return DIRECT_BLOCKS + p + p * p;
+}
+
+void inode_init_blocks(struct inode *inode)
+{
+  for (int i = 0; i < N_BLOCKS; i++)
+  {
+    inode->i_block[i] = -1;
+  }
+  inode->i_map     = NULL;
+  inode->i_map_len = 0;
+  inode->i_ext     = NULL;
+  inode->i_ext_len = 0;
+}
+
+static void drop_map(struct inode *inode)
+{
+  free(inode->i_map);
+  free(inode->i_ext);
+  inode->i_map     = NULL;
+  inode->i_map_len = 0;
+  inode->i_ext     = NULL;
+  inode->i_ext_len = 0;
+}
+
+void inode_set_ptrs(struct inode *inode, const int32_t *ptrs)
+{
+  drop_map(inode);
+  for (int i = 0; i < N_BLOCKS; i++)
+  {
+    inode->i_block[i] = ptrs ? ptrs[i] : -1;
+  }
+}
+
+void inode_release(struct inode *inode)
+{
+  if (inode)
+  {
+    drop_map(inode);
+    free(inode);
+  }
+}
+
+/* ---------- inline data ---------- */
+
+int inode_is_inline(const struct inode *inode)
+{
+  return is_inline(inode->i_block);
+}
+
+const uint8_t *inode_inline_data(const struct inode *inode)
+{
+  return (const uint8_t *)&inode->i_block[1];
+}
+
+int inode_set_inline(struct inode *inode, const void *data, size_t len)
+{
+  if (!inode || len > INLINE_MAX || (!data && len > 0))
+  {
+    return -1;
+  }
+
+  inode_set_ptrs(inode, NULL);
+  inode->i_block[0] = I_INLINE;
+  memset(&inode->i_block[1], 0, INLINE_MAX);
+  if (len > 0)
+  {
+    memcpy(&inode->i_block[1], data, len);
+  }
+  return 0;
+}
+
+/* ---------- extent lists ---------- */
+
+/* extents as set_extents() writes them: inside the device, in strictly
+ * increasing logical order and within the size's blocks. Anything else
+ * (a stale extent block, say) is not a map to be walked. */
+static int ext_check(const struct extent *ext, size_t n, size_t size)
+{
+  size_t total = block_total_blocks();
+  size_t nblk  = size / block_size() + (size % block_size() != 0);
+  size_t next  = 0;
+
+  for (size_t i = 0; i < n; i++)
+  {
+    const struct extent *e = &ext[i];
+    if (e->e_len == 0 || !blk_ok(e->e_pblk) || (size_t)e->e_pblk + e->e_len > total)
+    {
+      return -1;
+    }
+    if (e->e_lblk < next || (size_t)e->e_lblk + e->e_len > nblk)
+    {
+      return -1;
+    }
+    next = (size_t)e->e_lblk + e->e_len;
+  }
+  return 0;
+}
+
+/* ptrs' extents into a new array, from i_block[] or the extent block;
+ * -1 unless they pass ext_check() for a file of `size` bytes */
+static int ext_read(const int32_t *ptrs, size_t size, struct extent **out, size_t *count)
+{
+  int32_t n = ptrs[EXT_COUNT];
+
+  *out   = NULL;
+  *count = 0;
+  if (n < 0 || (size_t)n > ext_per_block())
+  {
+    return -1;
+  }
+
+  struct extent *ext = malloc((n ? (size_t)n : 1) * sizeof(*ext));
+  if (!ext)
+  {
+    return -1;
+  }
+
+  if (ptrs[EXT_BLOCK] < 0)
+  {
+    if (n > EXT_INLINE)
+    {
+      free(ext);
+      return -1;
+    }
+    for (int32_t i = 0; i < n; i++)
+    {
+      ext_get(ptrs + EXT_FIRST + 3 * i, &ext[i]);
+    }
+  }
+  else
+  {
+    int32_t *buf = malloc(block_size());
+    if (!buf || !blk_ok(ptrs[EXT_BLOCK]) || block_read(ptrs[EXT_BLOCK], buf) != 0)
+    {
+      free(buf);
+      free(ext);
+      return -1;
+    }
+    for (int32_t i = 0; i < n; i++)
+    {
+      ext_get(buf + 3 * i, &ext[i]);
+    }
+    free(buf);
+  }
+  if (ext_check(ext, (size_t)n, size) != 0)
+  {
+    free(ext);
+    return -1;
+  }
+
+  *out   = ext;
+  *count = (size_t)n;
+  return 0;
+}
+
+static int inode_extents(struct inode *inode)
+{
+  if (inode->i_ext)
+  {
+    return 0;
+  }
+  return ext_read(inode->i_block, inode->i_size, &inode->i_ext, &inode->i_ext_len);
+}
+
+int inode_lookup(struct inode *inode, size_t lblk)
+{
+  if (!inode || is_inline(inode->i_block))
+  {
+    return -1;
+  }
+
+  if (!is_extents(inode->i_block))
+  {
+    const int *map;
+    size_t n;
+    if (inode_bmap(inode, &map, &n) != 0 || lblk >= n)
+    {
+      return -1;
+    }
+    return map[lblk];
+  }
+
+  if (inode_extents(inode) != 0)
+  {
+    return -1;
+  }
+
+  size_t lo = 0, hi = inode->i_ext_len;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    const struct extent *e = &inode->i_ext[mid];
+    if (lblk < e->e_lblk)
+    {
+      hi = mid;
+    }
+    else if (lblk - e->e_lblk >= e->e_len)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      return e->e_pblk + (int)(lblk - e->e_lblk);
+    }
+  }
+  return -1;
+}
+
+int inode_first_block(const struct inode *inode)
+{
+  const int *p = inode->i_block;
+
+  if (is_inline(p))
+  {
+    return -1;
+  }
+  if (is_extents(p))
+  {
+    /* the extent block sits with the data; inline, the first extent */
+    if (p[EXT_BLOCK] >= 0)
+    {
+      return p[EXT_BLOCK];
+    }
+    return p[EXT_COUNT] > 0 ? p[EXT_FIRST + 1] : -1;
+  }
+  for (int i = 0; i < DIRECT_BLOCKS; i++)
+  {
+    if (p[i] >= 0)
+    {
+      return p[i];
+    }
+  }
+  return -1;
+}
+
+int bmap_valid(const int32_t *ptrs, size_t size)
+{
+  size_t total = block_total_blocks();
+
+  if (is_inline(ptrs))
+  {
+    return 1;
+  }
+  if (!is_extents(ptrs))
+  {
+    for (int i = 0; i < N_BLOCKS; i++)
+    {
+      if (ptrs[i] < -1 || (ptrs[i] >= 0 && (size_t)ptrs[i] >= total))
+      {
+        return 0;
+      }
+    }
+    return 1;
+  }
+
+  int32_t n = ptrs[EXT_COUNT];
+  if (n < 0 || (size_t)n > ext_per_block())
+  {
+    return 0;
+  }
+  if (ptrs[EXT_BLOCK] >= 0)
+  {
+    return blk_ok(ptrs[EXT_BLOCK]);
+  }
+  if (ptrs[EXT_BLOCK] != -1 || n > EXT_INLINE)
+  {
+    return 0;
+  }
+  struct extent ext[EXT_INLINE];
+  for (int32_t i = 0; i < n; i++)
+  {
+    ext_get(ptrs + EXT_FIRST + 3 * i, &ext[i]);
+  }
+  return ext_check(ext, (size_t)n, size) == 0;
+}
+
+/* ---------- walking the chain ---------- */
+
+/* fn for each block an indirect block names (level 2: recursively),
+ * then for the block itself. A copy is walked, not a pin: fn may free
+ * blocks and the file backend's cache has to stay free to evict. */
+static int walk_ind(int blk, int level, int (*fn)(int blk, void *arg), void *arg)
+{
+  size_t p = ptrs_per_block();
+  int32_t *ptrs = malloc(block_size());
+  if (!ptrs)
+  {
+    return -1;
+  }
+  if (block_read(blk, ptrs) != 0)
+  {
+    free(ptrs);
+    return -1;
+  }
+
+  int rc = 0;
+  for (size_t i = 0; i < p && rc == 0; i++)
+  {
+    if (!blk_ok(ptrs[i]))
+    {
+      continue;
+    }
+    rc = level > 1 ? walk_ind(ptrs[i], level - 1, fn, arg) : fn(ptrs[i], arg);
+  }
+  free(ptrs);
+  return rc == 0 ? fn(blk, arg) : -1;
+}
+
+/* the extents' blocks, then the extent block; a copy of the list is
+ * walked, for the same reason as in walk_ind() */
+static int walk_extents(const int32_t *ptrs, size_t size, int (*fn)(int blk, void *arg),
+                        void *arg)
+{
+  struct extent *ext;
+  size_t n;
+  if (ext_read(ptrs, size, &ext, &n) != 0)
+  {
+    return -1;
+  }
+
+  int rc = 0;
+  for (size_t i = 0; i < n && rc == 0; i++)
+  {
+    for (uint32_t k = 0; k < ext[i].e_len && rc == 0; k++)
+    {
+      int blk = ext[i].e_pblk + (int)k;
+      if (blk_ok(blk))
+      {
+        rc = fn(blk, arg);
+      }
+    }
+  }
+  free(ext);
+  if (rc == 0 && blk_ok(ptrs[EXT_BLOCK]))
+  {
+    rc = fn(ptrs[EXT_BLOCK], arg);
+  }
+  return rc == 0 ? 0 : -1;
+}
+
+int bmap_walk(const int32_t *ptrs, size_t size, int (*fn)(int blk, void *arg), void *arg)
+{
+  if (is_inline(ptrs))
+  {
+    return 0;
+  }
+  if (is_extents(ptrs))
+  {
+    return walk_extents(ptrs, size, fn, arg);
+  }
+
+  for (int i = 0; i < DIRECT_BLOCKS; i++)
+  {
+    if (blk_ok(ptrs[i]) && fn(ptrs[i], arg) != 0)
+    {
+      return -1;
+    }
+  }
+  if (blk_ok(ptrs[IND_BLOCK]) && walk_ind(ptrs[IND_BLOCK], 1, fn, arg) != 0)
+  {
+    return -1;
+  }
+  if (blk_ok(ptrs[DIND_BLOCK]) && walk_ind(ptrs[DIND_BLOCK], 2, fn, arg) != 0)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+/* ---------- lookups ---------- */
+
+/* the indirect blocks hold the map's entries as they are laid out in
+ * memory: one vectored read straight into the array */
+static int read_ptr_blocks(const int *blks, size_t nblk, int *out, size_t n)
+{
+  struct iovec iov = { out, n * sizeof(*out) };
+  for (size_t i = 0; i < nblk; i++)
+  {
+    if (!blk_ok(blks[i]))
+    {
+      return -1;
+    }
+  }
+  return block_readv(blks, nblk, &iov, 1);
+}
+
+int inode_bmap(struct inode *inode, const int **map, size_t *count)
+{
+  size_t bsize = block_size();
+  size_t n = (inode->i_size + bsize - 1) / bsize;
+
+  *map   = NULL;
+  *count = 0;
+  if (is_inline(inode->i_block))
+  {
+    return -1;
+  }
+  if (n == 0)
+  {
+    return 0;
+  }
+  if (inode->i_map && inode->i_map_len >= n)
+  {
+    *map   = inode->i_map;
+    *count = n;
+    return 0;
+  }
+  if (n > inode_max_blocks())
+  {
+    return -1;
+  }
+
+  int *m = malloc(n * sizeof(*m));
+  if (!m)
+  {
+    return -1;
+  }
+
+  if (is_extents(inode->i_block))
+  {
+    /* no I/O past the extent block: the extents expand in place */
+    size_t got = 0;
+    if (inode_extents(inode) != 0)
+    {
+      free(m);
+      return -1;
+    }
+    for (size_t i = 0; i < inode->i_ext_len && got < n; i++)
+    {
+      const struct extent *e = &inode->i_ext[i];
+      for (uint32_t k = 0; k < e->e_len && got < n; k++)
+      {
+        m[got++] = e->e_pblk + (int)k;
+      }
+    }
+    if (got < n)
+    {
+      free(m);
+      return -1;
+    }
+    free(inode->i_map);
+    inode->i_map     = m;
+    inode->i_map_len = n;
+    *map   = m;
+    *count = n;
+    return 0;
+  }
+
+  size_t p = ptrs_per_block();
+  size_t direct = n < DIRECT_BLOCKS ? n : DIRECT_BLOCKS;
+  memcpy(m, inode->i_block, direct * sizeof(*m));
+
+  int rc = 0;
+  if (n > DIRECT_BLOCKS)
+  {
+    size_t k = n - DIRECT_BLOCKS < p ? n - DIRECT_BLOCKS : p;
+    rc = read_ptr_blocks(&inode->i_block[IND_BLOCK], 1, m + DIRECT_BLOCKS, k);
+  }
+  if (rc == 0 && n > DIRECT_BLOCKS + p)
+  {
+    size_t rest = n - DIRECT_BLOCKS - p;
+    int *dind = malloc(bsize);
+    rc = -1;
+    if (dind && read_ptr_blocks(&inode->i_block[DIND_BLOCK], 1, dind, p) == 0)
+    {
+      rc = read_ptr_blocks(dind, (rest + p - 1) / p, m + DIRECT_BLOCKS + p, rest);
+    }
+    free(dind);
+  }
+  if (rc != 0)
+  {
+    free(m);
+    return -1;
+  }
+
+  drop_map(inode);
+  inode->i_map     = m;
+  inode->i_map_len = n;
+  *map   = m;
+  *count = n;
+  return 0;
+}
+
+/* ---------- setting and freeing ---------- */
+
+/* n fresh blocks into out[], in as few contiguous runs as the allocator
+ * can find, starting in allocation group `group`; on failure the new
+ * blocks are released */
+static int alloc_runs(int *out, size_t n, int group)
+{
+  size_t done = 0;
+
+  while (done < n)
+  {
+    int start;
+    size_t got;
+
+    if (block_alloc_range_group(group, n - done, &start, &got) != 0)
+    {
+      for (size_t i = 0; i < done; i++)
+      {
+        block_free(out[i]);
+      }
+      return -1;
+    }
+    for (size_t k = 0; k < got; k++)
+    {
+      out[done + k] = start + (int)k;
+    }
+    done += got;
+  }
+  return 0;
+}
+
+/* one block of pointers, unused slots -1 */
+static int write_ptrs(int blk, const int *ptrs, size_t n)
+{
+  uint8_t *p = block_pin(blk, BLOCK_PIN_WRITE | BLOCK_PIN_WHOLE);
+  if (!p)
+  {
+    return -1;
+  }
+  memcpy(p, ptrs, n * sizeof(int32_t));
+  memset(p + n * sizeof(int32_t), 0xff, block_size() - n * sizeof(int32_t));
+  block_unpin(blk);
+  return 0;
+}
+
+static int free_one(int blk, void *arg)
+{
+  (void)arg;
+  block_free(blk);
+  return 0;
+}
+
+int inode_free_blocks(struct inode *inode)
+{
+  if (!inode)
+  {
+    return -1;
+  }
+
+  /* an unreadable indirect block leaks what it names, nothing worse.
+   * A map just set may be ahead of i_size (a write rolling back). */
+  size_t size = inode->i_size;
+  if (inode->i_map && inode->i_map_len * block_size() > size)
+  {
+    size = inode->i_map_len * block_size();
+  }
+  bmap_walk(inode->i_block, size, free_one, NULL);
+  inode_set_ptrs(inode, NULL);
+  /* the table record names those blocks: it is stale from here on,
+   * whether or not the caller gets as far as logging the change */
+  inode_mark_dirty(inode);
+  return 0;
+}
+
+void inode_save_blocks(struct inode *inode, struct bmap_saved *old)
+{
+  memcpy(old->ptrs, inode->i_block, sizeof(old->ptrs));
+  old->size = inode->i_size;
+  inode_set_ptrs(inode, NULL);
+  inode->i_size = 0;
+  inode_mark_dirty(inode);
+}
+
+void inode_restore_blocks(struct inode *inode, const struct bmap_saved *old)
+{
+  inode_free_blocks(inode);
+  inode_set_ptrs(inode, old->ptrs);
+  inode->i_size = old->size;
+}
+
+void bmap_release(const struct bmap_saved *old)
+{
+  bmap_walk(old->ptrs, old->size, free_one, NULL);
+}
+
+static int release_map(int *map, size_t n)
+{
+  for (size_t i = 0; map && i < n; i++)
+  {
+    if (map[i] >= 0) block_free(map[i]);
+  }
+  free(map);
+  return -1;
+}
+
+static size_t count_runs(const int *map, size_t n)
+{
+  size_t runs = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    if (i == 0 || map[i] != map[i - 1] + 1) runs++;
+  }
+  return runs;
+}
+
+/* map as `runs` extents: inline, or in a new extent block */
+static int set_extents(struct inode *inode, int group, int *map, size_t n, size_t runs)
+{
+  struct extent *ext = malloc((runs ? runs : 1) * sizeof(*ext));
+  int32_t *raw = NULL;
+  int eblk = -1;
+
+  if (!ext)
+  {
+    return -1;
+  }
+
+  size_t k = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    if (i > 0 && map[i] == map[i - 1] + 1)
+    {
+      ext[k - 1].e_len++;
+      continue;
+    }
+    ext[k].e_lblk = (uint32_t)i;
+    ext[k].e_pblk = map[i];
+    ext[k].e_len  = 1;
+    k++;
+  }
+
+  if (runs > EXT_INLINE)
+  {
+    raw = malloc(runs * 3 * sizeof(*raw));
+    if (!raw || alloc_runs(&eblk, 1, group) != 0)
+    {
+      free(raw);
+      free(ext);
+      return -1;
+    }
+    for (size_t i = 0; i < runs; i++)
+    {
+      ext_put(raw + 3 * i, &ext[i]);
+    }
+    if (write_ptrs(eblk, raw, runs * 3) != 0)
+    {
+      block_free(eblk);
+      free(raw);
+      free(ext);
+      return -1;
+    }
+    free(raw);
+  }
+
+  for (int i = 0; i < N_BLOCKS; i++)
+  {
+    inode->i_block[i] = -1;
+  }
+  inode->i_block[0]         = I_EXTENTS;
+  inode->i_block[EXT_COUNT] = (int)runs;
+  inode->i_block[EXT_BLOCK] = eblk;
+  for (size_t i = 0; eblk < 0 && i < runs; i++)
+  {
+    ext_put(inode->i_block + EXT_FIRST + 3 * i, &ext[i]);
+  }
+  inode->i_ext     = ext;
+  inode->i_ext_len = runs;
+  inode->i_map     = map;
+  inode->i_map_len = n;
+  return 0;
+}
+
+/* map into i_block[], with new index blocks; on failure the map and
+ * its blocks are still the caller's */
+static int build_map(struct inode *inode, int group, int *map, size_t n)
+{
+  size_t p = ptrs_per_block();
+  int ind = -1, dind = -1;
+  int *inds = NULL;
+  size_t ninds = 0;
+
+  inode_set_ptrs(inode, NULL);
+  if (n > inode_max_blocks())
+  {
+    goto fail;
+  }
+
+  /* extents unless the file is so fragmented that they would take more
+   * room than pointers: past an extent block, or past the inline ones
+   * when the direct pointers alone would do */
+  size_t runs = count_runs(map, n);
+  if (runs <= EXT_INLINE || (n > DIRECT_BLOCKS && runs <= ext_per_block()))
+  {
+    return set_extents(inode, group, map, n, runs) == 0 ? 0 : -1;
+  }
+
+  if (n > DIRECT_BLOCKS)
+  {
+    size_t k = n - DIRECT_BLOCKS < p ? n - DIRECT_BLOCKS : p;
+    if (alloc_runs(&ind, 1, group) != 0)
+    {
+      goto fail;
+    }
+    if (write_ptrs(ind, map + DIRECT_BLOCKS, k) != 0)
+    {
+      goto fail;
+    }
+  }
+  if (n > DIRECT_BLOCKS + p)
+  {
+    size_t rest = n - DIRECT_BLOCKS - p;
+    ninds = (rest + p - 1) / p;
+    inds  = malloc(ninds * sizeof(*inds));
+    if (!inds || alloc_runs(&dind, 1, group) != 0)
+    {
+      ninds = 0;
+      goto fail;
+    }
+    if (alloc_runs(inds, ninds, group) != 0)
+    {
+      ninds = 0;
+      goto fail;
+    }
+    for (size_t i = 0; i < ninds; i++)
+    {
+      size_t k = rest - i * p < p ? rest - i * p : p;
+      if (write_ptrs(inds[i], map + DIRECT_BLOCKS + p + i * p, k) != 0)
+      {
+        goto fail;
+      }
+    }
+    if (write_ptrs(dind, inds, ninds) != 0)
+    {
+      goto fail;
+    }
+    free(inds);
+  }
+
+  for (size_t i = 0; i < DIRECT_BLOCKS; i++)
+  {
+    inode->i_block[i] = i < n ? map[i] : -1;
+  }
+  inode->i_block[IND_BLOCK]  = ind;
+  inode->i_block[DIND_BLOCK] = dind;
+  inode->i_map     = map;
+  inode->i_map_len = n;
+  return 0;
+
+fail:
+  for (size_t i = 0; i < ninds; i++)
+  {
+    block_free(inds[i]);
+  }
+  free(inds);
+  if (dind >= 0) block_free(dind);
+  if (ind >= 0) block_free(ind);
+  return -1;
+}
+
+int inode_set_blocks(struct inode *inode, int group, int *map, size_t n)
+{
+  if (build_map(inode, group, map, n) != 0)
+  {
+    return release_map(map, n);
+  }
+  return 0;
+}
+
+/* the extent or indirect blocks of a map, not the data blocks */
+static void free_index(const int32_t *ptrs)
+{
+  if (is_inline(ptrs))
+  {
+    return;
+  }
+  if (is_extents(ptrs))
+  {
+    if (blk_ok(ptrs[EXT_BLOCK])) block_free(ptrs[EXT_BLOCK]);
+    return;
+  }
+
+  if (blk_ok(ptrs[IND_BLOCK])) block_free(ptrs[IND_BLOCK]);
+  if (!blk_ok(ptrs[DIND_BLOCK]))
+  {
+    return;
+  }
+  /* unreadable: the indirect blocks it names leak, as in inode_free_blocks */
+  int32_t *inds = malloc(block_size());
+  if (inds && block_read(ptrs[DIND_BLOCK], inds) == 0)
+  {
+    for (size_t i = 0; i < ptrs_per_block(); i++)
+    {
+      if (blk_ok(inds[i])) block_free(inds[i]);
+    }
+  }
+  free(inds);
+  block_free(ptrs[DIND_BLOCK]);
+}
+
+int inode_remap_blocks(struct inode *inode, int group, int *map, size_t n)
+{
+  int32_t old[N_BLOCKS];
+  memcpy(old, inode->i_block, sizeof(old));
+
+  if (build_map(inode, group, map, n) != 0)
+  {
+    inode_set_ptrs(inode, old);
+    return -1;
+  }
+  /* indexes are never changed in place: the new map has its own */
+  free_index(old);
+  return 0;
+}
+
+int inode_alloc_blocks(struct inode *inode, int group, size_t n)
+{
+  if (!inode || n > inode_max_blocks())
+  {
+    return -1;
+  }
+
+  inode_set_ptrs(inode, NULL);
+  if (n == 0)
+  {
+    return 0;
+  }
+
+  int *map = malloc(n * sizeof(*map));
+  if (!map)
+  {
+    return -1;
+  }
+  if (alloc_runs(map, n, group) != 0)
+  {
+    free(map);
+    return -1;
+  }
+  return inode_set_blocks(inode, group, map, n);
+}
@@ -132,6 +132,23 @@ struct dentry *dentry_find_child(struct dentry *parent, const char *name)
   return NULL;
 }
 
+/* allocation group for a file's blocks: one per directory, so its files
+ * stay together, picked from the directory's inode number, which spreads
+ * directories out. The number is in the dentry: no inode is read, and
+ * the choice survives renames and restarts. */
+int dentry_block_group(const struct dentry *dent)
+{
+  const struct dentry *dir = dent ? dent->d_parent : NULL;
+  if (!dir || block_groups() == 0)
+  {
+    return BLOCK_GROUP_ANY;
+  }
+
+  /* multiplicative hash: nearby numbers spread over the groups */
+  uint32_t h = (uint32_t)dir->d_ino * 2654435761u;
+  return (int)(h % block_groups());
+}
+
 /* --- fs_init: 建 root inode + root dentry --- */
 
 int fs_init(void)
@@ -139,15 +156,14 @@ int fs_init(void)
   memset(&g_sb, 0, sizeof(g_sb));
   g_sb.s_magic = 0x12345678;
 
-  struct inode *root_inode = malloc(sizeof(struct inode));
+  /* the inode table comes with the image; until then the root is the
+   * one inode, fixed at ROOT_INO and never evicted */
+  struct inode *root_inode = inode_new_at(ROOT_INO, FS_INODE_DIR);
   if (!root_inode)
   {
     return -1;
   }
-
-  memset(root_inode, 0, sizeof(*root_inode));
-  root_inode->i_ino  = 1;
-  root_inode->i_type = FS_INODE_DIR;
+  inode_hold(root_inode);
 
   root_inode->i_mode  = FS_IFDIR | FS_IRUSR | FS_IWUSR | FS_IXUSR |
                         FS_IRGRP | FS_IXGRP |
@@ -158,22 +174,16 @@ int fs_init(void)
   root_inode->i_size  = 0;
   root_inode->i_mtime = (uint64_t)time(NULL);
 
-  for (int i = 0; i < DIRECT_BLOCKS; i++)
-  {
-    root_inode->i_block[i] = -1; 
-  }
-
   struct dentry *root_dentry = malloc(sizeof(struct dentry));
   if (!root_dentry)
   {
-    free(root_inode);
     return -1;
   }
 
   memset(root_dentry, 0, sizeof(*root_dentry));
   root_dentry->d_name   = fs_strdup("/");
   root_dentry->d_parent = root_dentry; /* root->parent to itself */
-  root_dentry->d_inode  = root_inode;
+  root_dentry->d_ino    = root_inode->i_ino;
 
   g_sb.s_root = root_dentry;
   g_cwd       = root_dentry;
@@ -56,7 +56,7 @@ static int vfs_ls_long_dentry(struct dentry *dir)
 
   for (cur = dir->d_child; cur != NULL; cur = cur->d_sibling)
   {
-    struct inode *inode = cur->d_inode;
+    struct inode *inode = d_inode(cur);
     char mode_str[11] = "----------";
     char time_str[32] = "";
     time_t t;
@@ -100,11 +100,11 @@ int vfs_ls_path(const char *path)
     return -1;
   }
   target = vfs_lookup(path);
-  if (!target || !target->d_inode)
+  if (!target || !d_inode(target))
   {
     return -1;
   }
-  if (target->d_inode->i_type != FS_INODE_DIR)
+  if (d_inode(target)->i_type != FS_INODE_DIR)
   {
     return -1;
   }
@@ -114,12 +114,12 @@ int vfs_ls_path(const char *path)
 int vfs_ls_long(void)
 {
   struct dentry *cwd = fs_get_cwd_dentry();
-  if (!cwd || !cwd->d_inode)
+  if (!cwd || !d_inode(cwd))
   {
     return -1;
   }
 
-  if (fs_perm_check(cwd->d_inode, FS_R_OK) != 0)
+  if (fs_perm_check(d_inode(cwd), FS_R_OK) != 0)
   {
     return -1;
   }
@@ -137,17 +137,17 @@ int vfs_ls_long_path(const char *path)
   }
 
   target = vfs_lookup(path);
-  if (!target || !target->d_inode)
+  if (!target || !d_inode(target))
   {
     return -1;
   }
 
-  if (target->d_inode->i_type != FS_INODE_DIR)
+  if (d_inode(target)->i_type != FS_INODE_DIR)
   {
     return -1;
   }
 
-  if (fs_perm_check(target->d_inode, FS_R_OK) != 0)
+  if (fs_perm_check(d_inode(target), FS_R_OK) != 0)
   {
     return -1;
   }
@@ -157,7 +157,7 @@ int vfs_ls_long_path(const char *path)
 
 static void _vfs_tree_rec(struct dentry *dir, int level)
 {
-  if (!dir || !dir->d_inode)
+  if (!dir || !d_inode(dir))
   {
     return;
   }
@@ -176,7 +176,7 @@ static void _vfs_tree_rec(struct dentry *dir, int level)
     {
       printf("|   ");
     }
-    if (cur->d_inode && cur->d_inode->i_type == FS_INODE_DIR)
+    if (d_inode(cur) && d_inode(cur)->i_type == FS_INODE_DIR)
     {
       printf("|-- %s%s\x1b[0m\n", "\x1b[34m", cur->d_name);
       _vfs_tree_rec(cur, level + 1);
@@ -200,7 +200,7 @@ void vfs_tree(const char *path)
   {
     start = vfs_lookup(path);
   }
-  if (!start || !start->d_inode || start->d_inode->i_type != FS_INODE_DIR)
+  if (!start || !d_inode(start) || d_inode(start)->i_type != FS_INODE_DIR)
   {
     printf("tree: %s: No such file or directory\n", path ? path : "");
     return;
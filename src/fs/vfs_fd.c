@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "vfs.h"
+#include "vfs_internal.h"
+#include "inode.h"
+#include "dentry.h"
+#include "block.h"
+#include "perm.h"
+#include "meta.h"
+
+/* open file table
+ * vfs_open() resolves the path and checks permissions once; the fd then
+ * holds the dentry and the inode, pinned in the inode cache so its block
+ * map (i_map, built by the first read) stays in memory between calls.
+ * vfs_read() and vfs_write() go straight to the blocks from the fd's
+ * offset: no path walk, no permission check, and reads keep a readahead
+ * window per fd.
+ *
+ * An open file cannot be removed (vfs_rm fails) and a snapshot cannot be
+ * rolled back while any file is open: both would free what an fd holds. */
+
+#define VFS_FD_MAX 64
+
+#define FD_READ   0x1
+#define FD_WRITE  0x2
+#define FD_APPEND 0x4   /* every write goes to the end */
+
+struct vfs_file
+{
+  int             f_flags;      /* FD_*, 0: slot free */
+  size_t          f_pos;
+  int             f_group;      /* allocation group for new blocks */
+  struct dentry  *f_dentry;
+  struct inode   *f_inode;
+  struct block_ra f_ra;
+};
+
+static struct vfs_file g_files[VFS_FD_MAX];
+static int             g_nopen;
+
+static struct vfs_file *fd_get(int fd)
+{
+  if (fd < 0 || fd >= VFS_FD_MAX || g_files[fd].f_flags == 0)
+  {
+    return NULL;
+  }
+  return &g_files[fd];
+}
+
+int vfs_open_files(void)
+{
+  return g_nopen;
+}
+
+/* "r", "w", "a", each optionally with "+", as fopen */
+static int parse_mode(const char *mode, int *flags, int *create, int *trunc)
+{
+  *create = 0;
+  *trunc  = 0;
+  switch (mode ? mode[0] : '\0')
+  {
+    case 'r': *flags = FD_READ; break;
+    case 'w': *flags = FD_WRITE; *create = 1; *trunc = 1; break;
+    case 'a': *flags = FD_WRITE | FD_APPEND; *create = 1; break;
+    default:  return -1;
+  }
+  if (mode[1] == '+')
+  {
+    *flags |= FD_READ | FD_WRITE;
+  }
+  else if (mode[1] != '\0')
+  {
+    return -1;
+  }
+  return 0;
+}
+
+int vfs_open(const char *path, const char *mode)
+{
+  int flags, create, trunc;
+  if (!path || parse_mode(mode, &flags, &create, &trunc) != 0)
+  {
+    return -1;
+  }
+
+  int fd = 0;
+  while (fd < VFS_FD_MAX && g_files[fd].f_flags != 0)
+  {
+    fd++;
+  }
+  if (fd == VFS_FD_MAX)
+  {
+    return -1;
+  }
+
+  struct dentry *dent = vfs_lookup(path);
+  if (!dent && create)
+  {
+    if (vfs_create_file(path) != 0)
+    {
+      return -1;
+    }
+    dent = vfs_lookup(path);
+  }
+
+  struct inode *inode = d_inode(dent);
+  if (!inode || inode->i_type != FS_INODE_FILE)
+  {
+    return -1;
+  }
+  int need = ((flags & FD_READ) ? FS_R_OK : 0) | ((flags & FD_WRITE) ? FS_W_OK : 0);
+  if (fs_perm_check(inode, need) != 0)
+  {
+    return -1;
+  }
+
+  if (trunc && (inode->i_size > 0 || inode_is_inline(inode)))
+  {
+    inode_free_blocks(inode);
+    inode->i_size  = 0;
+    inode->i_mtime = (uint64_t)time(NULL);
+    if (meta_log_update(dent) != 0)
+    {
+      return -1;
+    }
+  }
+
+  struct vfs_file *f = &g_files[fd];
+  memset(f, 0, sizeof(*f));
+  f->f_flags  = flags;
+  f->f_group  = dentry_block_group(dent);
+  f->f_dentry = dent;
+  f->f_inode  = inode;
+  block_ra_init(&f->f_ra);
+  inode_hold(inode);
+  g_nopen++;
+  return fd;
+}
+
+int vfs_close(int fd)
+{
+  struct vfs_file *f = fd_get(fd);
+  if (!f)
+  {
+    return -1;
+  }
+  inode_put(f->f_inode);
+  memset(f, 0, sizeof(*f));
+  g_nopen--;
+  return 0;
+}
+
+size_t vfs_read(int fd, void *buf, size_t count)
+{
+  struct vfs_file *f = fd_get(fd);
+  if (!f || !(f->f_flags & FD_READ) || (!buf && count > 0))
+  {
+    return 0;
+  }
+
+  struct inode *inode = f->f_inode;
+  if (f->f_pos >= inode->i_size)
+  {
+    return 0;
+  }
+  if (count > inode->i_size - f->f_pos)
+  {
+    count = inode->i_size - f->f_pos;
+  }
+
+  if (inode_is_inline(inode))
+  {
+    memcpy(buf, inode_inline_data(inode) + f->f_pos, count);
+    f->f_pos += count;
+    return count;
+  }
+
+  const int *map;
+  size_t nblk;
+  if (inode_bmap(inode, &map, &nblk) != 0)
+  {
+    return 0;
+  }
+
+  size_t bsize = block_size();
+  size_t first = f->f_pos / bsize;
+  size_t last  = (f->f_pos + count - 1) / bsize;
+  block_readahead(&f->f_ra, map, nblk, first, last - first + 1);
+
+  /* straight out of the block storage, a block at a time */
+  uint8_t *out = buf;
+  size_t done = 0;
+  while (done < count)
+  {
+    size_t pos = f->f_pos + done;
+    size_t lo  = pos % bsize;
+    size_t n   = bsize - lo < count - done ? bsize - lo : count - done;
+    int blk = map[pos / bsize];
+
+    const uint8_t *p = block_pin(blk, BLOCK_PIN_READ);
+    if (!p)
+    {
+      break;
+    }
+    memcpy(out + done, p + lo, n);
+    block_unpin(blk);
+    done += n;
+  }
+  f->f_pos += done;
+  return done;
+}
+
+size_t vfs_write(int fd, const void *buf, size_t count)
+{
+  struct vfs_file *f = fd_get(fd);
+  if (!f || !(f->f_flags & FD_WRITE) || (!buf && count > 0))
+  {
+    return 0;
+  }
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  if (f->f_flags & FD_APPEND)
+  {
+    f->f_pos = f->f_inode->i_size;
+  }
+  if (inode_pwrite(f->f_inode, f->f_group, buf, count, f->f_pos) != 0)
+  {
+    return 0;
+  }
+  if (meta_log_update(f->f_dentry) != 0)
+  {
+    return 0;
+  }
+  f->f_pos += count;
+  return count;
+}
@@ -14,12 +14,14 @@
 #include "path.h"
 #include "block.h"
 #include "perm.h"
+#include "meta.h"
 /* user define library done */
 
 /* user define function */
 int vfs_cat(const char *path);
 int vfs_create_file(const char *path);
 int vfs_write_all(const char *path, const char *data);
+int vfs_pwrite(const char *path, const void *buf, size_t len, size_t offset);
 /* user define function done */
 
 /* function */
@@ -34,11 +36,11 @@ int vfs_cat(const char *path)
       return -1;
     }
     dent = vfs_lookup(path);
-    if (!dent || !dent->d_inode)
+    if (!dent || !d_inode(dent))
     {
       return -1;
     }
-    inode = dent->d_inode;
+    inode = d_inode(dent);
     if (inode->i_type != FS_INODE_FILE)
     {
       return -1;
@@ -47,20 +49,9 @@ int vfs_cat(const char *path)
     {
       return -1;
     }
-    size_t remain = inode->i_size;
-    for (int i = 0; i < DIRECT_BLOCKS && remain > 0; i++)
+    if (inode_read_to_file(inode, stdout) != 0)
     {
-      int blk = inode->i_block[i];
-      if (blk < 0) break;
-
-      uint8_t buf[BLOCK_SIZE];
-      if (block_read(blk, buf) != 0)
-      {
-        return -1;
-      }
-      size_t n = (remain > BLOCK_SIZE) ? BLOCK_SIZE : remain;
-      fwrite(buf, 1, n, stdout);
-      remain -= n;
+      return -1;
     }
     printf("\n");
     return 0;
@@ -126,15 +117,15 @@ int vfs_create_file(const char *path)
   {
     return -1;
   }
-  if (!parent || !parent->d_inode)
+  if (!parent || !d_inode(parent))
   {
     return -1;
   }
-  if(parent->d_inode->i_type != FS_INODE_DIR)
+  if(d_inode(parent)->i_type != FS_INODE_DIR)
   {  
     return -1;
   }
-  if(fs_perm_check(parent->d_inode, FS_W_OK | FS_X_OK) != 0)
+  if(fs_perm_check(d_inode(parent), FS_W_OK | FS_X_OK) != 0)
   {
     return -1;
   }
@@ -142,13 +133,11 @@ int vfs_create_file(const char *path)
   {
     return -1;
   }
-  inode = calloc(1, sizeof(struct inode));
+  inode = inode_new(FS_INODE_FILE);
   if (!inode)
   {
     return -1;
   }
-  inode->i_ino   = 0;
-  inode->i_type  = FS_INODE_FILE;
   inode->i_mode  = FS_IFREG | 0644;
   inode->i_uid   = fs_get_uid();
   inode->i_gid   = fs_get_gid();
@@ -156,16 +145,10 @@ int vfs_create_file(const char *path)
   inode->i_size  = 0;
   inode->i_mtime = (uint64_t)time(NULL);
 
-  for (int i = 0; i < DIRECT_BLOCKS; i++)
-  {
-    inode->i_block[i] = -1;
-  }
-
- 
   dentry = calloc(1, sizeof(struct dentry));
   if (!dentry)
   {
-    free(inode);
+    inode_delete(inode);
     return -1;
   }
 
@@ -173,39 +156,41 @@ int vfs_create_file(const char *path)
   if (!dentry->d_name)
   {
     free(dentry);
-    free(inode);
+    inode_delete(inode);
     return -1;
   }
-  dentry->d_inode = inode;
+  dentry->d_ino = inode->i_ino;
 
   if (dentry_add_child(parent, dentry) != 0)
   {
     free(dentry->d_name);
     free(dentry);
-    free(inode);
+    inode_delete(inode);
     return -1;
   }
-  return 0;
+  return meta_log_update(dentry);
 }
 
 int vfs_write_all(const char *path, const char *data)
 {
     struct dentry *dent;
     struct inode  *inode;
+    struct bmap_saved old;
     size_t len;
     size_t need_blocks;
-    size_t i, j;
+    size_t bsize;
+    size_t i;
 
     if (!path || !data)
     {
       return -1;
     }
     dent = vfs_lookup(path);
-    if (!dent || !dent->d_inode)
+    if (!dent || !d_inode(dent))
     {
       return -1;
     }
-    inode = dent->d_inode;
+    inode = d_inode(dent);
 
     if (inode->i_type != FS_INODE_FILE)
     {
@@ -217,68 +202,101 @@ int vfs_write_all(const char *path, const char *data)
     }
 
     len = strlen(data);
+    bsize = block_size();
 
-
-    need_blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    if (need_blocks > DIRECT_BLOCKS)
+    need_blocks = (len + bsize - 1) / bsize;
+    if (need_blocks > inode_max_blocks())
     {
       return -1;  /* file too large */
     }
 
-    for (i = 0; i < DIRECT_BLOCKS; i++)
+    /* the old blocks stay allocated until the new ones are written: the
+     * journal still names them, and a failure puts them back */
+    inode_save_blocks(inode, &old);
+
+    /* tiny: the bytes go in the inode, no block at all */
+    if (len <= INLINE_MAX)
     {
-      if (inode->i_block[i] >= 0) 
-      {
-        block_free(inode->i_block[i]);
-        inode->i_block[i] = -1;
-      }
+      need_blocks = 0;
+      inode_set_inline(inode, data, len);
+    }
+    /* contiguous runs where possible; rolls itself back on failure */
+    else if (inode_alloc_blocks(inode, dentry_block_group(dent), need_blocks) != 0)
+    {
+      inode_restore_blocks(inode, &old);
+      return -1;
     }
-
 
     for (i = 0; i < need_blocks; i++) 
     {
-      int blk = block_alloc();
-      if (blk < 0) 
-      {
-          /* rollback */
-        for (j = 0; j < i; j++)
-        {
-          block_free(inode->i_block[j]);
-          inode->i_block[j] = -1;
-        }
-        return -1;
-      }
-
-      inode->i_block[i] = blk;
+      int blk = inode->i_map[i];
 
-      size_t offset = i * BLOCK_SIZE;
+      size_t offset = i * bsize;
       size_t remain = len - offset;
-      size_t write_size = remain > BLOCK_SIZE ? BLOCK_SIZE : remain;
+      size_t write_size = remain > bsize ? bsize : remain;
 
-      uint8_t buf[BLOCK_SIZE];
-      memset(buf, 0, BLOCK_SIZE);
-      memcpy(buf, data + offset, write_size);
-
-
-      if (block_write(blk, buf) != 0) 
+      /* copy straight into the block, no bounce buffer; the tail is
+       * cleared below, so the old contents are never needed */
+      uint8_t *p = block_pin(blk, BLOCK_PIN_WRITE | BLOCK_PIN_WHOLE);
+      if (!p) 
       {
         /* rollback */
-        for (j = 0; j <= i; j++)
-         {
-           if (inode->i_block[j] >= 0)
-           {
-             block_free(inode->i_block[j]);
-             inode->i_block[j] = -1;
-           }
-         }
+        inode_restore_blocks(inode, &old);
         return -1;
       }
+      memcpy(p, data + offset, write_size);
+      memset(p + write_size, 0, bsize - write_size);
+      block_unpin(blk);
     }
 
+    bmap_release(&old);
     inode->i_size  = len;
     inode->i_mtime = (uint64_t)time(NULL);
+    return meta_log_update(dent);
+}
 
-    return 0;
+/* only the blocks the bytes fall in are touched: an edit or an append
+ * costs what it changes, not the size of the file */
+int vfs_pwrite(const char *path, const void *buf, size_t len, size_t offset)
+{
+    struct dentry *dent;
+    struct inode  *inode;
+
+    if (!path || (!buf && len > 0))
+    {
+      return -1;
+    }
+    dent  = vfs_lookup(path);
+    inode = d_inode(dent);
+    if (!dent || !inode)
+    {
+      return -1;
+    }
+    if (inode->i_type != FS_INODE_FILE)
+    {
+      return -1;
+    }
+    if (fs_perm_check(inode, FS_W_OK) != 0)
+    {
+      return -1;
+    }
+
+    if (offset == VFS_APPEND)
+    {
+      offset = inode->i_size;
+    }
+    if (inode_pwrite(inode, dentry_block_group(dent), buf, len, offset) != 0)
+    {
+      return -1;
+    }
+    return meta_log_update(dent);
+}
+
+static int count_block(int blk, void *arg)
+{
+  (void)blk;
+  (*(int *)arg)++;
+  return 0;
 }
 
 void vfs_stat(const char *path) {
@@ -288,18 +306,17 @@ void vfs_stat(const char *path) {
   if (!path) return;
 
   dent = vfs_lookup(path);
-  if (!dent || !dent->d_inode) {
+  if (!dent || !d_inode(dent)) {
     printf("stat: '%s': No such file or directory\n", path);
     return;
   }
 
-  node = dent->d_inode;
+  node = d_inode(dent);
   if (!node) return;
 
+  /* data blocks and the indirect blocks mapping them */
   int block_count = 0;
-  for (int i = 0; i < DIRECT_BLOCKS; i++) {
-    if (node->i_block[i] >= 0) block_count++;
-  }
+  bmap_walk(node->i_block, node->i_size, count_block, &block_count);
 
   printf("  File: %s\n", path);
   printf("  Size: %zu \tBlocks: %d \tType: %s\n",
@@ -11,6 +11,7 @@
 #include "path.h"
 #include "block.h"
 #include "perm.h"
+#include "meta.h"
 
 static const char *host_basename(const char *p)
 {
@@ -56,25 +57,59 @@ static void join_vfs_path(char out[256], const char *dir, const char *base)
   }
 }
 
-static int inode_free_blocks(struct inode *inode)
+static int release_map(int *map, size_t n)
 {
-  if (!inode)
+  for (size_t i = 0; i < n; i++)
+  {
+    block_free(map[i]);
+  }
+  free(map);
+  return -1;
+}
+
+/* dedup: each block is stored by content, so data already on the device
+ * is referenced instead of written again */
+static int inode_store_blocks(struct inode *inode, int group, const uint8_t *data,
+                              size_t len, size_t nblk)
+{
+  size_t bsize = block_size();
+  uint8_t *tail = NULL;
+  int *map = malloc((nblk ? nblk : 1) * sizeof(*map));
+
+  if (!map)
   {
     return -1;
   }
 
-  for (int i = 0; i < DIRECT_BLOCKS; i++)
+  for (size_t i = 0; i < nblk; i++)
   {
-    if (inode->i_block[i] >= 0)
+    const uint8_t *src = data + i * bsize;
+    if ((i + 1) * bsize > len)
+    {
+      /* the last block is zero padded, as a plain write would leave it */
+      tail = calloc(1, bsize);
+      if (!tail)
+      {
+        return release_map(map, i);
+      }
+      memcpy(tail, src, len - i * bsize);
+      src = tail;
+    }
+
+    int blk = block_store(src);
+    if (blk < 0)
     {
-      block_free(inode->i_block[i]);
-      inode->i_block[i] = -1;
+      free(tail);
+      return release_map(map, i);
     }
+    map[i] = blk;
   }
-  return 0;
+
+  free(tail);
+  return inode_set_blocks(inode, group, map, nblk);
 }
 
-static int inode_write_bytes(struct inode *inode, const uint8_t *data, size_t len)
+static int inode_write_bytes(struct inode *inode, int group, const uint8_t *data, size_t len)
 {
   if (!inode || (!data && len > 0))
   {
@@ -86,55 +121,324 @@ static int inode_write_bytes(struct inode *inode, const uint8_t *data, size_t le
     return -1;
   }
 
-  size_t need_blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  if (need_blocks > DIRECT_BLOCKS)
+  size_t bsize = block_size();
+  size_t need_blocks = (len + bsize - 1) / bsize;
+  if (need_blocks > inode_max_blocks())
   {
     return -1;
   }
 
-  if (block_free_size() < need_blocks * (size_t)BLOCK_SIZE)
+  if (block_free_size() < need_blocks * bsize)
   {
     return -1;
   }
 
-  inode_free_blocks(inode);
+  /* the new blocks are written before the old ones are let go */
+  struct bmap_saved old;
+  inode_save_blocks(inode, &old);
 
-  for (size_t i = 0; i < need_blocks; i++)
+  if (len <= INLINE_MAX)
   {
-    int blk = block_alloc();
-    if (blk < 0)
+    inode_set_inline(inode, data, len);
+  }
+  else if (block_dedup())
+  {
+    if (inode_store_blocks(inode, group, data, len, need_blocks) != 0)
     {
-      inode_free_blocks(inode);
+      inode_restore_blocks(inode, &old);
+      return -1;
+    }
+  }
+  else
+  {
+    if (inode_alloc_blocks(inode, group, need_blocks) != 0)
+    {
+      inode_restore_blocks(inode, &old);
       return -1;
     }
 
-    inode->i_block[i] = blk;
+    /* one gather write: adjacent blocks become single transfers and the
+     * tail of the last block is zero-filled by the block layer */
+    struct iovec iov = { (void *)data, len };
+    if (need_blocks > 0 && block_writev(inode->i_map, need_blocks, &iov, 1) != 0)
+    {
+      inode_restore_blocks(inode, &old);
+      return -1;
+    }
+  }
 
-    size_t off = i * (size_t)BLOCK_SIZE;
-    size_t remain = len - off;
-    size_t wlen = remain > (size_t)BLOCK_SIZE ? (size_t)BLOCK_SIZE : remain;
+  bmap_release(&old);
+  inode->i_size = len;
+  inode->i_mtime = (uint64_t)time(NULL);
+
+  return 0;
+}
+
+/* ---------- writes at an offset ---------- */
+
+/* blocks [from, to) of a file that has `cur`: the ones it has are
+ * changed, the ones past its end are new, and nothing else is touched.
+ * Without dedup the old blocks are written in place and the new ones
+ * allocated in a few runs after the last; one shared with a snapshot or
+ * a copy (reference counts) is swapped for a private copy first. With
+ * dedup every changed block is stored again by content and the old one
+ * is let go. Either way only the new map is written out again, never
+ * the rest of the data. */
+static int pwrite_blocks(struct inode *inode, int group, const uint8_t *data,
+                         size_t len, size_t off)
+{
+  size_t bsize = block_size();
+  size_t size  = inode->i_size;
+  size_t end   = off + len;
+  const int *old;
+  size_t cur;
+
+  if (inode_bmap(inode, &old, &cur) != 0)
+  {
+    return -1;
+  }
+
+  size_t from = (off < size ? off : size) / bsize;
+  size_t to   = (end + bsize - 1) / bsize;
+  size_t n    = to > cur ? to : cur;
+  int dedup   = block_dedup();
+  int refs    = !dedup && block_refcounts();
+
+  int *map  = malloc(n * sizeof(*map));
+  int *gone = dedup ? malloc((to - from) * sizeof(*gone)) : NULL;
+  uint8_t *tmp = dedup ? malloc(bsize) : NULL;
+  /* refs: (index, shared block) for each block swapped for a copy */
+  int *cowed = refs ? malloc(2 * (to - from) * sizeof(*cowed)) : NULL;
+  size_t ngone = 0, nnew = 0, ncow = 0;
+  if (!map || (dedup && (!gone || !tmp)) || (refs && !cowed))
+  {
+    goto fail;
+  }
+  if (cur > 0)
+  {
+    memcpy(map, old, cur * sizeof(*map));
+  }
 
-    uint8_t buf[BLOCK_SIZE];
-    memset(buf, 0, sizeof(buf));
-    if (wlen > 0)
+  /* the new tail first: nothing is written until it has a place */
+  if (!dedup)
+  {
+    int goal = cur > 0 ? block_group_of(map[cur - 1]) : group;
+    while (cur + nnew < n)
     {
-      memcpy(buf, data + off, wlen);
+      int start;
+      size_t got;
+      if (block_alloc_range_group(goal, n - cur - nnew, &start, &got) != 0)
+      {
+        goto fail;
+      }
+      for (size_t k = 0; k < got; k++)
+      {
+        map[cur + nnew++] = start + (int)k;
+      }
     }
+  }
 
-    if (block_write(blk, buf) != 0)
+  for (size_t i = from; i < to; i++)
+  {
+    size_t base = i * bsize;
+    size_t lo   = off > base ? off - base : 0;      /* [lo, hi): new bytes */
+    size_t hi   = end < base + bsize ? end - base : bsize;
+    /* bytes of this block past the old end read as zeros, a gap too */
+    size_t keep = size > base ? size - base : 0;
+    if (lo > bsize)
+    {
+      lo = bsize;
+    }
+    if (keep > lo)
+    {
+      keep = lo;
+    }
+
+    uint8_t *p;
+    if (dedup)
+    {
+      p = tmp;
+      if (i < cur && block_read(map[i], p) != 0)
+      {
+        goto fail;
+      }
+    }
+    else
+    {
+      if (refs && i < cur)
+      {
+        int blk = block_cow(map[i]);
+        if (blk < 0)
+        {
+          goto fail;
+        }
+        if (blk != map[i])
+        {
+          cowed[2 * ncow]     = (int)i;
+          cowed[2 * ncow + 1] = map[i];
+          ncow++;
+          map[i] = blk;
+        }
+      }
+      int whole = i >= cur || (lo == 0 && hi == bsize);
+      p = block_pin(map[i], BLOCK_PIN_WRITE | (whole ? BLOCK_PIN_WHOLE : 0));
+      if (!p)
+      {
+        goto fail;
+      }
+    }
+
+    memset(p + keep, 0, lo - keep);
+    if (hi > lo)
+    {
+      memcpy(p + lo, data + (base + lo - off), hi - lo);
+    }
+    if (i >= cur)
+    {
+      memset(p + hi, 0, bsize - hi);
+    }
+
+    if (!dedup)
+    {
+      block_unpin(map[i]);
+      continue;
+    }
+    int blk = block_store(p);
+    if (blk < 0)
+    {
+      goto fail;
+    }
+    if (i < cur)
+    {
+      gone[ngone++] = map[i];
+    }
+    else
+    {
+      nnew++;
+    }
+    map[i] = blk;
+  }
+
+  /* the map changes when the file grows, or with dedup; extending the
+   * file in place needs neither */
+  if (n == cur && !dedup && ncow == 0)
+  {
+    free(map);
+  }
+  else if (inode_remap_blocks(inode, group, map, n) != 0)
+  {
+    goto fail;
+  }
+
+  for (size_t k = 0; k < ngone; k++)
+  {
+    block_free(gone[k]);
+  }
+  free(gone);
+  free(tmp);
+  free(cowed);
+  if (end > size)
+  {
+    inode->i_size = end;
+  }
+  return 0;
+
+fail:
+  /* what was stored or allocated here goes back; with dedup the old
+   * blocks were only read, without it those written hold the new bytes
+   * (a partial write, as after a crash) */
+  if (map)
+  {
+    for (size_t i = from; dedup && i < from + ngone; i++)
+    {
+      block_free(map[i]);
+    }
+    for (size_t k = 0; k < nnew; k++)
+    {
+      block_free(map[cur + k]);
+    }
+    /* the copies go, the shared blocks get their reference back */
+    for (size_t k = 0; k < ncow; k++)
+    {
+      block_share(cowed[2 * k + 1]);
+      block_free(map[cowed[2 * k]]);
+    }
+  }
+  free(map);
+  free(gone);
+  free(tmp);
+  free(cowed);
+  return -1;
+}
+
+int inode_pwrite(struct inode *inode, int group, const void *buf, size_t len, size_t off)
+{
+  if (!inode || inode->i_type != FS_INODE_FILE || (!buf && len > 0))
+  {
+    return -1;
+  }
+  if (len == 0)
+  {
+    return 0;
+  }
+
+  size_t bsize = block_size();
+  if (off > SIZE_MAX - len - bsize || (off + len + bsize - 1) / bsize > inode_max_blocks())
+  {
+    return -1;  /* file too large */
+  }
+
+  size_t size = inode->i_size;
+  size_t end  = off + len;
+  uint8_t tmp[INLINE_MAX];
+
+  if (inode_is_inline(inode) || size == 0)
+  {
+    memset(tmp, 0, sizeof(tmp));
+    if (inode_is_inline(inode))
+    {
+      memcpy(tmp, inode_inline_data(inode), size);
+    }
+  }
+
+  if ((inode_is_inline(inode) || size == 0) && end <= INLINE_MAX)
+  {
+    /* still tiny: edited in the inode */
+    memcpy(tmp + off, buf, len);
+    inode_set_inline(inode, tmp, end > size ? end : size);
+    if (end > size)
+    {
+      inode->i_size = end;
+    }
+  }
+  else
+  {
+    if (inode_is_inline(inode))
+    {
+      /* outgrown: the bytes it had go to a first block, then on as for
+       * any file */
+      inode_set_ptrs(inode, NULL);
+      inode->i_size = 0;
+      if (size > 0 && pwrite_blocks(inode, group, tmp, size, 0) != 0)
+      {
+        inode_set_inline(inode, tmp, size);
+        inode->i_size = size;
+        return -1;
+      }
+    }
+    if (pwrite_blocks(inode, group, buf, len, off) != 0)
     {
-      inode_free_blocks(inode);
       return -1;
     }
   }
 
-  inode->i_size = len;
   inode->i_mtime = (uint64_t)time(NULL);
-
   return 0;
 }
 
-static int inode_read_to_file(const struct inode *inode, FILE *fp)
+/* streams the file out a few blocks at a time; readahead keeps the
+ * blocks after each chunk coming while the chunk is written out */
+int inode_read_to_file(struct inode *inode, FILE *fp)
 {
   if (!inode || !fp)
   {
@@ -146,33 +450,160 @@ static int inode_read_to_file(const struct inode *inode, FILE *fp)
     return -1;
   }
 
-  size_t remain = inode->i_size;
+  if (inode_is_inline(inode))
+  {
+    return fwrite(inode_inline_data(inode), 1, inode->i_size, fp) == inode->i_size ? 0 : -1;
+  }
 
-  for (int i = 0; i < DIRECT_BLOCKS && remain > 0; i++)
+  size_t bsize = block_size();
+  const int *map;
+  size_t nblk;
+  if (inode_bmap(inode, &map, &nblk) != 0)
   {
-    int blk = inode->i_block[i];
-    if (blk < 0)
+    return -1;
+  }
+  if (nblk == 0)
+  {
+    return 0;
+  }
+
+  size_t chunk = nblk < VFS_STREAM_BLOCKS ? nblk : VFS_STREAM_BLOCKS;
+  uint8_t *buf = malloc(chunk * bsize);
+  if (!buf)
+  {
+    return -1;
+  }
+
+  struct block_ra ra;
+  block_ra_init(&ra);
+
+  int rc = 0;
+  for (size_t pos = 0; pos < nblk && rc == 0; pos += chunk)
+  {
+    size_t n = nblk - pos < chunk ? nblk - pos : chunk;
+    size_t len = inode->i_size - pos * bsize;
+    if (len > n * bsize)
+    {
+      len = n * bsize;
+    }
+
+    block_readahead(&ra, map, nblk, pos, n);
+
+    struct iovec iov = { buf, len };
+    if (block_readv(map + pos, n, &iov, 1) != 0 ||
+        fwrite(buf, 1, len, fp) != len)
+    {
+      rc = -1;
+    }
+  }
+
+  free(buf);
+  return rc;
+}
+
+struct share_walk
+{
+  size_t left;      /* blocks still to share, or to unshare */
+  int    undo;
+};
+
+static int share_one(int blk, void *arg)
+{
+  struct share_walk *w = arg;
+  if (w->left == 0)
+  {
+    return w->undo ? -1 : 0;
+  }
+  w->left--;
+  if (w->undo)
+  {
+    block_free(blk);
+    return 0;
+  }
+  return block_share(blk);
+}
+
+/* dst gets its own copy of src's blocks: a gather read of the source and
+ * a scatter write of the copy, VFS_COPY_BLOCKS at a time. With reference
+ * counts (dedup or not) it shares them instead, indirect blocks included,
+ * and no data moves at all. */
+static int inode_copy_blocks(struct inode *dst, int group, struct inode *src)
+{
+  size_t bsize = block_size();
+  struct bmap_saved old;
+  const int *map;
+  size_t nblk;
+
+  if (inode_is_inline(src))
+  {
+    /* the data is the metadata: nothing to share or to move */
+    inode_save_blocks(dst, &old);
+    inode_set_inline(dst, inode_inline_data(src), src->i_size);
+    bmap_release(&old);
+    dst->i_size  = src->i_size;
+    dst->i_mtime = (uint64_t)time(NULL);
+    return 0;
+  }
+
+  if (inode_bmap(src, &map, &nblk) != 0)
+  {
+    return -1;
+  }
+
+  if (block_refcounts())
+  {
+    struct share_walk w = { SIZE_MAX, 0 };
+    if (bmap_walk(src->i_block, src->i_size, share_one, &w) != 0)
     {
-      break;
+      /* give back what was taken, in the same order */
+      struct share_walk u = { SIZE_MAX - w.left, 1 };
+      bmap_walk(src->i_block, src->i_size, share_one, &u);
+      return -1;
     }
+    inode_save_blocks(dst, &old);
+    inode_set_ptrs(dst, src->i_block);
+    bmap_release(&old);
+    dst->i_size  = src->i_size;
+    dst->i_mtime = (uint64_t)time(NULL);
+    return 0;
+  }
+
+  /* the copy is made before dst lets go of what it had */
+  inode_save_blocks(dst, &old);
+  if (inode_alloc_blocks(dst, group, nblk) != 0)
+  {
+    inode_restore_blocks(dst, &old);
+    return -1;
+  }
 
-    uint8_t buf[BLOCK_SIZE];
-    if (block_read(blk, buf) != 0)
+  if (nblk > 0)
+  {
+    size_t chunk = nblk < VFS_COPY_BLOCKS ? nblk : VFS_COPY_BLOCKS;
+    uint8_t *buf = malloc(chunk * bsize);
+    if (!buf)
     {
+      inode_restore_blocks(dst, &old);
       return -1;
     }
 
-    size_t n = remain > (size_t)BLOCK_SIZE ? (size_t)BLOCK_SIZE : remain;
-    if (n > 0)
+    for (size_t pos = 0; pos < nblk; pos += chunk)
     {
-      if (fwrite(buf, 1, n, fp) != n)
+      size_t n = nblk - pos < chunk ? nblk - pos : chunk;
+      struct iovec iov = { buf, n * bsize };
+      if (block_readv(map + pos, n, &iov, 1) != 0 ||
+          block_writev(dst->i_map + pos, n, &iov, 1) != 0)
       {
+        free(buf);
+        inode_restore_blocks(dst, &old);
         return -1;
       }
     }
-    remain -= n;
+    free(buf);
   }
 
+  bmap_release(&old);
+  dst->i_size  = src->i_size;
+  dst->i_mtime = (uint64_t)time(NULL);
   return 0;
 }
 
@@ -209,7 +640,7 @@ int vfs_import(const char *host_path, const char *vfs_path)
   }
 
   size_t len = (size_t)fsz;
-  size_t max_len = (size_t)DIRECT_BLOCKS * (size_t)BLOCK_SIZE;
+  size_t max_len = inode_max_blocks() * block_size();
 
   if (len > max_len)
   {
@@ -253,7 +684,7 @@ int vfs_import(const char *host_path, const char *vfs_path)
   }
 
   struct dentry *maybe_dir = vfs_lookup(target);
-  if (maybe_dir && maybe_dir->d_inode && maybe_dir->d_inode->i_type == FS_INODE_DIR)
+  if (maybe_dir && d_inode(maybe_dir) && d_inode(maybe_dir)->i_type == FS_INODE_DIR)
   {
     char joined[256];
     const char *base = host_basename(host_path);
@@ -286,7 +717,7 @@ int vfs_import(const char *host_path, const char *vfs_path)
     }
 
     dent = vfs_lookup(target);
-    if (!dent || !dent->d_inode)
+    if (!dent || !d_inode(dent))
     {
       if (data)
         free(data);
@@ -294,7 +725,7 @@ int vfs_import(const char *host_path, const char *vfs_path)
     }
   }
 
-  if (!dent->d_inode || dent->d_inode->i_type != FS_INODE_FILE)
+  if (!d_inode(dent) || d_inode(dent)->i_type != FS_INODE_FILE)
   {
     if (data)
       free(data);
@@ -303,13 +734,17 @@ int vfs_import(const char *host_path, const char *vfs_path)
 
   int rc = 0;
 
-  if (fs_perm_check(dent->d_inode, FS_W_OK) != 0)
+  if (fs_perm_check(d_inode(dent), FS_W_OK) != 0)
   {
     rc = -1;
   }
   else
   {
-    rc = inode_write_bytes(dent->d_inode, data, len);
+    rc = inode_write_bytes(d_inode(dent), dentry_block_group(dent), data, len);
+    if (rc == 0)
+    {
+      rc = meta_log_update(dent);
+    }
   }
 
   if (data) free(data);
@@ -324,17 +759,17 @@ int vfs_export(const char *vfs_path, const char *host_path)
   }
 
   struct dentry *dent = vfs_lookup(vfs_path);
-  if (!dent || !dent->d_inode)
+  if (!dent || !d_inode(dent))
   {
     return -1;
   }
 
-  if (dent->d_inode->i_type != FS_INODE_FILE)
+  if (d_inode(dent)->i_type != FS_INODE_FILE)
   {
     return -1;
   }
 
-  if (fs_perm_check(dent->d_inode, FS_R_OK) != 0)
+  if (fs_perm_check(d_inode(dent), FS_R_OK) != 0)
   {
     return -1;
   }
@@ -345,7 +780,7 @@ int vfs_export(const char *vfs_path, const char *host_path)
     return -1;
   }
 
-  int rc = inode_read_to_file(dent->d_inode, fp);
+  int rc = inode_read_to_file(d_inode(dent), fp);
 
   fclose(fp);
   return rc;
@@ -356,85 +791,49 @@ int vfs_cp(const char *src_path, const char *dest_path) {
     return -1;
 
   struct dentry *src = vfs_lookup(src_path);
-  if (!src || !src->d_inode) {
+  if (!src || !d_inode(src)) {
     printf("cp: cannot stat '%s': No such file\n", src_path);
     return -1;
   }
-  if (src->d_inode->i_type != FS_INODE_FILE) {
+  if (d_inode(src)->i_type != FS_INODE_FILE) {
     printf("cp: '%s' is not a regular file\n", src_path);
     return -1;
   }
-  if (fs_perm_check(src->d_inode, FS_R_OK) != 0) {
+  if (fs_perm_check(d_inode(src), FS_R_OK) != 0) {
     return -1;
   }
 
-  size_t len = src->d_inode->i_size;
-  size_t max_len = (size_t)DIRECT_BLOCKS * (size_t)BLOCK_SIZE;
+  size_t len = d_inode(src)->i_size;
+  size_t max_len = inode_max_blocks() * block_size();
   if (len > max_len)
     return -1;
 
-  uint8_t *buf = NULL;
-  if (len > 0) {
-    buf = malloc(len);
-    if (!buf)
-      return -1;
-
-    size_t remain = len;
-    size_t off = 0;
-    for (int i = 0; i < DIRECT_BLOCKS && remain > 0; i++) {
-      int blk = src->d_inode->i_block[i];
-      if (blk < 0)
-        break;
-
-      uint8_t tmp[BLOCK_SIZE];
-      if (block_read(blk, tmp) != 0) {
-        free(buf);
-        return -1;
-      }
-
-      size_t n = remain > (size_t)BLOCK_SIZE ? (size_t)BLOCK_SIZE : remain;
-      memcpy(buf + off, tmp, n);
-      off += n;
-      remain -= n;
-    }
-  }
-
   struct dentry *dest = vfs_lookup(dest_path);
   if (!dest) {
     if (vfs_create_file(dest_path) != 0) {
-      if (buf)
-        free(buf);
       return -1;
     }
     dest = vfs_lookup(dest_path);
-    if (!dest || !dest->d_inode) {
-      if (buf)
-        free(buf);
+    if (!dest || !d_inode(dest)) {
       return -1;
     }
   }
 
-  if (dest->d_inode->i_type != FS_INODE_FILE) {
-    if (buf)
-      free(buf);
+  if (d_inode(dest)->i_type != FS_INODE_FILE) {
     return -1;
   }
 
-  if (fs_perm_check(dest->d_inode, FS_W_OK) != 0) {
-    if (buf)
-      free(buf);
+  if (fs_perm_check(d_inode(dest), FS_W_OK) != 0) {
     return -1;
   }
 
-  int rc = 0;
-  if (len == 0) {
-    rc = vfs_write_all(dest_path, "");
-  }
-  else {
-    rc = vfs_write_all(dest_path, (const char *)buf);
+  /* cp onto itself: nothing to do (and freeing dest would free src) */
+  if (d_inode(dest) == d_inode(src)) {
+    return 0;
   }
 
-  if (buf)
-    free(buf);
-  return rc;
+  if (inode_copy_blocks(d_inode(dest), dentry_block_group(dest), d_inode(src)) != 0) {
+    return -1;
+  }
+  return meta_log_update(dest);
 }
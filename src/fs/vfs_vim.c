@@ -31,12 +31,12 @@ static int vfs_read_all_into_buf(const char *path, char *out, size_t out_sz)
   out[0] = '\0';
 
   dent = vfs_lookup(path);
-  if (!dent || !dent->d_inode)
+  if (!dent || !d_inode(dent))
   {
     return -1;
   }
 
-  inode = dent->d_inode;
+  inode = d_inode(dent);
   if (inode->i_type != FS_INODE_FILE)
   {
     return -1;
@@ -47,24 +47,35 @@ static int vfs_read_all_into_buf(const char *path, char *out, size_t out_sz)
     return -1;
   }
 
+  size_t bsize = block_size();
   size_t remain = inode->i_size;
   size_t pos = 0;
 
-  for (int i = 0; i < DIRECT_BLOCKS && remain > 0; i++)
+  if (inode_is_inline(inode))
   {
-    int blk = inode->i_block[i];
+    size_t n = remain < out_sz - 1 ? remain : out_sz - 1;
+    memcpy(out, inode_inline_data(inode), n);
+    out[n] = '\0';
+    return 0;
+  }
+
+  /* only the first out_sz bytes: look blocks up one at a time rather
+   * than building the map of a file that may be much larger */
+  for (size_t i = 0; remain > 0; i++)
+  {
+    int blk = inode_lookup(inode, i);
     if (blk < 0)
     {
       break;
     }
 
-    uint8_t b[BLOCK_SIZE];
-    if (block_read(blk, b) != 0)
+    const uint8_t *b = block_pin(blk, BLOCK_PIN_READ);
+    if (!b)
     {
       return -1;
     }
 
-    size_t n = (remain > BLOCK_SIZE) ? BLOCK_SIZE : remain;
+    size_t n = (remain > bsize) ? bsize : remain;
 
     if (pos + n >= out_sz)
     {
@@ -72,6 +83,7 @@ static int vfs_read_all_into_buf(const char *path, char *out, size_t out_sz)
     }
 
     memcpy(out + pos, b, n);
+    block_unpin(blk);
     pos += n;
     out[pos] = '\0';
 
@@ -138,10 +150,10 @@ int vfs_vim(const char *path)
 
   /* read current content (if any) */
   dent = vfs_lookup(pathbuf);
-  if (dent && dent->d_inode && dent->d_inode->i_type == FS_INODE_FILE)
+  if (dent && d_inode(dent) && d_inode(dent)->i_type == FS_INODE_FILE)
   {
     /* if no read permission, deny */
-    if (fs_perm_check(dent->d_inode, FS_R_OK) != 0)
+    if (fs_perm_check(d_inode(dent), FS_R_OK) != 0)
     {
       printf("vim: permission denied (read): %s\n", pathbuf);
       return -1;
@@ -201,12 +213,12 @@ int vfs_vim(const char *path)
     if (strcmp(line, ":w") == 0)
     {
       dent = vfs_lookup(pathbuf);
-      if (!dent || !dent->d_inode)
+      if (!dent || !d_inode(dent))
       {
         printf("vim: file disappeared?\n");
         continue;
       }
-      if (fs_perm_check(dent->d_inode, FS_W_OK) != 0)
+      if (fs_perm_check(d_inode(dent), FS_W_OK) != 0)
       {
         printf("vim: permission denied (write): %s\n", pathbuf);
         continue;
@@ -227,12 +239,12 @@ int vfs_vim(const char *path)
     if (strcmp(line, ":wq") == 0)
     {
       dent = vfs_lookup(pathbuf);
-      if (!dent || !dent->d_inode)
+      if (!dent || !d_inode(dent))
       {
         printf("vim: file disappeared?\n");
         break;
       }
-      if (fs_perm_check(dent->d_inode, FS_W_OK) != 0)
+      if (fs_perm_check(d_inode(dent), FS_W_OK) != 0)
       {
         printf("vim: permission denied (write): %s\n", pathbuf);
         continue;
@@ -1,25 +1,154 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "vfs.h"
 #include "meta.h"
 #include "shell.h"
 #include "block.h"
 
+static void print_usage(const char *prog)
+{
+    printf("usage: %s [-f] [-s block_size] [-n block_count] [-m mmap|file] [-c cache_blocks] [-q depth] [-K] [-z ratio] [-D] [-R] [image]\n", prog);
+    printf("  -f              format (mkfs) the image even if it exists\n");
+    printf("  -s block_size   bytes per block for a new image (%d-%d, power of 2)\n",
+           BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+    printf("  -n block_count  number of blocks for a new image (default %d)\n",
+           BLOCK_COUNT_DEFAULT);
+    printf("  -m mmap|file    block backend: map the whole image (default), or\n");
+    printf("                  pread/pwrite through a bounded buffer cache\n");
+    printf("  -c cache_blocks buffer cache size for -m file (default %d)\n",
+           BLOCK_CACHE_DEFAULT);
+    printf("  -q depth        io_uring queue depth for -m file (default %d,\n",
+           BLOCK_QUEUE_DEPTH_DEFAULT);
+    printf("                  0 = plain pread/pwrite)\n");
+    printf("  -K              format without per-block checksums\n");
+    printf("  -z ratio        format compressed: block_count blocks of storage\n");
+    printf("                  hold ratio times as many blocks (2-%d, -m file)\n",
+           BLOCK_LZ_RATIO_MAX);
+    printf("  -D              format with deduplication: cp and import share\n");
+    printf("                  blocks with identical contents (implies -R)\n");
+    printf("  -R              format with block reference counts: snapshots, and\n");
+    printf("                  cp shares blocks, copied on write; no content hashing\n");
+    printf("  image           disk image path (default disk.img)\n");
+}
 
-int main(void)
+int main(int argc, char **argv)
 {
-    block_init();
+    const char *image = "disk.img";
+    size_t bsize  = BLOCK_SIZE_DEFAULT;
+    size_t bcount = BLOCK_COUNT_DEFAULT;
+    int do_format = 0;
+    int backend = BLOCK_BACKEND_MMAP;
+    size_t cache_blocks = 0;
+    unsigned depth = BLOCK_QUEUE_DEPTH_DEFAULT;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-f") == 0)
+        {
+            do_format = 1;
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            bsize = (size_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            bcount = (size_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "mmap") == 0)
+            {
+                backend = BLOCK_BACKEND_MMAP;
+            }
+            else if (strcmp(argv[i], "file") == 0)
+            {
+                backend = BLOCK_BACKEND_FILE;
+            }
+            else
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            cache_blocks = (size_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+        {
+            depth = (unsigned)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-K") == 0)
+        {
+            block_set_checksums(0);
+        }
+        else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc)
+        {
+            if (block_set_compression((unsigned)strtoul(argv[++i], NULL, 0)) != 0)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-D") == 0)
+        {
+            block_set_dedup(1);
+        }
+        else if (strcmp(argv[i], "-R") == 0)
+        {
+            block_set_refcounts(1);
+        }
+        else if (argv[i][0] != '-')
+        {
+            image = argv[i];
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
 
-    if (block_load_image("disk.img") != 0)
+    block_set_backend(backend, cache_blocks);
+    block_set_queue_depth(depth);
+
+    int rc = do_format ? BLOCK_NO_IMAGE : block_load_image(image);
+    if (rc < 0)
+    {
+        /* formatting would destroy whatever the image still holds */
+        printf("cannot load image (damaged or unsupported?): %s left untouched\n", image);
+        return 1;
+    }
+    if (rc == BLOCK_NO_IMAGE)
     {
-        printf("first run, empty disk\n");
+        if (!do_format)
+        {
+            printf("first run, empty disk\n");
+        }
+        if (block_format(image, bsize, bcount) != 0)
+        {
+            printf("mkfs failed: %s (block size %zu, %zu blocks)\n", image, bsize, bcount);
+            return 1;
+        }
+        meta_format();
     }
 
     fs_init();
-    meta_load();
+    if (meta_load() != 0)
+    {
+        /* a checkpoint now would write the empty tree over the real one */
+        printf("metadata load failed (damaged image?): %s left untouched\n", image);
+        block_close();
+        return 1;
+    }
 
     run_shell();
 
     meta_save();
-    block_save_image("disk.img");
+    block_save_image(image);
+    block_close();
 }
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 /* standard library done */
 
 /* user define */
@@ -10,6 +11,7 @@
 #include "fs/path.h"
 #include "fs/perm.h"
 #include "fs/block.h" 
+#include "fs/meta.h"
 /* user define done */
 
 /* marco */
@@ -26,6 +28,7 @@
 
 /* define function */
 static void print_help(void);
+static void print_iostat(int json);
 void run_shell(void);
 /* define function done*/
 
@@ -40,6 +43,12 @@ static void print_help(void)
   printf("  help                         - Show this help message\n");
   printf("  exit                         - Exit the shell\n");
   printf("  df                           - Show disk usage information\n");
+  printf("  scrub [threads]              - Verify block checksums\n");
+  printf("  iostat [-j] | iostat reset   - Block layer counters and latencies (-j: JSON)\n");
+  printf("  snapshot list                - List snapshots\n");
+  printf("  snapshot create|rollback|delete <name>\n");
+  printf("                               - Freeze the tree / return to / drop a snapshot\n");
+  printf("                                 (images formatted with -R or -D)\n");
   printf("  id                           - Show current user identity\n");
   printf("  sudo <cmd>                   - Execute command as superuser\n");
   printf("  ls [path]                    - List files in a directory\n");
@@ -51,6 +60,12 @@ static void print_help(void)
   printf("  stat <path>                  - Show file or directory status\n");
   printf("  cp <src> <dest>              - Copy file from source to destination\n");
   printf("  write <path> <text>          - Write text to a file (overwrite)\n");
+  printf("  pwrite <path> <off> <text>   - Write text at a byte offset (in place)\n");
+  printf("  append <path> <text>         - Append text to the end of a file\n");
+  printf("  open <path> [r|w|a][+]       - Open a file, print its fd\n");
+  printf("  read <fd> [n]                - Read up to n bytes from the fd's offset\n");
+  printf("  fwrite <fd> <text>           - Write text at the fd's offset\n");
+  printf("  close <fd>                   - Close an fd\n");
   printf("  vim <path> <text>            - Edit file content (simple editor)\n");
   printf("  cat <path>                   - Display file contents\n");
   printf("  rm <path>                    - Remove a file\n");
@@ -67,6 +82,122 @@ static void print_help(void)
   printf("  sudo rmdir a                 - Remove directory 'a' as superuser\n");
 }
 
+/* "750ns", "12.3us", "4.1ms", "1.20s" */
+static void fmt_ns(char *out, size_t n, double ns)
+{
+  if (ns < 1000.0)
+    snprintf(out, n, "%.0fns", ns);
+  else if (ns < 1000000.0)
+    snprintf(out, n, "%.1fus", ns / 1000.0);
+  else if (ns < 1000000000.0)
+    snprintf(out, n, "%.1fms", ns / 1000000.0);
+  else
+    snprintf(out, n, "%.2fs", ns / 1000000000.0);
+}
+
+/* upper bound of the bucket holding the p-th fraction of the calls */
+static double lat_percentile(const uint64_t *lat, uint64_t n, double p)
+{
+  uint64_t want = (uint64_t)((double)n * p);
+  uint64_t seen = 0;
+
+  if (want == 0) want = 1;
+  for (int b = 0; b < BLOCK_LAT_BUCKETS; b++)
+  {
+    seen += lat[b];
+    if (seen >= want) return (double)((uint64_t)2 << b);
+  }
+  return (double)((uint64_t)1 << BLOCK_LAT_BUCKETS);
+}
+
+static void print_iostat(int json)
+{
+  struct block_stats st;
+  block_stats_get(&st);
+
+  if (json)
+  {
+    printf("{\"engine\":\"%s\",\"block_size\":%zu,\"ops\":{", block_io_engine(), block_size());
+    for (int op = 0; op < BLOCK_OP_COUNT; op++)
+    {
+      printf("%s\"%s\":{\"count\":%llu,\"time_ns\":%llu,", op ? "," : "",
+             block_op_name(op), (unsigned long long)st.ops[op],
+             (unsigned long long)st.lat_ns[op]);
+      if (op == BLOCK_OP_READ || op == BLOCK_OP_WRITE)
+      {
+        printf("\"bytes\":%llu,", (unsigned long long)
+               (op == BLOCK_OP_READ ? st.bytes_read : st.bytes_written));
+      }
+      printf("\"latency_log2_ns\":[");
+      for (int b = 0; b < BLOCK_LAT_BUCKETS; b++)
+      {
+        printf("%s%llu", b ? "," : "", (unsigned long long)st.lat[op][b]);
+      }
+      printf("]}");
+    }
+    printf("},\"cache\":{\"hits\":%llu,\"misses\":%llu},\"alloc_failed\":%llu}\n",
+           (unsigned long long)st.cache_hits, (unsigned long long)st.cache_misses,
+           (unsigned long long)st.alloc_failed);
+    return;
+  }
+
+  printf("%-6s %12s %14s %9s %9s %9s\n", "op", "count", "bytes", "avg", "p50", "p99");
+  for (int op = 0; op < BLOCK_OP_COUNT; op++)
+  {
+    uint64_t timed = 0;
+    char avg[16] = "-", p50[16] = "-", p99[16] = "-";
+    char bytes[24] = "-";
+
+    for (int b = 0; b < BLOCK_LAT_BUCKETS; b++)
+      timed += st.lat[op][b];
+    if (timed)
+    {
+      fmt_ns(avg, sizeof(avg), (double)st.lat_ns[op] / (double)timed);
+      fmt_ns(p50, sizeof(p50), lat_percentile(st.lat[op], timed, 0.50));
+      fmt_ns(p99, sizeof(p99), lat_percentile(st.lat[op], timed, 0.99));
+    }
+    if (op == BLOCK_OP_READ || op == BLOCK_OP_WRITE)
+    {
+      snprintf(bytes, sizeof(bytes), "%llu", (unsigned long long)
+               (op == BLOCK_OP_READ ? st.bytes_read : st.bytes_written));
+    }
+    printf("%-6s %12llu %14s %9s %9s %9s\n", block_op_name(op),
+           (unsigned long long)st.ops[op], bytes, avg, p50, p99);
+  }
+
+  uint64_t lookups = st.cache_hits + st.cache_misses;
+  printf("cache: %llu hits, %llu misses", (unsigned long long)st.cache_hits,
+         (unsigned long long)st.cache_misses);
+  if (lookups)
+    printf(" (%.1f%% hit)", 100.0 * (double)st.cache_hits / (double)lookups);
+  printf(", engine %s\n", block_io_engine());
+  printf("alloc failed: %llu\n", (unsigned long long)st.alloc_failed);
+
+  /* histograms: one bar per non-empty bucket, scaled to the fullest */
+  for (int op = 0; op < BLOCK_OP_COUNT; op++)
+  {
+    uint64_t max = 0;
+    for (int b = 0; b < BLOCK_LAT_BUCKETS; b++)
+      if (st.lat[op][b] > max) max = st.lat[op][b];
+    if (!max) continue;
+
+    printf("%s latency:\n", block_op_name(op));
+    for (int b = 0; b < BLOCK_LAT_BUCKETS; b++)
+    {
+      char lo[16], hi[16];
+      int bar;
+
+      if (!st.lat[op][b]) continue;
+      fmt_ns(lo, sizeof(lo), (double)((uint64_t)1 << b));
+      fmt_ns(hi, sizeof(hi), (double)((uint64_t)2 << b));
+      bar = (int)((st.lat[op][b] * 40 + max - 1) / max);
+      printf("  %8s - %-8s %10llu %.*s\n", lo,
+             b == BLOCK_LAT_BUCKETS - 1 ? "" : hi, (unsigned long long)st.lat[op][b],
+             bar, "########################################");
+    }
+  }
+}
+
 void run_shell(void)
 { 
   int is_sudo=0;
@@ -79,6 +210,9 @@ void run_shell(void)
   {
     char cwd[256];
 
+    /* only open files hold an inode across the prompt, pinned */
+    fs_icache_trim();
+
     if (vfs_get_cwd(cwd, sizeof(cwd)) != 0)
     {
       snprintf(cwd, sizeof(cwd), "?");
@@ -191,6 +325,10 @@ void run_shell(void)
       {
         printf("mkdir ok: %s\n", pathbuf);
       }
+      else if (fs_inodes_free() == 0)
+      {
+        printf("mkdir failed: %s: no free inodes\n", pathbuf);
+      }
       else
       {
         printf("mkdir failed: %s\n", pathbuf);
@@ -240,6 +378,136 @@ void run_shell(void)
     if (strcmp(buf, "df")==0)
     {
       printf("Total=%zu Used=%zu Free=%zu\n", block_total_size(), block_used_size(), block_free_size());
+      printf("Inodes free=%zu\n", fs_inodes_free());
+      if (block_compressed())
+      {
+        printf("Compressed: Stored=%zu of %zu\n", block_stored_size(), block_phys_size());
+      }
+      if (block_dedup())
+      {
+        printf("Dedup: Saved=%zu\n", block_dedup_saved() * block_size());
+      }
+      SUDO_RESTORE(is_sudo, old_uid, old_gid);
+      continue;
+    }
+    /* scrub [threads] */
+    if (strcmp(buf, "scrub") == 0 || strncmp(buf, "scrub ", 6) == 0)
+    {
+      unsigned threads = 0;
+      if (buf[5] == ' ')
+      {
+        threads = (unsigned)strtoul(buf + 6, NULL, 10);
+      }
+
+      if (!block_checksums())
+      {
+        printf("scrub: image has no checksums\n");
+        SUDO_RESTORE(is_sudo, old_uid, old_gid);
+        continue;
+      }
+
+      struct block_scrub_report rep;
+      block_scrub(threads, &rep);
+
+      double mb = (double)rep.checked * (double)block_size() / (1024.0 * 1024.0);
+      printf("scrub: %zu blocks checked, %zu skipped (unsaved), %zu errors\n",
+             rep.checked, rep.skipped, rep.errors);
+      printf("scrub: %u threads, %.3f s, %.1f MB/s\n", rep.threads, rep.seconds,
+             rep.seconds > 0 ? mb / rep.seconds : 0.0);
+      for (size_t i = 0; i < rep.errors && i < BLOCK_SCRUB_BAD_MAX; i++)
+      {
+        printf("scrub: bad block %d\n", rep.bad[i]);
+      }
+      SUDO_RESTORE(is_sudo, old_uid, old_gid);
+      continue;
+    }
+    /* iostat [-j] | iostat reset */
+    if (strcmp(buf, "iostat") == 0 || strncmp(buf, "iostat ", 7) == 0)
+    {
+      const char *arg = buf + 6;
+      while (*arg == ' ' || *arg == '\t') arg++;
+
+      if (*arg == '\0' || strcmp(arg, "-j") == 0)
+      {
+        print_iostat(*arg != '\0');
+      }
+      else if (strcmp(arg, "reset") == 0)
+      {
+        block_stats_reset();
+        printf("iostat reset\n");
+      }
+      else
+      {
+        printf("iostat: usage: iostat [-j] | iostat reset\n");
+      }
+      SUDO_RESTORE(is_sudo, old_uid, old_gid);
+      continue;
+    }
+    /* snapshot list | snapshot create|rollback|delete <name> */
+    if (strcmp(buf, "snapshot") == 0 || strncmp(buf, "snapshot ", 9) == 0)
+    {
+      char op[16] = "";
+      char name[META_SNAP_NAME + 1] = "";
+      int n = sscanf(buf + 8, "%15s %32s", op, name);
+
+      if (n >= 1 && strcmp(op, "list") == 0)
+      {
+        for (int i = 0; i < meta_snapshot_count(); i++)
+        {
+          struct meta_snapshot sn;
+          char time_str[32];
+          time_t t;
+
+          meta_snapshot_get(i, &sn);
+          t = (time_t)sn.created;
+          strftime(time_str, sizeof(time_str), "%b %d %H:%M", localtime(&t));
+          printf("%-24s %s %6u entries %8u blocks\n", sn.name, time_str, sn.entries, sn.blocks);
+        }
+        SUDO_RESTORE(is_sudo, old_uid, old_gid);
+        continue;
+      }
+      if (n != 2 || (strcmp(op, "create") != 0 && strcmp(op, "rollback") != 0 &&
+                     strcmp(op, "delete") != 0))
+      {
+        printf("snapshot: usage: snapshot list | snapshot create|rollback|delete <name>\n");
+        SUDO_RESTORE(is_sudo, old_uid, old_gid);
+        continue;
+      }
+      if (fs_get_uid() != 0)
+      {
+        printf("snapshot: permission denied\n");
+        SUDO_RESTORE(is_sudo, old_uid, old_gid);
+        continue;
+      }
+      if (strcmp(op, "create") == 0 && !block_refcounts())
+      {
+        printf("snapshot: image has no reference counts (format with -R, or -D for dedup)\n");
+        SUDO_RESTORE(is_sudo, old_uid, old_gid);
+        continue;
+      }
+
+      int rc;
+      if (strcmp(op, "create") == 0)
+      {
+        rc = meta_snapshot_create(name);
+      }
+      else if (strcmp(op, "rollback") == 0)
+      {
+        rc = meta_snapshot_rollback(name);
+      }
+      else
+      {
+        rc = meta_snapshot_delete(name);
+      }
+
+      if (rc == 0)
+      {
+        printf("snapshot %s ok: %s\n", op, name);
+      }
+      else
+      {
+        printf("snapshot %s failed: %s\n", op, name);
+      }
       SUDO_RESTORE(is_sudo, old_uid, old_gid);
       continue;
     }
@@ -341,6 +609,10 @@ void run_shell(void)
       {
         printf("touch ok: %s\n", pathbuf);
       }
+      else if (fs_inodes_free() == 0)
+      {
+        printf("touch failed: %s: no free inodes\n", pathbuf);
+      }
       else
       {
         printf("touch failed: %s\n", pathbuf);
@@ -484,6 +756,166 @@ void run_shell(void)
       continue;
     }
 
+    /* pwrite <path> <offset> <text...> | append <path> <text...> */
+    if (strncmp(buf, "pwrite ", 7) == 0 || strncmp(buf, "append ", 7) == 0)
+    {
+      int append = buf[0] == 'a';
+      const char *cmd = append ? "append" : "pwrite";
+      char *arg  = buf + 7;
+      char pathbuf[256];
+      char *path;
+      size_t offset = VFS_APPEND;
+
+      while (*arg == ' ' || *arg == '\t')
+      {
+        arg++;
+      }
+      path = arg;
+      while (*arg && *arg != ' ' && *arg != '\t')
+      {
+        arg++;
+      }
+      if (*path == '\0' || *arg == '\0')
+      {
+        printf("%s: path and data required\n", cmd);
+        SUDO_RESTORE(is_sudo, old_uid, old_gid);
+        continue;
+      }
+      *arg++ = '\0';
+
+      while (*arg == ' ' || *arg == '\t')
+      {
+        arg++;
+      }
+      if (!append)
+      {
+        char *endp;
+        offset = (size_t)strtoull(arg, &endp, 10);
+        if (endp == arg || (*endp != ' ' && *endp != '\t'))
+        {
+          printf("pwrite: offset and data required\n");
+          SUDO_RESTORE(is_sudo, old_uid, old_gid);
+          continue;
+        }
+        arg = endp + 1;
+      }
+
+      strncpy(pathbuf, path, sizeof(pathbuf) - 1);
+      pathbuf[sizeof(pathbuf) - 1] = '\0';
+
+      trim(pathbuf);
+      remove_multiple_slashes(pathbuf);
+      rstrip_slash(pathbuf);
+
+      if (vfs_pwrite(pathbuf, arg, strlen(arg), offset) == 0)
+      {
+        printf("%s ok: %s\n", cmd, pathbuf);
+      }
+      else
+      {
+        printf("%s failed: %s\n", cmd, pathbuf);
+      }
+      SUDO_RESTORE(is_sudo, old_uid, old_gid);
+      continue;
+    }
+
+    /* open <path> [mode] | read <fd> [n] | fwrite <fd> <text...> | close <fd> */
+    if (strncmp(buf, "open ", 5) == 0)
+    {
+      char pathbuf[256];
+      char mode[4] = "r";
+      char *arg = buf + 5;
+
+      while (*arg == ' ' || *arg == '\t')
+      {
+        arg++;
+      }
+      char *path = arg;
+      while (*arg && *arg != ' ' && *arg != '\t')
+      {
+        arg++;
+      }
+      if (*arg)
+      {
+        *arg++ = '\0';
+        while (*arg == ' ' || *arg == '\t')
+        {
+          arg++;
+        }
+        if (*arg)
+        {
+          strncpy(mode, arg, sizeof(mode) - 1);
+          mode[sizeof(mode) - 1] = '\0';
+        }
+      }
+
+      strncpy(pathbuf, path, sizeof(pathbuf) - 1);
+      pathbuf[sizeof(pathbuf) - 1] = '\0';
+      trim(pathbuf);
+      remove_multiple_slashes(pathbuf);
+      rstrip_slash(pathbuf);
+      trim(mode);
+
+      int fd = vfs_open(pathbuf, mode);
+      if (fd >= 0) printf("fd %d\n", fd);
+      else printf("open failed: %s\n", pathbuf);
+      SUDO_RESTORE(is_sudo, old_uid, old_gid);
+      continue;
+    }
+
+    if (strncmp(buf, "read ", 5) == 0)
+    {
+      char *endp;
+      int fd = (int)strtol(buf + 5, &endp, 10);
+      size_t want = (size_t)strtoul(endp, NULL, 10);
+      char data[CMD_BUF];
+
+      if (want == 0 || want > sizeof(data))
+      {
+        want = sizeof(data);
+      }
+      size_t got = vfs_read(fd, data, want);
+      fwrite(data, 1, got, stdout);
+      printf("\n");
+      SUDO_RESTORE(is_sudo, old_uid, old_gid);
+      continue;
+    }
+
+    if (strncmp(buf, "fwrite ", 7) == 0)
+    {
+      char *endp;
+      int fd = (int)strtol(buf + 7, &endp, 10);
+
+      if (endp == buf + 7 || (*endp != ' ' && *endp != '\t'))
+      {
+        printf("fwrite: fd and data required\n");
+        SUDO_RESTORE(is_sudo, old_uid, old_gid);
+        continue;
+      }
+      endp++;
+      if (vfs_write(fd, endp, strlen(endp)) == strlen(endp) && *endp)
+      {
+        printf("fwrite ok: fd %d\n", fd);
+      }
+      else
+      {
+        printf("fwrite failed: fd %d\n", fd);
+      }
+      SUDO_RESTORE(is_sudo, old_uid, old_gid);
+      continue;
+    }
+
+    if (strncmp(buf, "close ", 6) == 0)
+    {
+      int fd = (int)strtol(buf + 6, NULL, 10);
+      if (vfs_close(fd) != 0)
+      {
+        printf("close failed: fd %d\n", fd);
+      }
+      SUDO_RESTORE(is_sudo, old_uid, old_gid);
+      continue;
+    }
+
     /* cat <path> */
     if (strncmp(buf, "cat ", 4) == 0)
     {